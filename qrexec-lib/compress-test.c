@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "Compression test program does not work without assertions."
+#endif
+#include <assert.h>
+
+#define BLOCK_MAX 65536
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+static unsigned char in[BLOCK_MAX], out[BLOCK_MAX];
+static unsigned char comp[COMPRESS_BOUND(BLOCK_MAX)];
+
+static size_t round_trip(const char *what, size_t len)
+{
+    size_t comp_len = compress_block(in, len, comp, sizeof(comp));
+    long got;
+
+    if (comp_len == 0) {
+        fprintf(stderr, "BUG: %s: %zu bytes did not fit in the bound\n", what, len);
+        abort();
+    }
+    got = decompress_block(comp, comp_len, out, len);
+    if (got < 0 || (size_t)got != len || memcmp(in, out, len)) {
+        fprintf(stderr, "BUG: %s: round trip of %zu bytes failed\n", what, len);
+        abort();
+    }
+    /* an output buffer one byte too small must be detected */
+    if (len > 0)
+        assert(decompress_block(comp, comp_len, out, len - 1) < 0);
+    return comp_len;
+}
+
+static void fill(const char *kind, size_t len)
+{
+    static const char words[][8] = { "qubes", "file", "copy ", "\n", "dom0", "vm " };
+
+    for (size_t i = 0; i < len; i++) {
+        if (!strcmp(kind, "zeros"))
+            in[i] = 0;
+        else if (!strcmp(kind, "random"))
+            in[i] = rng();
+        else if (!strcmp(kind, "period3"))
+            in[i] = "abc"[i % 3];
+        else {
+            const char *w = words[rng() % 6];
+            for (; *w && i < len; w++)
+                in[i++] = *w;
+            i--;
+        }
+    }
+}
+
+/* corrupted blocks must be rejected or decoded within bounds */
+static void check_corruption(size_t len)
+{
+    size_t comp_len;
+    long got;
+
+    fill("text", len);
+    comp_len = compress_block(in, len, comp, sizeof(comp));
+    assert(comp_len > 0);
+    for (int i = 0; i < 2000; i++) {
+        unsigned char bad[COMPRESS_BOUND(BLOCK_MAX)];
+        size_t bad_len = comp_len;
+
+        memcpy(bad, comp, comp_len);
+        if (i % 4 == 0)
+            bad_len = rng() % comp_len;
+        else
+            bad[rng() % comp_len] ^= 1 << (rng() % 8);
+        got = decompress_block(bad, bad_len, out, len);
+        assert(got >= -1 && got <= (long)len);
+    }
+}
+
+/*
+ * Arbitrary input must never be decoded past dstlen: the output is followed
+ * by a guard area that has to stay untouched.
+ */
+static void check_random_input(void)
+{
+    static unsigned char bad[512], dst[1024 + 64];
+
+    for (int i = 0; i < 200000; i++) {
+        size_t bad_len = rng() % sizeof(bad), dstlen = rng() % 1024;
+        long got;
+
+        for (size_t j = 0; j < bad_len; j++) {
+            /* mostly small lengths and offsets, so that some blocks decode */
+            bad[j] = rng() % 4 ? rng() % 32 : rng();
+        }
+        memset(dst + dstlen, 0xa5, 64);
+        got = decompress_block(bad, bad_len, dst, dstlen);
+        assert(got >= -1 && got <= (long)dstlen);
+        for (size_t j = dstlen; j < dstlen + 64; j++)
+            assert(dst[j] == 0xa5);
+    }
+}
+
+int main(void)
+{
+    static const char *const kinds[] = { "zeros", "random", "period3", "text" };
+    static const size_t lens[] = { 0, 1, 4, 12, 13, 14, 15, 16, 255, 256, 270, 4095, 65535, 65536 };
+    /* hand-made blocks: invalid offsets, lengths running off the end */
+    static const struct {
+        const char *what;
+        unsigned char data[8];
+        size_t len;
+        long expected;
+    } blocks[] = {
+        { "truncated token", { 0x1f, 'a', 0x01, 0x00 }, 4, -1 },
+        { "truncated match length", { 0x1f, 'a', 0x01, 0x00, 0xff }, 5, -1 },
+        { "match after the last literals", { 0x10, 'a', 0x01, 0x00 }, 4, -1 },
+        { "later offset before start", { 0x20, 'a', 'b', 0x02, 0x00, 0x10, 'c', 0x04 }, 8, -1 },
+        { "overlong literal run", { 0xf0, 0x00, 'a', 'b' }, 4, -1 },
+        { "literal length overflow", { 0xf0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 }, 8, -1 },
+        { "empty", { 0x00 }, 1, 0 },
+        { "literals", { 0x30, 'a', 'b', 'c' }, 4, 3 },
+        { "match", { 0x10, 'a', 0x01, 0x00, 0x10, 'b' }, 6, 6 },
+        { "no input", { 0 }, 0, -1 },
+        { "offset 0", { 0x10, 'a', 0x00, 0x00, 0x00 }, 5, -1 },
+        { "offset before start", { 0x10, 'a', 0x02, 0x00, 0x00 }, 5, -1 },
+        { "truncated literals", { 0x40, 'a', 'b' }, 3, -1 },
+        { "truncated length", { 0xf0, 0xff }, 2, -1 },
+        { "truncated offset", { 0x10, 'a', 0x01 }, 3, -1 },
+    };
+
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        long got = decompress_block(blocks[i].data, blocks[i].len, out, sizeof(out));
+        if (got != blocks[i].expected) {
+            fprintf(stderr, "BUG: %s: got %ld, expected %ld\n",
+                    blocks[i].what, got, blocks[i].expected);
+            abort();
+        }
+    }
+    assert(!memcmp(out, "aaaaab", 6));
+
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        size_t total = 0, total_comp = 0;
+        for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+            fill(kinds[k], lens[i]);
+            total += lens[i];
+            total_comp += round_trip(kinds[k], lens[i]);
+        }
+        printf("%s: OK (%zu -> %zu bytes)\n", kinds[k], total, total_comp);
+    }
+    /* too large for 16-bit offsets */
+    assert(compress_block(in, BLOCK_MAX + 1, comp, sizeof(comp)) == 0);
+    /* too small an output buffer */
+    fill("random", 1000);
+    assert(compress_block(in, 1000, comp, 500) == 0);
+
+    check_corruption(300);
+    check_corruption(BLOCK_MAX);
+    check_random_input();
+    printf("corruption: OK\n");
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/*
+ * A block is a sequence of (literals, match) pairs, each starting with a
+ * token: literal length in the high nibble and match length - MIN_MATCH in
+ * the low one, with 15 meaning that more length bytes follow.  The last
+ * sequence has only literals.  The compressor follows the LZ4 rules for
+ * the end of a block (no match in the last MF_LIMIT bytes), so its output
+ * can be read by any LZ4 decoder; the decoder does not rely on them.
+ */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* number of equal bytes at a and b, stopping at limit (which bounds a) */
+static size_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit)
+{
+    const uint8_t *start = a;
+    uint64_t diff;
+
+    while (limit - a >= 8) {
+        diff = read64(a) ^ read64(b);
+        if (diff) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return a - start + (__builtin_ctzll(diff) >> 3);
+#else
+            return a - start + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+static unsigned hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/* output bytes needed for a sequence, at most */
+static size_t sequence_size(size_t literals)
+{
+    return 1 + literals / 255 + 1 + literals + 2 + 8;
+}
+
+size_t compress_block(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+    const uint8_t *const base = src, *const end = base + srclen;
+    const uint8_t *ip = base, *anchor = base, *ref;
+    uint8_t *op = dst, *const oend = op + dstlen;
+    uint16_t table[1 << HASH_LOG];
+    size_t literals, len;
+    unsigned h;
+
+    if (srclen > MAX_OFFSET + 1)
+        return 0;
+    memset(table, 0, sizeof(table));
+    if (srclen > MF_LIMIT) {
+        const uint8_t *const mf_limit = end - MF_LIMIT;
+        const uint8_t *const match_limit = end - LAST_LITERALS;
+
+        ip++;
+        while (ip < mf_limit) {
+            h = hash32(read32(ip));
+            ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || read32(ref) != read32(ip)) {
+                /* move faster through data that does not compress */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            len = MIN_MATCH + match_length(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            literals = ip - anchor;
+            if ((size_t)(oend - op) < sequence_size(literals) + len / 255)
+                return 0;
+            *op = (literals >= 15 ? 15 << 4 : literals << 4) |
+                  (len - MIN_MATCH >= 15 ? 15 : len - MIN_MATCH);
+            op++;
+            if (literals >= 15)
+                op = put_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if (len - MIN_MATCH >= 15)
+                op = put_length(op, len - MIN_MATCH - 15);
+
+            ip += len;
+            anchor = ip;
+            if (ip < mf_limit)
+                table[hash32(read32(ip - 2))] = ip - 2 - base;
+        }
+    }
+
+    literals = end - anchor;
+    if ((size_t)(oend - op) < sequence_size(literals))
+        return 0;
+    *op++ = literals >= 15 ? 15 << 4 : literals << 4;
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - (uint8_t *)dst;
+}
+
+/* read an extended length; *len is bounded by limit or the call fails */
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len, size_t limit)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= end)
+            return 0;
+        b = *(*ip)++;
+        *len += b;
+        if (*len > limit)
+            return 0;
+    } while (b == 255);
+    return 1;
+}
+
+long decompress_block(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+    const uint8_t *ip = src, *const end = ip + srclen;
+    uint8_t *op = dst, *const oend = op + dstlen;
+    size_t literals, len, offset;
+    uint8_t token;
+
+    for (;;) {
+        if (ip >= end)
+            return -1;
+        token = *ip++;
+
+        literals = token >> 4;
+        if (literals == 15 && !get_length(&ip, end, &literals, dstlen))
+            return -1;
+        if (literals > (size_t)(end - ip) || literals > (size_t)(oend - op))
+            return -1;
+        /* short runs are the common case: copy a fixed 16 bytes if there is room */
+        if (end - ip >= 16 && oend - op >= 16 && literals <= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            break;  /* the last sequence has no match */
+
+        if (end - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+            return -1;
+        len = token & 15;
+        if (len == 15 && !get_length(&ip, end, &len, dstlen))
+            return -1;
+        len += MIN_MATCH;
+        if (len > (size_t)(oend - op))
+            return -1;
+        if (offset >= 8 && (size_t)(oend - op) >= len + 8) {
+            /* 8 bytes at a time, each chunk is complete before it is read */
+            const uint8_t *ref = op - offset;
+            uint8_t *const match_end = op + len;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < match_end);
+            op = match_end;
+        } else if (offset >= len) {
+            memcpy(op, op - offset, len);
+            op += len;
+        } else {
+            /* the match overlaps its own output, so copy forwards */
+            for (const uint8_t *ref = op - offset; len > 0; len--)
+                *op++ = *ref++;
+        }
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,24 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stddef.h>
+
+/*
+ * Block compression for QFILE_FEATURE_COMPRESS frames, in the LZ4 block
+ * format.  Blocks are at most QFILE_FRAME_MAX bytes, so the 16-bit match
+ * offsets can reach anywhere in the block and neither side keeps any
+ * state between blocks.
+ */
+
+/* room needed for the compressed form of len bytes */
+#define COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* returns the compressed size, or 0 if it would not fit in dstlen */
+size_t compress_block(const void *src, size_t srclen, void *dst, size_t dstlen);
+/*
+ * Decompress untrusted data.  Never writes more than dstlen bytes or reads
+ * past srclen; returns the decompressed size or -1 if the input is invalid.
+ */
+long decompress_block(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+#endif /* _COMPRESS_H */
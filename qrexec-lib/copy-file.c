@@ -1,7 +1,15 @@
+#define _GNU_SOURCE /* For splice(2) and tee(2). */
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include "ioall.h"
 #include "libqubes-rpc-filecopy.h"
 #include "crc32.h"
+#include "digest.h"
+#include "progress.h"
+#include "stats.h"
 
 notify_progress_t *notify_progress_func = NULL;
 void register_notify_progress(notify_progress_t *func)
@@ -9,34 +17,255 @@ void register_notify_progress(notify_progress_t *func)
     notify_progress_func = func;
 }
 
-int copy_file(int outfd, int infd, long long size, unsigned long *crc32)
+/*
+ * Transfer buffer of copy_file() and copy_fd_all(), kept between the calls
+ * of each thread.  It is sized for each copy between io_buf_min and
+ * io_buf_max, so big files need fewer syscalls and small ones do not cost a
+ * big allocation.
+ */
+/* reads and writes of more than INT_MAX bytes do not fit write_all() */
+#define IO_BUF_LIMIT (1 << 30)
+static size_t io_buf_min = 64 * 1024;
+static size_t io_buf_max = 4 * 1024 * 1024;
+static _Thread_local char *io_buf;
+static _Thread_local size_t io_buf_size;
+/* requested capacity of stdin/stdout pipes, 0 - leave as is */
+static int pipe_size;
+
+void set_io_buffer_size(size_t min, size_t max)
 {
-    char buf[4096];
+    io_buf_min = min ? min : 1;
+    if (io_buf_min > IO_BUF_LIMIT)
+        io_buf_min = IO_BUF_LIMIT;
+    io_buf_max = max > io_buf_min ? max : io_buf_min;
+    if (io_buf_max > IO_BUF_LIMIT)
+        io_buf_max = IO_BUF_LIMIT;
+    release_io_buffer();
+}
+
+void release_io_buffer(void)
+{
+    free(io_buf);
+    io_buf = NULL;
+    io_buf_size = 0;
+}
+
+char *get_io_buffer(long long want, size_t *len)
+{
+    size_t size;
+
+    if (want > (long long)io_buf_max)
+        size = io_buf_max;
+    else if (want < (long long)io_buf_min)
+        size = io_buf_min;
+    else
+        size = (want + 4095) & ~(size_t)4095;
+    if (size > io_buf_size) {
+        char *buf = malloc(size);
+        if (buf) {
+            free(io_buf);
+            io_buf = buf;
+            io_buf_size = size;
+        }
+    }
+    if (!io_buf)
+        return NULL;
+    /* a bigger buffer from an earlier copy is fine too */
+    *len = io_buf_size;
+    return io_buf;
+}
+
+void set_pipe_size(int bytes)
+{
+    pipe_size = bytes;
+}
+
+void tune_pipe_size(int fd)
+{
+    struct stat st;
+
+    if (pipe_size <= 0 || fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+        return;
+    /* best effort: unprivileged callers are limited by fs.pipe-max-size */
+    if (fcntl(fd, F_GETPIPE_SZ) < pipe_size)
+        fcntl(fd, F_SETPIPE_SZ, pipe_size);
+}
+
+int copy_file_hash(int outfd, int infd, long long size, unsigned long *crc32,
+                   struct digest *digest)
+{
+    char fallback[4096];
+    char *buf;
+    size_t buf_size;
     long long written = 0;
-    int ret;
-    int count;
+    ssize_t ret;
+    size_t count;
+    uint64_t t;
+
+    buf = get_io_buffer(size, &buf_size);
+    if (!buf) {
+        buf = fallback;
+        buf_size = sizeof(fallback);
+    }
     while (written < size) {
-        if (size - written > (int)sizeof(buf))
-            count = sizeof buf;
+        if (size - written > (long long)buf_size)
+            count = buf_size;
         else
             count = size - written;
+        t = stats_begin();
         ret = read(infd, buf, count);
+        stats_end(QFILE_STAT_READ, t, ret > 0 ? ret : 0);
         if (!ret)
             return COPY_FILE_READ_EOF;
         if (ret < 0)
             return COPY_FILE_READ_ERROR;
-        /* acumulate crc32 if requested */
+        /* accumulate crc32 if requested */
         if (crc32)
             *crc32 = Crc32_ComputeBuf(*crc32, buf, ret);
+        if (digest)
+            digest_update(digest, buf, ret);
         if (!write_all(outfd, buf, ret))
             return COPY_FILE_WRITE_ERROR;
-        if (notify_progress_func != NULL)
-            notify_progress_func(ret, 0);
+        progress_add(ret);
         written += ret;
     }
     return COPY_FILE_OK;
 }
 
+int copy_file(int outfd, int infd, long long size, unsigned long *crc32)
+{
+    return copy_file_hash(outfd, infd, size, crc32, NULL);
+}
+
+/*
+ * splice() state: splice_broken is set for the rest of the thread once
+ * splicing turns out not to work, so the fallback costs a single failed
+ * syscall.  crc_pipe receives a tee()d copy of the data for the CRC (and
+ * the digest), which is read back into userspace: the data is still copied
+ * once there, as with read()/write(), and only the copy out to the file is
+ * saved.
+ */
+static int use_splice = 0;
+static _Thread_local int splice_broken;
+static _Thread_local int crc_pipe[2] = { -1, -1 };
+
+void set_use_splice(int value)
+{
+    use_splice = value;
+}
+
+void release_splice_pipe(void)
+{
+    if (crc_pipe[0] < 0)
+        return;
+    close(crc_pipe[0]);
+    close(crc_pipe[1]);
+    crc_pipe[0] = crc_pipe[1] = -1;
+}
+
+static int open_crc_pipe(int infd)
+{
+    int size;
+
+    if (crc_pipe[0] >= 0)
+        return 1;
+    if (pipe2(crc_pipe, O_CLOEXEC))
+        return 0;
+    /* tee() cannot duplicate more than fits in the destination pipe */
+    size = fcntl(infd, F_GETPIPE_SZ);
+    if (size > 0)
+        fcntl(crc_pipe[1], F_SETPIPE_SZ, size);
+    return 1;
+}
+
+/* discard data tee()d into crc_pipe that will not be spliced after all */
+static int drain_crc_pipe(ssize_t len)
+{
+    char buf[4096];
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = read(crc_pipe[0], buf, len > (ssize_t)sizeof(buf) ? (ssize_t)sizeof(buf) : len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 0;
+        len -= ret;
+    }
+    return 1;
+}
+
+int copy_file_splice_hash(int outfd, int infd, long long size, unsigned long *crc32,
+                          struct digest *digest)
+{
+    char buf[65536];
+    long long written = 0;
+    ssize_t teed, moved, ret;
+    uint64_t t;
+
+    while (written < size) {
+        if (!use_splice || splice_broken || !open_crc_pipe(infd))
+            break;
+        t = stats_begin();
+        teed = tee(infd, crc_pipe[1], size - written, 0);
+        stats_end(QFILE_STAT_READ, t, teed > 0 ? teed : 0);
+        if (teed == -1 && errno == EINTR)
+            continue;
+        if (teed == 0)
+            return COPY_FILE_READ_EOF;
+        if (teed < 0) {
+            /* EINVAL: infd is not a pipe; EAGAIN: nonblocking and empty */
+            if (errno != EAGAIN)
+                splice_broken = 1;
+            break;
+        }
+        /* teed bytes are already buffered in infd, so this cannot block on input */
+        for (moved = 0; moved < teed; moved += ret) {
+            t = stats_begin();
+            ret = splice(infd, NULL, outfd, NULL, teed - moved, SPLICE_F_MOVE);
+            stats_end(QFILE_STAT_WRITE, t, ret > 0 ? ret : 0);
+            if (ret == -1 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (ret > 0)
+                continue;
+            if (ret < 0 && moved == 0 && errno == EINVAL) {
+                /* filesystem cannot splice; nothing consumed yet */
+                splice_broken = 1;
+                if (!drain_crc_pipe(teed))
+                    return COPY_FILE_READ_ERROR;
+                goto fallback;
+            }
+            return COPY_FILE_WRITE_ERROR;
+        }
+        /* accumulate crc32 from the duplicated data */
+        for (moved = 0; moved < teed; moved += ret) {
+            ret = read(crc_pipe[0], buf,
+                    teed - moved > (ssize_t)sizeof(buf) ? (ssize_t)sizeof(buf) : teed - moved);
+            if (ret == -1 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (ret <= 0)
+                return COPY_FILE_READ_ERROR;
+            if (crc32)
+                *crc32 = Crc32_ComputeBuf(*crc32, buf, ret);
+            if (digest)
+                digest_update(digest, buf, ret);
+        }
+        progress_add(teed);
+        written += teed;
+    }
+fallback:
+    return copy_file_hash(outfd, infd, size - written, crc32, digest);
+}
+
+int copy_file_splice(int outfd, int infd, long long size, unsigned long *crc32)
+{
+    return copy_file_splice_hash(outfd, infd, size, crc32, NULL);
+}
+
 const char * copy_file_status_to_str(int status)
 {
     switch (status) {
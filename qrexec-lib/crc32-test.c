@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "CRC-32 test program does not work without assertions."
+#endif
+#include <assert.h>
+
+/* the original byte-at-a-time implementation is the reference */
+static const struct crc32_impl *reference_impl(void)
+{
+    const struct crc32_impl *impl;
+    for (impl = crc32_impls; impl->name; impl++)
+        if (!strcmp(impl->name, "table"))
+            return impl;
+    abort();
+}
+
+static void check_impl(const struct crc32_impl *ref, const struct crc32_impl *impl,
+                       const unsigned char *buf, size_t size)
+{
+    /* every length and alignment around the block sizes of the kernels */
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t len = 0; len + offset <= size; len += (len < 300 ? 1 : 97)) {
+            unsigned long expected = crc32_compute_with(ref, 0, buf + offset, len);
+            unsigned long got = crc32_compute_with(impl, 0, buf + offset, len);
+            if (got != expected) {
+                fprintf(stderr, "BUG: %s: crc of %zu bytes at offset %zu is %08lx, expected %08lx\n",
+                        impl->name, len, offset, got, expected);
+                abort();
+            }
+            /* accumulated in two parts, as copy_file() does */
+            got = crc32_compute_with(impl, crc32_compute_with(impl, 0, buf + offset, len / 3),
+                                     buf + offset + len / 3, len - len / 3);
+            assert(got == expected);
+        }
+    }
+}
+
+int main(void)
+{
+    static unsigned char buf[8192];
+    const struct crc32_impl *ref = reference_impl(), *impl;
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+
+    /* standard check value */
+    assert(Crc32_ComputeBuf(0, "123456789", 9) == 0xCBF43926);
+    assert(crc32_compute_with(ref, 0, "123456789", 9) == 0xCBF43926);
+
+    for (impl = crc32_impls; impl->name; impl++) {
+        if (!impl->supported()) {
+            printf("%s: not supported on this CPU, skipped\n", impl->name);
+            continue;
+        }
+        check_impl(ref, impl, buf, sizeof(buf));
+        printf("%s: OK\n", impl->name);
+    }
+    assert(Crc32_ComputeBuf(0, buf, sizeof(buf)) ==
+           crc32_compute_with(ref, 0, buf, sizeof(buf)));
+    return 0;
+}
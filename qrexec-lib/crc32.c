@@ -17,40 +17,29 @@
  *  v1.0.3: replaced CRC constant table by generator function.
  *  v1.0.4: reformatted code, made ANSI C.  1994-12-05.
  *  v2.0.0: rewrote to use memory buffer & static table, 2006-04-29.
+ *
+ *  Qubes: added slice-by-8/16 and carry-less multiply implementations,
+ *  selected at load time according to the CPU features.
 \*----------------------------------------------------------------------------*/
 
-#include <stdio.h>
-#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "crc32.h"
+#include "stats.h"
 
-/*----------------------------------------------------------------------------*\
- *  Local functions
-\*----------------------------------------------------------------------------*/
-
-unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
-                                       size_t bufLen );
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 /*----------------------------------------------------------------------------*\
- *  NAME:
- *     Crc32_ComputeBuf() - computes the CRC-32 value of a memory buffer
- *  DESCRIPTION:
- *     Computes or accumulates the CRC-32 value for a memory buffer.
- *     The 'inCrc32' gives a previously accumulated CRC-32 value to allow
- *     a CRC to be generated for multiple sequential buffer-fuls of data.
- *     The 'inCrc32' for the first buffer must be zero.
- *  ARGUMENTS:
- *     inCrc32 - accumulated CRC-32 value, must be 0 on first call
- *     buf     - buffer to compute CRC-32 value for
- *     bufLen  - number of bytes in buffer
- *  RETURNS:
- *     crc32 - computed CRC-32 value
- *  ERRORS:
- *     (no errors are possible)
+ *  Local functions
 \*----------------------------------------------------------------------------*/
 
-unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
-                                       size_t bufLen )
-{
-    static const unsigned long crcTable[256] = {
+static const uint32_t crcTable[256] = {
    0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,
    0x9E6495A3,0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,
    0xE7B82D07,0x90BF1D91,0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,
@@ -88,17 +77,272 @@ unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
    0x47B2CF7F,0x30B5FFE9,0xBDBDF21C,0xCABAC28A,0x53B39330,0x24B4A3A6,0xBAD03605,
    0xCDD70693,0x54DE5729,0x23D967BF,0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,
    0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D };
-    unsigned long crc32;
-    unsigned char *byteBuf;
+
+/*
+ * crcSlice[k][i] is the CRC of byte i followed by k zero bytes; crcSlice[0]
+ * is crcTable.  Filled in by crc32_init() before main() runs.
+ */
+static uint32_t crcSlice[16][256];
+
+/* all implementations below work on the inverted CRC register */
+static uint32_t crc32_table(uint32_t crc, const unsigned char *p, size_t len)
+{
     size_t i;
 
-    /** accumulate crc32 for buffer **/
-    crc32 = inCrc32 ^ 0xFFFFFFFF;
-    byteBuf = (unsigned char*) buf;
-    for (i=0; i < bufLen; i++) {
-        crc32 = (crc32 >> 8) ^ crcTable[ (crc32 ^ byteBuf[i]) & 0xFF ];
+    for (i = 0; i < len; i++)
+        crc = (crc >> 8) ^ crcTable[(crc ^ p[i]) & 0xFF];
+    return crc;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint32_t crc32_word(const uint32_t (*t)[256], uint32_t lo, uint32_t hi)
+{
+    return t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+           t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+           t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+           t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, p, sizeof(v));
+        crc = crc32_word(crcSlice, (uint32_t)v ^ crc, v >> 32);
+        p += 8;
+        len -= 8;
     }
-    return( crc32 ^ 0xFFFFFFFF );
+    return crc32_table(crc, p, len);
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t v[2];
+
+    while (len >= 16) {
+        memcpy(v, p, sizeof(v));
+        crc = crc32_word(crcSlice + 8, (uint32_t)v[0] ^ crc, v[0] >> 32) ^
+              crc32_word(crcSlice, (uint32_t)v[1], v[1] >> 32);
+        p += 16;
+        len -= 16;
+    }
+    return crc32_slice8(crc, p, len);
+}
+#else
+/* the slicing tables above assume little-endian loads */
+#define crc32_slice8 crc32_table
+#define crc32_slice16 crc32_table
+#endif
+
+#if defined(__x86_64__)
+/*
+ * Fold 64-byte blocks with carry-less multiplication, then Barrett-reduce to
+ * 32 bits, as described in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction".  The constants are the
+ * bit-reflected ones for the CRC-32 polynomial 0x04C11DB7.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    if (len < 64)
+        return crc32_slice16(crc, p, len);
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    p += 64;
+    len -= 64;
+
+    /* fold four 128-bit lanes in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining whole 16-byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc32_slice16(crc, p, len);
+}
+
+static int crc32_pclmul_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#elif defined(__aarch64__)
+/*
+ * The ARMv8 CRC32 extension implements exactly this polynomial, 8 bytes per
+ * instruction, so there is no need for the PMULL folding used on x86.
+ */
+#pragma GCC push_options
+#pragma GCC target("arch=armv8-a+crc")
+#include <arm_acle.h>
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+#pragma GCC pop_options
+
+static int crc32_armv8_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static int crc32_always_supported(void)
+{
+    return 1;
+}
+
+const struct crc32_impl crc32_impls[] = {
+#if defined(__x86_64__)
+    { "pclmul", crc32_pclmul, crc32_pclmul_supported },
+#elif defined(__aarch64__)
+    { "armv8-crc", crc32_armv8, crc32_armv8_supported },
+#endif
+    { "slice16", crc32_slice16, crc32_always_supported },
+    { "slice8", crc32_slice8, crc32_always_supported },
+    { "table", crc32_table, crc32_always_supported },
+    { NULL, NULL, NULL },
+};
+
+/* byte-at-a-time until crc32_init() has picked the fastest one */
+static crc32_fn_t *crc32_best = crc32_table;
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+    const struct crc32_impl *impl;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+        crcSlice[0][i] = crcTable[i];
+    for (k = 1; k < 16; k++)
+        for (i = 0; i < 256; i++)
+            crcSlice[k][i] = (crcSlice[k - 1][i] >> 8) ^
+                crcTable[crcSlice[k - 1][i] & 0xFF];
+
+    /* crc32_impls is sorted fastest first */
+    for (impl = crc32_impls; impl->name; impl++) {
+        if (impl->supported()) {
+            crc32_best = impl->compute;
+            break;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*\
+ *  NAME:
+ *     Crc32_ComputeBuf() - computes the CRC-32 value of a memory buffer
+ *  DESCRIPTION:
+ *     Computes or accumulates the CRC-32 value for a memory buffer.
+ *     The 'inCrc32' gives a previously accumulated CRC-32 value to allow
+ *     a CRC to be generated for multiple sequential buffer-fuls of data.
+ *     The 'inCrc32' for the first buffer must be zero.
+ *  ARGUMENTS:
+ *     inCrc32 - accumulated CRC-32 value, must be 0 on first call
+ *     buf     - buffer to compute CRC-32 value for
+ *     bufLen  - number of bytes in buffer
+ *  RETURNS:
+ *     crc32 - computed CRC-32 value
+ *  ERRORS:
+ *     (no errors are possible)
+\*----------------------------------------------------------------------------*/
+
+unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
+                                       size_t bufLen )
+{
+    uint64_t t = stats_begin();
+    unsigned long crc = crc32_best((uint32_t)inCrc32 ^ 0xFFFFFFFF, buf, bufLen) ^ 0xFFFFFFFF;
+
+    stats_end(QFILE_STAT_CRC, t, bufLen);
+    return crc;
+}
+
+/*
+ * Same as Crc32_ComputeBuf(), but with an explicit implementation, for
+ * testing and benchmarking.
+ */
+unsigned long crc32_compute_with(const struct crc32_impl *impl,
+        unsigned long inCrc32, const void *buf, size_t bufLen)
+{
+    return impl->compute((uint32_t)inCrc32 ^ 0xFFFFFFFF, buf, bufLen) ^ 0xFFFFFFFF;
 }
 
 /*----------------------------------------------------------------------------*\
@@ -1,7 +1,24 @@
 #ifndef _CRC32_H
 #define _CRC32_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 extern unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
         size_t bufLen );
 
+/* CRC-32 kernel working on the inverted CRC register */
+typedef uint32_t (crc32_fn_t)(uint32_t crc, const unsigned char *buf, size_t len);
+
+struct crc32_impl {
+    const char *name;
+    crc32_fn_t *compute;
+    int (*supported)(void);
+};
+
+/* all implementations built for this CPU architecture, terminated by NULL name */
+extern const struct crc32_impl crc32_impls[];
+unsigned long crc32_compute_with(const struct crc32_impl *impl,
+        unsigned long inCrc32, const void *buf, size_t bufLen);
+
 #endif /* _CRC32_H */
@@ -0,0 +1,83 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ctx.h"
+
+_Thread_local struct qfile_ctx *current_ctx;
+
+struct qfile_ctx *qfile_ctx_new(int in_fd, int out_fd, int dir_fd)
+{
+    struct qfile_ctx *ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx)
+        return NULL;
+    ctx->in_fd = in_fd;
+    ctx->out_fd = out_fd;
+    ctx->dir_fd = dir_fd;
+    return ctx;
+}
+
+void qfile_ctx_free(struct qfile_ctx *ctx)
+{
+    free(ctx);
+}
+
+void qfile_ctx_set_size_limit(struct qfile_ctx *ctx, unsigned long long bytes_limit,
+                              unsigned long long files_limit)
+{
+    ctx->size_limit_set = 1;
+    ctx->bytes_limit = bytes_limit;
+    ctx->files_limit = files_limit;
+}
+
+int qfile_ctx_error(const struct qfile_ctx *ctx)
+{
+    return ctx->error;
+}
+
+const char *qfile_ctx_message(const struct qfile_ctx *ctx)
+{
+    return ctx->message;
+}
+
+void ctx_enter(struct qfile_ctx *ctx)
+{
+    ctx->error = 0;
+    ctx->message[0] = '\0';
+    current_ctx = ctx;
+}
+
+void ctx_leave(void)
+{
+    current_ctx = NULL;
+}
+
+_Noreturn void ctx_fail(int code, int exit_code, const char *message)
+{
+    if (!current_ctx)
+        exit(exit_code);
+    current_ctx->error = code;
+    if (message && !current_ctx->message[0])
+        snprintf(current_ctx->message, sizeof(current_ctx->message), "%s", message);
+    longjmp(current_ctx->fail, 1);
+}
@@ -0,0 +1,62 @@
+#ifndef _CTX_H
+#define _CTX_H
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include "libqubes-rpc-filecopy.h"
+
+/*
+ * A transfer started with one of the *_ctx functions.  The state of the
+ * transfer itself is thread-local; the context says where its input, output
+ * and files are, what it may differ in from the process-wide settings, and
+ * where to go instead of exit() when it fails.
+ */
+struct qfile_ctx {
+    int in_fd, out_fd, dir_fd;
+    /* qfile_ctx_set_size_limit(), if set_size_limit() does not apply */
+    int size_limit_set;
+    unsigned long long bytes_limit, files_limit;
+    int error;
+    char message[MAX_PATH_LENGTH + 256];
+    jmp_buf fail;
+};
+
+/* the context of the running *_ctx call of this thread, if any */
+extern _Thread_local struct qfile_ctx *current_ctx;
+
+static inline int input_fd(void)
+{
+    return current_ctx ? current_ctx->in_fd : 0;
+}
+
+static inline int output_fd(void)
+{
+    return current_ctx ? current_ctx->out_fd : 1;
+}
+
+/* what relative paths are relative to */
+static inline int base_dir_fd(void)
+{
+    return current_ctx ? current_ctx->dir_fd : AT_FDCWD;
+}
+
+/*
+ * Entered with setjmp(ctx->fail) in each *_ctx function:
+ *
+ *     if (setjmp(ctx->fail)) {
+ *         ...clean up...
+ *         ctx_leave();
+ *         return ctx->error;
+ *     }
+ *     ctx_enter(ctx);
+ */
+void ctx_enter(struct qfile_ctx *ctx);
+void ctx_leave(void);
+/*
+ * End the transfer: return code (an errno value or LEGAL_EOF) from the *_ctx
+ * function if there is one, exit(exit_code) otherwise.  message (may be NULL)
+ * is kept for qfile_ctx_message(), unless one was already set.
+ */
+_Noreturn void ctx_fail(int code, int exit_code, const char *message);
+
+#endif /* _CTX_H */
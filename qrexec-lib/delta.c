@@ -0,0 +1,167 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "digest.h"
+
+struct delta_index {
+    const struct delta_block *blocks;
+    uint64_t count;
+    uint32_t block_size;
+    /* length of the last block, which may be short */
+    uint32_t last_len;
+    /* chains of blocks by weak checksum: heads[] and next[] hold index + 1 */
+    uint32_t *heads, *next;
+    uint32_t mask;
+};
+
+uint32_t delta_block_size(uint64_t size)
+{
+    uint32_t block_size = DELTA_BLOCK_MIN;
+
+    while (block_size < DELTA_BLOCK_MAX &&
+            ((uint64_t)block_size * block_size < size ||
+             size / block_size >= QFILE_DELTA_MAX_BLOCKS))
+        block_size <<= 1;
+    return block_size;
+}
+
+uint32_t delta_weak(const uint8_t *buf, size_t len)
+{
+    uint32_t a = 0, b = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return (a & 0xffff) | b << 16;
+}
+
+static void delta_strong(const uint8_t *buf, size_t len, uint8_t out[QFILE_DELTA_STRONG_LEN])
+{
+    uint8_t full[DIGEST_LEN];
+    struct digest d;
+
+    digest_init(&d, NULL);
+    digest_update(&d, buf, len);
+    digest_final(&d, full);
+    memcpy(out, full, QFILE_DELTA_STRONG_LEN);
+}
+
+int delta_signature(int fd, uint64_t size, uint32_t block_size, struct delta_block *blocks)
+{
+    /* whole blocks, a MiB or so at a time */
+    size_t buf_size = block_size < (1 << 20) ? (1 << 20) : block_size;
+    uint8_t *buf = malloc(buf_size);
+    uint64_t offset = 0;
+    ssize_t ret;
+    size_t len, block_len;
+
+    if (!buf)
+        return -1;
+    for (; offset < size; offset += len) {
+        len = size - offset < buf_size ? size - offset : buf_size;
+        ret = pread(fd, buf, len, offset);
+        if (ret != (ssize_t)len) {
+            /* shrunk under us */
+            if (ret >= 0)
+                errno = EIO;
+            free(buf);
+            return -1;
+        }
+        for (size_t pos = 0; pos < len; pos += block_len, blocks++) {
+            block_len = len - pos < block_size ? len - pos : block_size;
+            blocks->weak = delta_weak(buf + pos, block_len);
+            delta_strong(buf + pos, block_len, blocks->strong);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+struct delta_index *delta_index_new(const struct delta_block *blocks,
+                                    const struct delta_signature *sig)
+{
+    struct delta_index *idx = calloc(1, sizeof(*idx));
+    uint64_t size;
+    uint32_t h;
+
+    if (!idx)
+        return NULL;
+    idx->blocks = blocks;
+    idx->block_size = sig->block_size;
+    idx->count = (sig->size + sig->block_size - 1) / sig->block_size;
+    idx->last_len = sig->size - (idx->count ? idx->count - 1 : 0) * sig->block_size;
+    for (size = 16; size < 2 * idx->count; size *= 2)
+        ;
+    idx->mask = size - 1;
+    idx->heads = calloc(size, sizeof(*idx->heads));
+    idx->next = calloc(idx->count ? idx->count : 1, sizeof(*idx->next));
+    if (!idx->heads || !idx->next) {
+        delta_index_free(idx);
+        return NULL;
+    }
+    /* backwards, so that each chain starts with the earliest block */
+    for (uint64_t i = idx->count; i-- > 0;) {
+        h = (blocks[i].weak * 0x9e3779b1U) >> 8 & idx->mask;
+        idx->next[i] = idx->heads[h];
+        idx->heads[h] = i + 1;
+    }
+    return idx;
+}
+
+void delta_index_free(struct delta_index *idx)
+{
+    if (!idx)
+        return;
+    free(idx->heads);
+    free(idx->next);
+    free(idx);
+}
+
+int64_t delta_index_find(const struct delta_index *idx, uint32_t weak,
+                         const uint8_t *buf, size_t len)
+{
+    uint32_t h = (weak * 0x9e3779b1U) >> 8 & idx->mask;
+    uint8_t strong[QFILE_DELTA_STRONG_LEN];
+    int have_strong = 0;
+    uint64_t i;
+
+    for (uint32_t e = idx->heads[h]; e; e = idx->next[e - 1]) {
+        i = e - 1;
+        if (idx->blocks[i].weak != weak)
+            continue;
+        if (len != (i == idx->count - 1 ? idx->last_len : idx->block_size))
+            continue;
+        if (!have_strong) {
+            delta_strong(buf, len, strong);
+            have_strong = 1;
+        }
+        if (!memcmp(idx->blocks[i].strong, strong, sizeof(strong)))
+            return i;
+    }
+    return -1;
+}
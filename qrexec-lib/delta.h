@@ -0,0 +1,47 @@
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "libqubes-rpc-filecopy.h"
+
+/*
+ * Block matching for QFILE_FEATURE_DELTA, as in rsync: the unpacker sends a
+ * weak rolling checksum and a 128-bit hash of each block of its old file,
+ * and the packer slides a window over the new file, looking the weak
+ * checksum up at every offset and hashing the window only when it matches.
+ * With millions of blocks, the weak checksum alone matches by chance all
+ * the time, so only the hash decides.
+ */
+/* smaller files are sent whole, the signature would save little */
+#define DELTA_MIN (1 << 20)
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (16 << 20)
+
+/* about the square root of the size, so the signature and the literals balance */
+uint32_t delta_block_size(uint64_t size);
+uint32_t delta_weak(const uint8_t *buf, size_t len);
+
+/* the window moves by one byte: out leaves it, in enters it */
+static inline uint32_t delta_roll(uint32_t sum, size_t len, uint8_t out, uint8_t in)
+{
+    uint32_t a = sum & 0xffff, b = sum >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return a | b << 16;
+}
+
+/* signature of size bytes of fd, in blocks of block_size */
+int delta_signature(int fd, uint64_t size, uint32_t block_size, struct delta_block *blocks);
+
+struct delta_index;
+/* blocks stay owned by the caller; NULL on allocation failure */
+struct delta_index *delta_index_new(const struct delta_block *blocks,
+                                    const struct delta_signature *sig);
+void delta_index_free(struct delta_index *idx);
+/* the block holding the len bytes at buf (with checksum weak), or -1 */
+int64_t delta_index_find(const struct delta_index *idx, uint32_t weak,
+                         const uint8_t *buf, size_t len);
+
+#endif /* _DELTA_H */
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "digest.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "Digest test program does not work without assertions."
+#endif
+#include <assert.h>
+
+/* from the BLAKE3 test vectors: input byte i is i % 251 */
+static const struct {
+    size_t len;
+    const char *hash, *keyed_hash;
+} vectors[] = {
+    { 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+      "92b2b75604ed3c761f9d6f62392c8a9227ad0ea3f09573e783f1498a4ed60d26" },
+    { 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213",
+      "6d7878dfff2f485635d39013278ae14f1454b8c0a3a2d34bc1ab38228a80c95b" },
+    { 64, "4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98",
+      "ba8ced36f327700d213f120b1a207a3b8c04330528586f414d09f2f7d9ccb7e6" },
+    { 65, "de1e5fa0be70df6d2be8fffd0e99ceaa8eb6e8c93a63f2d8d1c30ecb6b263dee",
+      "c0a4edefa2d2accb9277c371ac12fcdbb52988a86edc54f0716e1591b4326e72" },
+    { 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7",
+      "75c46f6f3d9eb4f55ecaaee480db732e6c2105546f1e675003687c31719c7ba4" },
+    { 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444",
+      "357dc55de0c7e382c900fd6e320acc04146be01db6a8ce7210b7189bd664ea69" },
+    { 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030",
+      "9f29700902f7c86e514ddc4df1e3049f258b2472b6dd5267f61bf13983b78dd5" },
+    { 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3",
+      "68dede9bef00ba89e43f31a6825f4cf433389fedae75c04ee9f0cf16a427c95a" },
+    { 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b",
+      "954a2a75420c8d6547e3ba5b98d963e6fa6491addc8c023189cc519821b4a1f5" },
+    { 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4",
+      "9e9fc4eb7cf081ea7c47d1807790ed211bfec56aa25bb7037784c13c4b707b0d" },
+    { 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47",
+      "efa53b389ab67c593dba624d898d0f7353ab99e4ac9d42302ee64cbf9939a419" },
+    { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085",
+      "1c35d1a5811083fd7119f5d5d1ba027b4d01c0c6c49fb6ff2cf75393ea5db4a7" },
+};
+
+static unsigned char input[102400];
+
+static void check_hex(const char *what, size_t len, const uint8_t got[DIGEST_LEN], const char *hex)
+{
+    char got_hex[2 * DIGEST_LEN + 1];
+
+    for (int i = 0; i < DIGEST_LEN; i++)
+        snprintf(got_hex + 2 * i, 3, "%02x", got[i]);
+    if (strcmp(got_hex, hex)) {
+        fprintf(stderr, "BUG: %s: digest of %zu bytes is %s, expected %s\n",
+                what, len, got_hex, hex);
+        abort();
+    }
+}
+
+/* whole, and then in pieces of every size up to a few blocks */
+static void check_impl(const struct digest_impl *impl, const struct digest_settings *s,
+                       size_t len, const char *hex)
+{
+    struct digest d;
+    uint8_t out[DIGEST_LEN];
+
+    digest_init_with(&d, s, impl);
+    digest_update(&d, input, len);
+    digest_final(&d, out);
+    check_hex(impl->name, len, out, hex);
+    for (size_t piece = 1; piece < 200; piece += 7) {
+        digest_init_with(&d, s, impl);
+        for (size_t done = 0; done < len; done += piece)
+            digest_update(&d, input + done, len - done < piece ? len - done : piece);
+        digest_final(&d, out);
+        check_hex(impl->name, len, out, hex);
+    }
+}
+
+/* digest_file() in threads against a single digest_update() */
+static void check_file(void)
+{
+    char path[] = "/tmp/digest-test.XXXXXX";
+    /* enough for all of the threads below to get a share */
+    size_t size = 7 * DIGEST_PARALLEL_MIN + 12345;
+    unsigned char *data = malloc(size);
+    struct digest_settings s = { .keyed = 0 };
+    uint8_t expected[DIGEST_LEN], got[DIGEST_LEN];
+    struct digest d;
+    uint32_t seed = 1;
+    int fd;
+
+    assert(data);
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    assert(write(fd, data, size) == (ssize_t)size);
+    for (int keyed = 0; keyed < 2; keyed++) {
+        s.keyed = keyed;
+        memset(s.key, 0x5a, sizeof(s.key));
+        digest_init(&d, &s);
+        digest_update(&d, data, size);
+        digest_final(&d, expected);
+        for (int threads = 0; threads <= 7; threads++) {
+            s.threads = threads;
+            assert(digest_file(fd, size, &s, got) == 0);
+            assert(digest_equal(got, expected));
+        }
+    }
+    /* the file has to be as long as expected */
+    errno = 0;
+    assert(digest_file(fd, size + 1, &s, got) == -1 && errno == EIO);
+    close(fd);
+
+    /* holes hash as zeros */
+    memset(data, 0, 100000);
+    digest_init(&d, &s);
+    digest_update(&d, data, 100000);
+    digest_final(&d, expected);
+    digest_init(&d, &s);
+    digest_update_zeros(&d, 100000);
+    digest_final(&d, got);
+    assert(digest_equal(got, expected));
+    got[DIGEST_LEN - 1] ^= 1;
+    assert(!digest_equal(got, expected));
+    free(data);
+}
+
+int main(void)
+{
+    struct digest_settings plain = { .keyed = 0 }, keyed = { .keyed = 1 };
+    const struct digest_impl *impl;
+
+    for (size_t i = 0; i < sizeof(input); i++)
+        input[i] = i % 251;
+    memcpy(keyed.key, "whats the Elvish word for friend", DIGEST_KEY_LEN);
+
+    for (impl = digest_impls; impl->name; impl++) {
+        if (!impl->supported()) {
+            printf("%s: not supported on this CPU, skipped\n", impl->name);
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+            check_impl(impl, &plain, vectors[i].len, vectors[i].hash);
+            check_impl(impl, &keyed, vectors[i].len, vectors[i].keyed_hash);
+        }
+        printf("%s: OK\n", impl->name);
+    }
+    check_file();
+    printf("digest_file: OK\n");
+    return 0;
+}
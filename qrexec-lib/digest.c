@@ -0,0 +1,774 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqubes-rpc-filecopy.h"
+#include "digest.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* domain separation flags */
+enum {
+    CHUNK_START = 1 << 0,
+    CHUNK_END = 1 << 1,
+    PARENT = 1 << 2,
+    ROOT = 1 << 3,
+    KEYED_HASH = 1 << 4,
+};
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* the message words in the order each of the 7 rounds uses them */
+static const uint8_t SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+_Static_assert(DIGEST_LEN == QFILE_DIGEST_LEN && DIGEST_KEY_LEN == QFILE_DIGEST_KEY_LEN,
+        "the digest is part of the protocol");
+
+#define BLOCK_LEN 64
+/* chunks per call of the kernel */
+#define BATCH_CHUNKS 16
+/* read size of digest_file() */
+#define FILE_BUF_SIZE (1 << 20)
+#define THREADS_MAX 64
+
+static int keyed;
+static uint8_t digest_key[DIGEST_KEY_LEN];
+static int digest_threads;
+
+void set_digest_key(const uint8_t *key)
+{
+    keyed = key != NULL;
+    if (key)
+        memcpy(digest_key, key, sizeof(digest_key));
+    else
+        memset(digest_key, 0, sizeof(digest_key));
+}
+
+void set_digest_threads(int threads)
+{
+    digest_threads = threads;
+}
+
+void digest_settings(struct digest_settings *s)
+{
+    s->keyed = keyed;
+    memcpy(s->key, digest_key, sizeof(s->key));
+    s->threads = digest_threads;
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t rotr32(uint32_t w, int c)
+{
+    return (w >> c) | (w << (32 - c));
+}
+
+static inline void g(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+    v[a] = v[a] + v[b] + x;
+    v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 7);
+}
+
+/* the state after compressing one block: the new chaining value comes first */
+static void compress(const uint32_t cv[8], const uint8_t block[BLOCK_LEN], uint8_t block_len,
+                     uint64_t counter, uint8_t flags, uint32_t out[16])
+{
+    uint32_t m[16], v[16];
+
+    for (int i = 0; i < 16; i++)
+        m[i] = load32(block + 4 * i);
+    memcpy(v, cv, 8 * sizeof(*v));
+    memcpy(v + 8, IV, 4 * sizeof(*v));
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *s = SCHEDULE[r];
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+static inline uint8_t block_flags(uint8_t flags, int block)
+{
+    return flags | (block == 0 ? CHUNK_START : 0) |
+        (block == DIGEST_CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+}
+
+static void chunks_portable(const uint8_t *input, size_t count, const uint32_t key[8],
+                            uint64_t counter, uint8_t flags, uint32_t *cvs)
+{
+    uint32_t out[16];
+
+    for (size_t i = 0; i < count; i++) {
+        memcpy(cvs, key, 8 * sizeof(*cvs));
+        for (int b = 0; b < DIGEST_CHUNK_LEN / BLOCK_LEN; b++) {
+            compress(cvs, input + b * BLOCK_LEN, BLOCK_LEN, counter + i,
+                    block_flags(flags, b), out);
+            memcpy(cvs, out, 8 * sizeof(*cvs));
+        }
+        input += DIGEST_CHUNK_LEN;
+        cvs += 8;
+    }
+}
+
+#if defined(__x86_64__)
+/*
+ * The SIMD kernels hash 4 or 8 chunks at once, one per lane: vector i of the
+ * state holds word i of every chunk's state, so the rounds are the scalar
+ * ones, with the message words transposed into the same layout.
+ */
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+static inline __m128i rot16_4(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+static inline __m128i rot8_4(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+#define G4(a, b, c, d, x, y) do { \
+    a = _mm_add_epi32(_mm_add_epi32(a, b), x); \
+    d = rot16_4(_mm_xor_si128(d, a)); \
+    c = _mm_add_epi32(c, d); \
+    b = _mm_xor_si128(b, c); \
+    b = _mm_or_si128(_mm_srli_epi32(b, 12), _mm_slli_epi32(b, 20)); \
+    a = _mm_add_epi32(_mm_add_epi32(a, b), y); \
+    d = rot8_4(_mm_xor_si128(d, a)); \
+    c = _mm_add_epi32(c, d); \
+    b = _mm_xor_si128(b, c); \
+    b = _mm_or_si128(_mm_srli_epi32(b, 7), _mm_slli_epi32(b, 25)); \
+} while (0)
+
+static inline void transpose4(__m128i r[4])
+{
+    __m128i ab01 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i ab23 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i cd01 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i cd23 = _mm_unpackhi_epi32(r[2], r[3]);
+
+    r[0] = _mm_unpacklo_epi64(ab01, cd01);
+    r[1] = _mm_unpackhi_epi64(ab01, cd01);
+    r[2] = _mm_unpacklo_epi64(ab23, cd23);
+    r[3] = _mm_unpackhi_epi64(ab23, cd23);
+}
+
+static void chunks4_sse41(const uint8_t *input, const uint32_t key[8],
+                          uint64_t counter, uint8_t flags, uint32_t *cvs)
+{
+    __m128i h[8], v[16], m[16], ctr_lo, ctr_hi;
+
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_set1_epi32(key[i]);
+    ctr_lo = _mm_setr_epi32(counter, counter + 1, counter + 2, counter + 3);
+    ctr_hi = _mm_setr_epi32((counter) >> 32, (counter + 1) >> 32,
+            (counter + 2) >> 32, (counter + 3) >> 32);
+    for (int b = 0; b < DIGEST_CHUNK_LEN / BLOCK_LEN; b++) {
+        for (int q = 0; q < 4; q++) {
+            for (int j = 0; j < 4; j++)
+                m[4 * q + j] = _mm_loadu_si128((const __m128i *)
+                        (input + j * DIGEST_CHUNK_LEN + b * BLOCK_LEN + 16 * q));
+            transpose4(m + 4 * q);
+        }
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm_set1_epi32(IV[i]);
+        v[12] = ctr_lo;
+        v[13] = ctr_hi;
+        v[14] = _mm_set1_epi32(BLOCK_LEN);
+        v[15] = _mm_set1_epi32(block_flags(flags, b));
+        for (int r = 0; r < 7; r++) {
+            const uint8_t *s = SCHEDULE[r];
+            G4(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+            G4(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+            G4(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+            G4(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+            G4(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+            G4(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+            G4(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+            G4(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+    /* back to one chaining value per chunk */
+    transpose4(h);
+    transpose4(h + 4);
+    for (int j = 0; j < 4; j++) {
+        _mm_storeu_si128((__m128i *)(cvs + 8 * j), h[j]);
+        _mm_storeu_si128((__m128i *)(cvs + 8 * j + 4), h[4 + j]);
+    }
+}
+
+static void chunks_sse41(const uint8_t *input, size_t count, const uint32_t key[8],
+                         uint64_t counter, uint8_t flags, uint32_t *cvs)
+{
+    for (; count >= 4; count -= 4) {
+        chunks4_sse41(input, key, counter, flags, cvs);
+        input += 4 * DIGEST_CHUNK_LEN;
+        counter += 4;
+        cvs += 4 * 8;
+    }
+    chunks_portable(input, count, key, counter, flags, cvs);
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static inline __m256i rot16_8(__m256i x)
+{
+    return _mm256_shuffle_epi8(x, _mm256_set_epi8(
+                13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+static inline __m256i rot8_8(__m256i x)
+{
+    return _mm256_shuffle_epi8(x, _mm256_set_epi8(
+                12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+#define G8(a, b, c, d, x, y) do { \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), x); \
+    d = rot16_8(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi32(c, d); \
+    b = _mm256_xor_si256(b, c); \
+    b = _mm256_or_si256(_mm256_srli_epi32(b, 12), _mm256_slli_epi32(b, 20)); \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), y); \
+    d = rot8_8(_mm256_xor_si256(d, a)); \
+    c = _mm256_add_epi32(c, d); \
+    b = _mm256_xor_si256(b, c); \
+    b = _mm256_or_si256(_mm256_srli_epi32(b, 7), _mm256_slli_epi32(b, 25)); \
+} while (0)
+
+static inline void transpose8(__m256i r[8])
+{
+    __m256i ab0145 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i ab2367 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i cd0145 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i cd2367 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i ef0145 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i ef2367 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i gh0145 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i gh2367 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i abcd04 = _mm256_unpacklo_epi64(ab0145, cd0145);
+    __m256i abcd15 = _mm256_unpackhi_epi64(ab0145, cd0145);
+    __m256i abcd26 = _mm256_unpacklo_epi64(ab2367, cd2367);
+    __m256i abcd37 = _mm256_unpackhi_epi64(ab2367, cd2367);
+    __m256i efgh04 = _mm256_unpacklo_epi64(ef0145, gh0145);
+    __m256i efgh15 = _mm256_unpackhi_epi64(ef0145, gh0145);
+    __m256i efgh26 = _mm256_unpacklo_epi64(ef2367, gh2367);
+    __m256i efgh37 = _mm256_unpackhi_epi64(ef2367, gh2367);
+
+    r[0] = _mm256_permute2x128_si256(abcd04, efgh04, 0x20);
+    r[1] = _mm256_permute2x128_si256(abcd15, efgh15, 0x20);
+    r[2] = _mm256_permute2x128_si256(abcd26, efgh26, 0x20);
+    r[3] = _mm256_permute2x128_si256(abcd37, efgh37, 0x20);
+    r[4] = _mm256_permute2x128_si256(abcd04, efgh04, 0x31);
+    r[5] = _mm256_permute2x128_si256(abcd15, efgh15, 0x31);
+    r[6] = _mm256_permute2x128_si256(abcd26, efgh26, 0x31);
+    r[7] = _mm256_permute2x128_si256(abcd37, efgh37, 0x31);
+}
+
+static void chunks8_avx2(const uint8_t *input, const uint32_t key[8],
+                         uint64_t counter, uint8_t flags, uint32_t *cvs)
+{
+    __m256i h[8], v[16], m[16], ctr_lo, ctr_hi;
+    uint32_t lo[8], hi[8];
+
+    for (int i = 0; i < 8; i++) {
+        h[i] = _mm256_set1_epi32(key[i]);
+        lo[i] = (uint32_t)(counter + i);
+        hi[i] = (uint32_t)((counter + i) >> 32);
+    }
+    ctr_lo = _mm256_loadu_si256((const __m256i *)lo);
+    ctr_hi = _mm256_loadu_si256((const __m256i *)hi);
+    for (int b = 0; b < DIGEST_CHUNK_LEN / BLOCK_LEN; b++) {
+        for (int q = 0; q < 2; q++) {
+            for (int j = 0; j < 8; j++)
+                m[8 * q + j] = _mm256_loadu_si256((const __m256i *)
+                        (input + j * DIGEST_CHUNK_LEN + b * BLOCK_LEN + 32 * q));
+            transpose8(m + 8 * q);
+        }
+        for (int i = 0; i < 8; i++)
+            v[i] = h[i];
+        for (int i = 0; i < 4; i++)
+            v[8 + i] = _mm256_set1_epi32(IV[i]);
+        v[12] = ctr_lo;
+        v[13] = ctr_hi;
+        v[14] = _mm256_set1_epi32(BLOCK_LEN);
+        v[15] = _mm256_set1_epi32(block_flags(flags, b));
+        for (int r = 0; r < 7; r++) {
+            const uint8_t *s = SCHEDULE[r];
+            G8(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+            G8(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+            G8(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+            G8(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+            G8(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+            G8(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+            G8(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+            G8(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+    transpose8(h);
+    for (int j = 0; j < 8; j++)
+        _mm256_storeu_si256((__m256i *)(cvs + 8 * j), h[j]);
+}
+
+static void chunks_avx2(const uint8_t *input, size_t count, const uint32_t key[8],
+                        uint64_t counter, uint8_t flags, uint32_t *cvs)
+{
+    for (; count >= 8; count -= 8) {
+        chunks8_avx2(input, key, counter, flags, cvs);
+        input += 8 * DIGEST_CHUNK_LEN;
+        counter += 8;
+        cvs += 8 * 8;
+    }
+    chunks_sse41(input, count, key, counter, flags, cvs);
+}
+#pragma GCC pop_options
+
+static int digest_sse41_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static int digest_avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static int digest_always_supported(void)
+{
+    return 1;
+}
+
+const struct digest_impl digest_impls[] = {
+#if defined(__x86_64__)
+    { "avx2", chunks_avx2, digest_avx2_supported },
+    { "sse4.1", chunks_sse41, digest_sse41_supported },
+#endif
+    { "portable", chunks_portable, digest_always_supported },
+    { NULL, NULL, NULL },
+};
+
+static const struct digest_impl *digest_best;
+
+__attribute__((constructor))
+static void digest_pick_impl(void)
+{
+    /* digest_impls is sorted fastest first */
+    for (digest_best = digest_impls; !digest_best->supported(); digest_best++)
+        ;
+}
+
+/* a block to compress into a chaining value or the root */
+struct output {
+    uint32_t cv[8];
+    uint8_t block[BLOCK_LEN];
+    uint8_t block_len;
+    uint64_t counter;
+    uint8_t flags;
+};
+
+static void output_cv(const struct output *o, uint32_t cv[8])
+{
+    uint32_t out[16];
+
+    compress(o->cv, o->block, o->block_len, o->counter, o->flags, out);
+    memcpy(cv, out, 8 * sizeof(*cv));
+}
+
+static void parent_output(const struct digest *d, const uint32_t left[8],
+                          const uint32_t right[8], struct output *o)
+{
+    memcpy(o->cv, d->key, sizeof(o->cv));
+    for (int i = 0; i < 8; i++) {
+        store32(o->block + 4 * i, left[i]);
+        store32(o->block + 32 + 4 * i, right[i]);
+    }
+    o->block_len = BLOCK_LEN;
+    o->counter = 0;
+    o->flags = d->flags | PARENT;
+}
+
+static void chunk_output(const struct digest *d, struct output *o)
+{
+    memcpy(o->cv, d->cv, sizeof(o->cv));
+    memcpy(o->block, d->block, sizeof(o->block));
+    o->block_len = d->block_len;
+    o->counter = d->chunk;
+    o->flags = d->flags | (d->blocks ? 0 : CHUNK_START) | CHUNK_END;
+}
+
+static void chunk_reset(struct digest *d, uint64_t chunk)
+{
+    memcpy(d->cv, d->key, sizeof(d->cv));
+    d->chunk = chunk;
+    d->blocks = 0;
+    d->block_len = 0;
+    memset(d->block, 0, sizeof(d->block));
+}
+
+static size_t chunk_len(const struct digest *d)
+{
+    return d->blocks * BLOCK_LEN + d->block_len;
+}
+
+/* bytes of the current chunk; the caller makes sure they fit */
+static void chunk_update(struct digest *d, const uint8_t *p, size_t len)
+{
+    uint32_t out[16];
+    size_t take;
+
+    while (len) {
+        /* a full block is compressed only once more input comes */
+        if (d->block_len == BLOCK_LEN) {
+            compress(d->cv, d->block, BLOCK_LEN, d->chunk,
+                    d->flags | (d->blocks ? 0 : CHUNK_START), out);
+            memcpy(d->cv, out, sizeof(d->cv));
+            d->blocks++;
+            d->block_len = 0;
+            memset(d->block, 0, sizeof(d->block));
+        }
+        take = BLOCK_LEN - d->block_len;
+        if (take > len)
+            take = len;
+        memcpy(d->block + d->block_len, p, take);
+        d->block_len += take;
+        p += take;
+        len -= take;
+    }
+}
+
+/*
+ * Add the chaining value of the subtree that makes total subtrees of its
+ * size, merging it with those to its left that it completes.  More input
+ * follows, so none of the merges is the root.
+ */
+static void push_cv(struct digest *d, uint32_t cv[8], uint64_t total)
+{
+    struct output o;
+
+    while (!(total & 1)) {
+        parent_output(d, d->stack[--d->stack_len], cv, &o);
+        output_cv(&o, cv);
+        total >>= 1;
+    }
+    memcpy(d->stack[d->stack_len++], cv, sizeof(d->stack[0]));
+}
+
+void digest_init_with(struct digest *d, const struct digest_settings *s,
+                      const struct digest_impl *impl)
+{
+    d->impl = impl;
+    if (s && s->keyed) {
+        for (int i = 0; i < 8; i++)
+            d->key[i] = load32(s->key + 4 * i);
+        d->flags = KEYED_HASH;
+    } else {
+        memcpy(d->key, IV, sizeof(d->key));
+        d->flags = 0;
+    }
+    d->stack_len = 0;
+    chunk_reset(d, 0);
+}
+
+void digest_init(struct digest *d, const struct digest_settings *s)
+{
+    digest_init_with(d, s, digest_best);
+}
+
+void digest_update(struct digest *d, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint32_t cvs[BATCH_CHUNKS * 8], cv[8];
+    struct output o;
+    size_t n, take;
+
+    while (len) {
+        if (chunk_len(d) == DIGEST_CHUNK_LEN) {
+            chunk_output(d, &o);
+            output_cv(&o, cv);
+            push_cv(d, cv, d->chunk + 1);
+            chunk_reset(d, d->chunk + 1);
+        }
+        /* whole chunks go to the kernel, except for the last one */
+        if (!chunk_len(d) && len > DIGEST_CHUNK_LEN) {
+            n = (len - 1) / DIGEST_CHUNK_LEN;
+            if (n > BATCH_CHUNKS)
+                n = BATCH_CHUNKS;
+            d->impl->chunks(p, n, d->key, d->chunk, d->flags, cvs);
+            for (size_t i = 0; i < n; i++) {
+                push_cv(d, cvs + 8 * i, d->chunk + 1);
+                d->chunk++;
+            }
+            p += n * DIGEST_CHUNK_LEN;
+            len -= n * DIGEST_CHUNK_LEN;
+            continue;
+        }
+        take = DIGEST_CHUNK_LEN - chunk_len(d);
+        if (take > len)
+            take = len;
+        chunk_update(d, p, take);
+        p += take;
+        len -= take;
+    }
+}
+
+void digest_update_zeros(struct digest *d, uint64_t len)
+{
+    static const uint8_t zeros[16 * DIGEST_CHUNK_LEN];
+
+    while (len) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        digest_update(d, zeros, n);
+        len -= n;
+    }
+}
+
+/* the last block: the current chunk, merged with the stack up to the top */
+static void finish(const struct digest *d, struct output *o)
+{
+    uint32_t cv[8];
+
+    chunk_output(d, o);
+    for (size_t i = d->stack_len; i-- > 0; ) {
+        output_cv(o, cv);
+        parent_output(d, d->stack[i], cv, o);
+    }
+}
+
+void digest_final(const struct digest *d, uint8_t out[DIGEST_LEN])
+{
+    struct output o;
+    uint32_t words[16];
+
+    finish(d, &o);
+    compress(o.cv, o.block, o.block_len, 0, o.flags | ROOT, words);
+    for (int i = 0; i < 8; i++)
+        store32(out + 4 * i, words[i]);
+}
+
+int digest_equal(const uint8_t a[DIGEST_LEN], const uint8_t b[DIGEST_LEN])
+{
+    uint8_t diff = 0;
+
+    for (int i = 0; i < DIGEST_LEN; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static int digest_range(struct digest *d, int fd, uint64_t offset, uint64_t len, uint8_t *buf)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pread(fd, buf, len < FILE_BUF_SIZE ? len : FILE_BUF_SIZE, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (ret == 0)
+                errno = EIO;
+            return -1;
+        }
+        digest_update(d, buf, ret);
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * digest_file() in threads: the file is cut into subtrees of a power of two
+ * chunks each, which the threads take in turn.  The last one, which may be
+ * short, is hashed by the calling thread as part of the root.
+ */
+struct subtrees {
+    int fd;
+    const struct digest_settings *s;
+    uint64_t chunks;        /* per subtree */
+    size_t count, next;
+    uint32_t (*cvs)[8];
+    int error;
+    pthread_mutex_t lock;
+};
+
+static void *subtree_main(void *arg)
+{
+    struct subtrees *t = arg;
+    uint8_t *buf = malloc(FILE_BUF_SIZE);
+    struct digest d;
+    struct output o;
+    size_t i;
+
+    /* the others can do without this thread */
+    if (!buf)
+        return NULL;
+    for (;;) {
+        pthread_mutex_lock(&t->lock);
+        i = t->error ? t->count : t->next++;
+        pthread_mutex_unlock(&t->lock);
+        if (i >= t->count)
+            break;
+        digest_init(&d, t->s);
+        d.chunk = i * t->chunks;
+        if (digest_range(&d, t->fd, i * t->chunks * DIGEST_CHUNK_LEN,
+                    t->chunks * DIGEST_CHUNK_LEN, buf)) {
+            pthread_mutex_lock(&t->lock);
+            if (!t->error)
+                t->error = errno;
+            pthread_mutex_unlock(&t->lock);
+            break;
+        }
+        finish(&d, &o);
+        output_cv(&o, t->cvs[i]);
+    }
+    free(buf);
+    return NULL;
+}
+
+int digest_file(int fd, uint64_t size, const struct digest_settings *s, uint8_t out[DIGEST_LEN])
+{
+    struct subtrees t = { .fd = fd, .s = s, .lock = PTHREAD_MUTEX_INITIALIZER };
+    pthread_t threads[THREADS_MAX];
+    uint64_t chunks = (size + DIGEST_CHUNK_LEN - 1) / DIGEST_CHUNK_LEN, tail;
+    int nthreads = s->threads < THREADS_MAX ? s->threads : THREADS_MAX, started = 0;
+    uint8_t *buf = malloc(FILE_BUF_SIZE);
+    struct digest d, left;
+    sigset_t all, old;
+    int ret = 0;
+
+    if (!buf)
+        return -1;
+    digest_init(&d, s);
+    /* starting a thread is only worth it for a big enough share of the file */
+    if ((uint64_t)nthreads > size / DIGEST_PARALLEL_MIN)
+        nthreads = size / DIGEST_PARALLEL_MIN;
+    if (nthreads < 2) {
+        ret = digest_range(&d, fd, 0, size, buf);
+        goto out;
+    }
+    for (t.chunks = 1; 2 * t.chunks * nthreads <= chunks; t.chunks *= 2)
+        ;
+    t.count = (chunks - 1) / t.chunks;
+    t.cvs = malloc(t.count * sizeof(*t.cvs));
+    if (!t.cvs) {
+        ret = -1;
+        goto out;
+    }
+    /* signals are for the caller's thread, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (; started < nthreads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, subtree_main, &t))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    tail = t.count * t.chunks;
+    d.chunk = tail;
+    if (digest_range(&d, fd, tail * DIGEST_CHUNK_LEN, size - tail * DIGEST_CHUNK_LEN, buf)) {
+        pthread_mutex_lock(&t.lock);
+        if (!t.error)
+            t.error = errno;
+        pthread_mutex_unlock(&t.lock);
+    } else {
+        subtree_main(&t);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (!t.error) {
+        /* the subtrees to the left of the last one, then what it has stacked */
+        digest_init(&left, s);
+        for (size_t i = 0; i < t.count; i++)
+            push_cv(&left, t.cvs[i], i + 1);
+        memmove(d.stack + left.stack_len, d.stack, d.stack_len * sizeof(d.stack[0]));
+        memcpy(d.stack, left.stack, left.stack_len * sizeof(d.stack[0]));
+        d.stack_len += left.stack_len;
+    }
+    free(t.cvs);
+    if (t.error) {
+        errno = t.error;
+        ret = -1;
+    }
+out:
+    if (!ret)
+        digest_final(&d, out);
+    free(buf);
+    return ret;
+}
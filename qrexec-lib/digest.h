@@ -0,0 +1,75 @@
+#ifndef _DIGEST_H
+#define _DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * BLAKE3 (unkeyed or keyed hash mode, 256-bit output) for
+ * QFILE_FEATURE_DIGEST.  Runs of whole 1 KiB chunks are hashed several at
+ * a time with SIMD kernels picked at run time, and digest_file() can split
+ * a large file into subtrees hashed in parallel threads.
+ */
+#define DIGEST_LEN 32
+#define DIGEST_KEY_LEN 32
+#define DIGEST_CHUNK_LEN 1024
+/*
+ * digest_file() uses a thread per this many bytes of the file at most, so
+ * files smaller than twice this are hashed in the calling thread only
+ */
+#define DIGEST_PARALLEL_MIN (8 << 20)
+
+/* hash count whole chunks, numbered from counter, into 8-word chaining values */
+typedef void (digest_chunks_fn)(const uint8_t *input, size_t count, const uint32_t key[8],
+                                uint64_t counter, uint8_t flags, uint32_t *cvs);
+
+struct digest_impl {
+    const char *name;
+    digest_chunks_fn *chunks;
+    int (*supported)(void);
+};
+
+/* all implementations built for this CPU architecture, terminated by NULL name */
+extern const struct digest_impl digest_impls[];
+
+/* what set_digest_key() and set_digest_threads() set */
+struct digest_settings {
+    int keyed;
+    uint8_t key[DIGEST_KEY_LEN];
+    int threads;
+};
+
+struct digest {
+    const struct digest_impl *impl;
+    uint32_t key[8];
+    uint8_t flags;
+    /* the current chunk: its number, the blocks compressed, and the next one */
+    uint64_t chunk;
+    uint32_t cv[8];
+    uint8_t blocks;
+    uint8_t block_len;
+    uint8_t block[64];
+    /* chaining values of the complete subtrees to the left */
+    uint8_t stack_len;
+    uint32_t stack[54][8];
+};
+
+void digest_settings(struct digest_settings *s);
+void digest_init(struct digest *d, const struct digest_settings *s);
+/* with an explicit implementation, for testing and benchmarking */
+void digest_init_with(struct digest *d, const struct digest_settings *s,
+                      const struct digest_impl *impl);
+void digest_update(struct digest *d, const void *buf, size_t len);
+/* as many zero bytes, for holes */
+void digest_update_zeros(struct digest *d, uint64_t len);
+void digest_final(const struct digest *d, uint8_t out[DIGEST_LEN]);
+/*
+ * The digest of the first size bytes of fd, read with pread(), in up to
+ * s->threads threads if it is large enough (see DIGEST_PARALLEL_MIN).  -1 with errno set on errors
+ * (EIO if the file is shorter).
+ */
+int digest_file(int fd, uint64_t size, const struct digest_settings *s, uint8_t out[DIGEST_LEN]);
+/* compare digests in constant time; 1 if equal */
+int digest_equal(const uint8_t a[DIGEST_LEN], const uint8_t b[DIGEST_LEN]);
+
+#endif /* _DIGEST_H */
@@ -0,0 +1,1171 @@
+/*
+ * Filecopy throughput benchmark.
+ *
+ * Packs a synthetic tree with do_fs_walk() in one process and unpacks it with
+ * do_unpack_ext() in another, connected through a pair of pipes the same way
+ * qrexec connects qfile-agent and qfile-unpacker.  Every case is run once per
+ * library configuration, so the numbers can be compared directly.
+ *
+ * Each run prints one line of key=value pairs, or a JSON object with -j,
+ * for tracking regressions.  -t socketpair connects the two processes with
+ * a socketpair instead.  The tree sizes grow with -s; at the default scale
+ * the "million" case has a million tiny files.
+ *
+ * The syscall counts come from /proc/PID/io, which only counts the read
+ * and write families (read, pread, readv, write, sendfile, ...): opens,
+ * stats, directory reads and io_uring submissions are not in
+ * rw_syscalls_per_file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <ftw.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libqubes-rpc-filecopy.h"
+#include "crc32.h"
+#include "digest.h"
+
+struct bench_config {
+    const char *name;
+    /* called in the packer process after qfile_pack_init() */
+    void (*setup_pack)(void);
+    /* called in the unpacker process before do_unpack_ext() */
+    void (*setup_unpack)(void);
+    /* extra streams, given to both sides before the setup functions */
+    int streams;
+    /* copy the tree to the target first, untimed, so that it is up to date */
+    int preload;
+    /* then make the copy out of date, given its path */
+    void (*modify)(const char *tree);
+    /* send a pax archive of the tree (made untimed) instead of walking it */
+    int tar;
+};
+
+struct bench_case {
+    const char *name;
+    void (*make_tree)(const char *path, unsigned long long scale);
+    /* configurations to compare, terminated by an empty one */
+    const struct bench_config *configs;
+    /* drop the source tree from the page cache before each run */
+    int cold;
+    /* keep dirtying unrelated data on the target filesystem during each run */
+    int busy;
+};
+
+static unsigned long long opt_scale = 64;
+static const char *opt_case;
+static int opt_json;
+static int opt_socketpair;
+/* filled in by the packer ([0]) and the unpacker ([1]) processes */
+static struct io_counts {
+    unsigned long long syscr, syscw, wchar;
+} *io_stats;
+
+static void fill_random(void *buf, size_t len, uint64_t *state)
+{
+    uint64_t *p = buf;
+    for (size_t i = 0; i < len / sizeof(*p); i++) {
+        /* xorshift64 - incompressible, and much faster than the disk */
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        p[i] = *state;
+    }
+}
+
+static void make_file(const char *path, unsigned long long size, uint64_t *state)
+{
+    static char buf[1 << 20];
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        err(1, "create %s", path);
+    while (size > 0) {
+        size_t len = size > sizeof(buf) ? sizeof(buf) : size;
+        fill_random(buf, (len + 7) & ~(size_t)7, state);
+        if (!write_all(fd, buf, len))
+            err(1, "write %s", path);
+        size -= len;
+    }
+    if (close(fd))
+        err(1, "close %s", path);
+}
+
+static char *join(const char *dir, const char *name)
+{
+    char *path;
+    if (asprintf(&path, "%s/%s", dir, name) < 0)
+        err(1, "asprintf");
+    return path;
+}
+
+static void make_dir(const char *path)
+{
+    if (mkdir(path, 0755))
+        err(1, "mkdir %s", path);
+}
+
+/* a few big files, scale is the total size in MiB */
+static void make_tree_large(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    char name[32];
+
+    make_dir(path);
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "large-%d", i);
+        char *file = join(path, name);
+        make_file(file, (scale << 20) / 4, &state);
+        free(file);
+    }
+}
+
+/* many small files in a few directories, scale * 32 files in total */
+static void make_tree_small(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    char name[32];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale / 2 + 1; i++) {
+        snprintf(name, sizeof(name), "dir-%llu", i);
+        char *dir = join(path, name);
+        make_dir(dir);
+        for (int j = 0; j < 64; j++) {
+            snprintf(name, sizeof(name), "file-%d", j);
+            char *file = join(dir, name);
+            make_file(file, 16384, &state);
+            free(file);
+        }
+        free(dir);
+    }
+}
+
+/* log-like text, which compresses well; scale is the total size in MiB */
+static void make_tree_text(const char *path, unsigned long long scale)
+{
+    static const char *const words[] = {
+        "qubes", "vm", "started", "stopped", "error:", "warning:", "domain",
+        "qrexec", "policy", "allow", "deny", "file", "copy", "/home/user",
+        "sys-net", "sys-firewall", "personal", "work", "untrusted", "vault",
+    };
+    static char buf[1 << 20];
+    uint64_t state = 0x6a09e667f3bcc908ULL;
+    char name[32];
+
+    make_dir(path);
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "log-%d", i);
+        char *file = join(path, name);
+        int fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+            err(1, "create %s", file);
+        for (unsigned long long left = (scale << 20) / 4; left > 0; ) {
+            size_t len = 0;
+            while (len < sizeof(buf) - 64) {
+                uint64_t r;
+                fill_random(&r, sizeof(r), &state);
+                len += snprintf(buf + len, 64, "%s %s %llu\n",
+                                words[r % 20], words[(r >> 8) % 20],
+                                (unsigned long long)(r >> 40));
+            }
+            if (len > left)
+                len = left;
+            if (!write_all(fd, buf, len))
+                err(1, "write %s", file);
+            left -= len;
+        }
+        close(fd);
+        free(file);
+    }
+}
+
+/* 64 KiB files with 4 names each, scale is the size of the distinct data in MiB */
+static void make_tree_hardlinks(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0xbb67ae8584caa73bULL;
+    char name[32];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale * 16; i++) {
+        snprintf(name, sizeof(name), "file-%llu", i);
+        char *file = join(path, name);
+        make_file(file, 65536, &state);
+        for (int j = 1; j < 4; j++) {
+            snprintf(name, sizeof(name), "file-%llu.%d", i, j);
+            char *other = join(path, name);
+            if (link(file, other))
+                err(1, "link %s", other);
+            free(other);
+        }
+        free(file);
+    }
+}
+
+/* lots of tiny files in one directory, scale * 128 files in total */
+static void make_tree_tiny(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0x853c49e6748fea9bULL;
+    char name[32];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale * 128; i++) {
+        snprintf(name, sizeof(name), "file-%llu", i);
+        char *file = join(path, name);
+        make_file(file, 256, &state);
+        free(file);
+    }
+}
+
+/* a million tiny files at the default scale, a thousand per directory */
+static void make_tree_million(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0x9b05688c2b3e6c1fULL;
+    char name[32];
+    char *dir = NULL;
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale * 15625; i++) {
+        if (i % 1000 == 0) {
+            free(dir);
+            snprintf(name, sizeof(name), "dir-%llu", i / 1000);
+            dir = join(path, name);
+            make_dir(dir);
+        }
+        snprintf(name, sizeof(name), "file-%llu", i % 1000);
+        char *file = join(dir, name);
+        make_file(file, 64, &state);
+        free(file);
+    }
+    free(dir);
+}
+
+/* small files in a few chains of 12 nested directories */
+static void make_tree_deep(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0xda942042e4dd58b5ULL;
+    char name[32];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale / 16 + 1; i++) {
+        snprintf(name, sizeof(name), "chain-%llu", i);
+        char *dir = join(path, name);
+        for (int depth = 0; depth < 12; depth++) {
+            make_dir(dir);
+            for (int j = 0; j < 16; j++) {
+                snprintf(name, sizeof(name), "file-%d", j);
+                char *file = join(dir, name);
+                make_file(file, 1024, &state);
+                free(file);
+            }
+            char *next = join(dir, "sub");
+            free(dir);
+            dir = next;
+        }
+        free(dir);
+    }
+}
+
+/* files of scale MiB with a 1 MiB extent of data every 16 MiB */
+static void make_tree_sparse(const char *path, unsigned long long scale)
+{
+    static char buf[1 << 20];
+    uint64_t state = 0x3c6ef372fe94f82bULL;
+    char name[32];
+
+    make_dir(path);
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "sparse-%d", i);
+        char *file = join(path, name);
+        int fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+            err(1, "create %s", file);
+        for (unsigned long long off = 0; off < scale; off += 16) {
+            fill_random(buf, sizeof(buf), &state);
+            if (pwrite(fd, buf, sizeof(buf), off << 20) != sizeof(buf))
+                err(1, "write %s", file);
+        }
+        if (ftruncate(fd, scale << 20))
+            err(1, "truncate %s", file);
+        close(fd);
+        free(file);
+    }
+}
+
+/* mostly symlinks, to files in other directories; scale * 64 entries */
+static void make_tree_symlinks(const char *path, unsigned long long scale)
+{
+    uint64_t state = 0xa54ff53a5f1d36f1ULL;
+    char name[32], target[64];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale; i++) {
+        snprintf(name, sizeof(name), "dir-%llu", i);
+        char *dir = join(path, name);
+        make_dir(dir);
+        char *file = join(dir, "target");
+        make_file(file, 4096, &state);
+        free(file);
+        for (int j = 0; j < 63; j++) {
+            snprintf(name, sizeof(name), "link-%d", j);
+            snprintf(target, sizeof(target), "../dir-%llu/target", (i + j) % scale);
+            char *link = join(dir, name);
+            if (symlink(target, link))
+                err(1, "symlink %s", link);
+            free(link);
+        }
+        free(dir);
+    }
+}
+
+/* small files with non-ASCII names, scale * 32 files */
+static void make_tree_unicode(const char *path, unsigned long long scale)
+{
+    static const char *const words[] = {
+        "r\u00e9sum\u00e9", "\u0444\u0430\u0439\u043b", "\u03b1\u03c1\u03c7\u03b5\u03af\u03bf",
+        "\u6587\u4ef6", "\ud30c\uc77c", "\u30d5\u30a1\u30a4\u30eb", "za\u017c\u00f3\u0142\u0107",
+        "\u00fcber", "\u0109iuj",
+    };
+    uint64_t state = 0x1f83d9abfb41bd6bULL;
+    char name[128];
+
+    make_dir(path);
+    for (unsigned long long i = 0; i < scale / 2 + 1; i++) {
+        snprintf(name, sizeof(name), "%s-%llu", words[i % 9], i);
+        char *dir = join(path, name);
+        make_dir(dir);
+        for (int j = 0; j < 64; j++) {
+            snprintf(name, sizeof(name), "%s %s-%d.txt", words[j % 9], words[(j / 9) % 9], j);
+            char *file = join(dir, name);
+            make_file(file, 1024, &state);
+            free(file);
+        }
+        free(dir);
+    }
+}
+
+static void setup_buffered(void)
+{
+    set_use_splice(0);
+}
+
+static void setup_4k_buffers(void)
+{
+    set_io_buffer_size(4096, 4096);
+}
+
+static void setup_buffered_4k(void)
+{
+    set_use_splice(0);
+    set_io_buffer_size(4096, 4096);
+}
+
+static void setup_buffered_pipe_1m(void)
+{
+    set_use_splice(0);
+    set_pipe_size(1 << 20);
+}
+
+static void setup_splice(void)
+{
+    set_use_splice(1);
+}
+
+static void setup_compressed(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_COMPRESS) != QFILE_FEATURE_COMPRESS)
+        errx(1, "compression not accepted");
+}
+
+static void setup_sparse(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_SPARSE) != QFILE_FEATURE_SPARSE)
+        errx(1, "sparse files not accepted");
+}
+
+static void setup_hardlinks(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_HARDLINK) != QFILE_FEATURE_HARDLINK)
+        errx(1, "hardlinks not accepted");
+}
+
+static void setup_readahead(void)
+{
+    set_pack_readahead(32);
+}
+
+static void setup_io_uring(void)
+{
+    set_use_io_uring(1);
+}
+
+static void setup_threaded(void)
+{
+    set_threaded_unpack(1);
+}
+
+static void setup_stat_threads(void)
+{
+    set_pack_stat_threads(4);
+}
+
+static void setup_dir_once(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_DIR_ONCE) != QFILE_FEATURE_DIR_ONCE)
+        errx(1, "single-pass directories not accepted");
+}
+
+static void setup_striped(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_STRIPED) != QFILE_FEATURE_STRIPED)
+        errx(1, "striped transfer not accepted");
+}
+
+static void setup_update(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE;
+
+    if (qfile_pack_negotiate(wanted) != wanted)
+        errx(1, "update not accepted");
+}
+
+static void setup_delta(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_DELTA;
+
+    if (qfile_pack_negotiate(wanted) != wanted)
+        errx(1, "delta not accepted");
+}
+
+static void setup_digest(void)
+{
+    if (qfile_pack_negotiate(QFILE_FEATURE_DIGEST) != QFILE_FEATURE_DIGEST)
+        errx(1, "digest not accepted");
+}
+
+static void setup_digest_striped(void)
+{
+    uint32_t wanted = QFILE_FEATURE_DIGEST | QFILE_FEATURE_STRIPED;
+
+    if (qfile_pack_negotiate(wanted) != wanted)
+        errx(1, "striped digest not accepted");
+}
+
+/* a few bytes changed here and there in each file of make_tree_large() */
+static void modify_large(const char *tree)
+{
+    char name[32];
+    struct stat st;
+    int fd;
+
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "large-%d", i);
+        char *file = join(tree, name);
+        if ((fd = open(file, O_WRONLY | O_CLOEXEC)) < 0 || fstat(fd, &st))
+            err(1, "open %s", file);
+        for (off_t offset = 12345; offset < st.st_size; offset += st.st_size / 16)
+            if (pwrite(fd, "CHANGED", 7, offset) != 7)
+                err(1, "pwrite %s", file);
+        close(fd);
+        free(file);
+    }
+}
+
+static void setup_unbatched(void)
+{
+    set_pack_batch_size(0);
+}
+
+static void setup_durability_none(void)
+{
+    set_durability(QFILE_DURABILITY_NONE);
+}
+
+static void setup_durability_file(void)
+{
+    set_durability(QFILE_DURABILITY_FILE);
+}
+
+static void setup_durability_file_io_uring(void)
+{
+    set_durability(QFILE_DURABILITY_FILE);
+    set_use_io_uring(1);
+}
+
+static const struct bench_config batch_configs[] = {
+    { .name = "unbatched", .setup_pack = setup_unbatched },
+    { .name = "batched" },
+    { 0 },
+};
+
+static const struct bench_config io_uring_configs[] = {
+    { .name = "sync" },
+    { .name = "io_uring", .setup_unpack = setup_io_uring },
+    { .name = "threaded", .setup_unpack = setup_threaded },
+    { 0 },
+};
+
+static const struct bench_config splice_configs[] = {
+    { .name = "buffered-4k", .setup_pack = setup_4k_buffers,
+      .setup_unpack = setup_buffered_4k },
+    { .name = "buffered", .setup_unpack = setup_buffered },
+    { .name = "buffered-pipe-1m", .setup_unpack = setup_buffered_pipe_1m },
+    { .name = "splice", .setup_unpack = setup_splice },
+    { .name = "threaded", .setup_unpack = setup_threaded },
+    { .name = "compressed", .setup_pack = setup_compressed },
+    { 0 },
+};
+
+static const struct bench_config compress_configs[] = {
+    { .name = "raw" },
+    { .name = "compressed", .setup_pack = setup_compressed },
+    { .name = "compressed-threaded", .setup_pack = setup_compressed,
+      .setup_unpack = setup_threaded },
+    { 0 },
+};
+
+static const struct bench_config hardlink_configs[] = {
+    { .name = "copies" },
+    { .name = "hardlinks", .setup_pack = setup_hardlinks },
+    { 0 },
+};
+
+static const struct bench_config readahead_configs[] = {
+    { .name = "serial" },
+    { .name = "readahead-32", .setup_pack = setup_readahead },
+    { .name = "stat-threads-4", .setup_pack = setup_stat_threads },
+    { 0 },
+};
+
+static const struct bench_config durability_configs[] = {
+    { .name = "none", .setup_unpack = setup_durability_none },
+    { .name = "file", .setup_unpack = setup_durability_file },
+    { .name = "file-io_uring", .setup_unpack = setup_durability_file_io_uring },
+    { .name = "fs" },
+    { 0 },
+};
+
+static const struct bench_config sparse_configs[] = {
+    { .name = "dense" },
+    { .name = "sparse", .setup_pack = setup_sparse },
+    { 0 },
+};
+
+static const struct bench_config dir_once_configs[] = {
+    { .name = "dir-twice" },
+    { .name = "dir-once", .setup_pack = setup_dir_once },
+    { .name = "dir-once-io_uring", .setup_pack = setup_dir_once,
+      .setup_unpack = setup_io_uring },
+    { 0 },
+};
+
+static const struct bench_config stripe_configs[] = {
+    { .name = "single" },
+    { .name = "striped-1", .setup_pack = setup_striped, .streams = 1 },
+    { .name = "striped-2", .setup_pack = setup_striped, .streams = 2 },
+    { .name = "striped-4", .setup_pack = setup_striped, .streams = 4 },
+    { 0 },
+};
+
+static const struct bench_config update_configs[] = {
+    { .name = "full", .setup_pack = setup_dir_once },
+    { .name = "update-empty", .setup_pack = setup_update },
+    { .name = "update-unchanged", .setup_pack = setup_update, .preload = 1 },
+    { 0 },
+};
+
+static const struct bench_config delta_configs[] = {
+    { .name = "full", .setup_pack = setup_dir_once },
+    { .name = "update-changed", .setup_pack = setup_update, .preload = 1,
+      .modify = modify_large },
+    { .name = "delta-changed", .setup_pack = setup_delta, .preload = 1,
+      .modify = modify_large },
+    { 0 },
+};
+
+static const struct bench_config tar_configs[] = {
+    { .name = "walk" },
+    { .name = "tar", .tar = 1 },
+    { 0 },
+};
+
+static const struct bench_config digest_configs[] = {
+    { .name = "crc32" },
+    { .name = "digest", .setup_pack = setup_digest },
+    { .name = "digest-striped-2", .setup_pack = setup_digest_striped, .streams = 2 },
+    { 0 },
+};
+
+static const struct bench_config default_configs[] = {
+    { .name = "default" },
+    { 0 },
+};
+
+static const struct bench_case cases[] = {
+    { "large", make_tree_large, splice_configs, 0, 0 },
+    { "striped", make_tree_large, stripe_configs, 0, 0 },
+    { "text", make_tree_text, compress_configs, 0, 0 },
+    { "small-cold", make_tree_small, readahead_configs, 1, 0 },
+    { "small", make_tree_small, io_uring_configs, 0, 0 },
+    { "tiny", make_tree_tiny, batch_configs, 0, 0 },
+    { "million", make_tree_million, batch_configs, 0, 0 },
+    { "deep", make_tree_deep, io_uring_configs, 0, 0 },
+    { "deep-dirs", make_tree_deep, dir_once_configs, 0, 0 },
+    { "hardlinks", make_tree_hardlinks, hardlink_configs, 0, 0 },
+    { "update", make_tree_small, update_configs, 0, 0 },
+    { "delta", make_tree_large, delta_configs, 0, 0 },
+    { "tar", make_tree_small, tar_configs, 0, 0 },
+    { "tar-large", make_tree_large, tar_configs, 0, 0 },
+    { "digest", make_tree_large, digest_configs, 0, 0 },
+    { "busy", make_tree_small, durability_configs, 0, 1 },
+    { "sparse", make_tree_sparse, sparse_configs, 0, 0 },
+    { "symlinks", make_tree_symlinks, io_uring_configs, 0, 0 },
+    { "unicode", make_tree_unicode, default_configs, 0, 0 },
+};
+
+static int evict_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    int fd;
+
+    (void)type;
+    (void)ftw;
+    if (!S_ISREG(st->st_mode))
+        return 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        err(1, "open %s", path);
+    /* written data must be clean before it can be dropped */
+    if (fdatasync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+        err(1, "evict %s", path);
+    close(fd);
+    return 0;
+}
+
+/* drop file contents from the page cache, which does not need root */
+static void evict_tree(const char *path)
+{
+    if (nftw(path, evict_cb, 64, FTW_PHYS))
+        err(1, "nftw %s", path);
+}
+
+/*
+ * Write back whatever is dirty on the filesystem of path: making the tree
+ * and removing the ones of earlier runs leaves metadata behind, which the
+ * syncfs() at the end of the unpacker would otherwise pay for.
+ */
+static void settle_fs(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 || syncfs(fd))
+        err(1, "syncfs %s", path);
+    close(fd);
+}
+
+static int remove_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    if (remove(path))
+        err(1, "remove %s", path);
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    if (nftw(path, remove_cb, 64, FTW_DEPTH | FTW_PHYS) && errno != ENOENT)
+        err(1, "nftw %s", path);
+}
+
+struct tree_size {
+    unsigned long long bytes;
+    unsigned long long files;
+};
+
+static struct tree_size tree_size;
+
+static int size_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)path;
+    (void)type;
+    (void)ftw;
+    if (S_ISREG(st->st_mode))
+        tree_size.bytes += st->st_size;
+    tree_size.files++;
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* streams end up as fds 3, 4, ... in the child */
+static pid_t spawn(int in, int out, const int *streams, int nstreams,
+                   const char *dir, void (*fn)(void *), void *arg)
+{
+    int fds[QFILE_STREAMS_MAX];
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid == 0) {
+        if (dup2(in, 0) < 0 || dup2(out, 1) < 0)
+            err(1, "dup2");
+        for (int i = 0; i < nstreams; i++) {
+            if ((fds[i] = fcntl(streams[i], F_DUPFD_CLOEXEC, 64)) < 0)
+                err(1, "fcntl");
+        }
+        for (int i = 0; i < nstreams; i++) {
+            if (dup2(fds[i], 3 + i) < 0)
+                err(1, "dup2");
+        }
+        /* the other ends of the channels, so that the peer exiting is noticed */
+        if (close_range(3 + nstreams, ~0U, 0))
+            err(1, "close_range");
+        if (chdir(dir))
+            err(1, "chdir %s", dir);
+        fn(arg);
+        _exit(0);
+    }
+    return pid;
+}
+
+/* read and write family syscalls made by this process so far */
+static struct io_counts count_io(void)
+{
+    struct io_counts counts = { 0, 0, 0 };
+    char line[128];
+    FILE *f = fopen("/proc/self/io", "re");
+
+    if (!f)
+        return counts;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %llu", &counts.syscr);
+        sscanf(line, "syscw: %llu", &counts.syscw);
+        sscanf(line, "wchar: %llu", &counts.wchar);
+    }
+    fclose(f);
+    return counts;
+}
+
+struct run_args {
+    const struct bench_case *c;
+    const struct bench_config *config;
+};
+
+/* where spawn() has put the extra streams */
+static void stream_fds(int fds[QFILE_STREAMS_MAX], int count)
+{
+    for (int i = 0; i < count; i++)
+        fds[i] = 3 + i;
+}
+
+static void run_unpacker(void *arg)
+{
+    const struct run_args *args = arg;
+    int procdir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct io_counts start, end;
+    int fds[QFILE_STREAMS_MAX];
+    int ret;
+
+    if (procdir_fd >= 0)
+        set_procfs_fd(procdir_fd);
+    stream_fds(fds, args->config->streams);
+    set_unpack_streams(fds, args->config->streams);
+    /* the packer is our own, so everything it offers can be accepted */
+    set_unpack_features(QFILE_FEATURES_SUPPORTED);
+    if (args->config->setup_unpack)
+        args->config->setup_unpack();
+    start = count_io();
+    ret = do_unpack();
+    end = count_io();
+    io_stats[1].syscr = end.syscr - start.syscr;
+    io_stats[1].syscw = end.syscw - start.syscw;
+    io_stats[1].wchar = end.wchar - start.wchar;
+    _exit(ret ? 1 : 0);
+}
+
+static void run_packer(void *arg)
+{
+    const struct run_args *args = arg;
+    struct io_counts start = count_io(), end;
+    int fds[QFILE_STREAMS_MAX];
+
+    qfile_pack_init();
+    stream_fds(fds, args->config->streams);
+    set_pack_streams(fds, args->config->streams);
+    if (args->config->setup_pack)
+        args->config->setup_pack();
+    if (args->config->tar) {
+        int fd = open("../archive.tar", O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            err(1, "open archive.tar");
+        qfile_pack_tar(fd);
+        close(fd);
+    } else {
+        do_fs_walk(args->c->name, 0);
+    }
+    notify_end_and_wait_for_result();
+    end = count_io();
+    io_stats[0].syscr = end.syscr - start.syscr;
+    io_stats[0].syscw = end.syscw - start.syscw;
+    io_stats[0].wchar = end.wchar - start.wchar;
+}
+
+/* rewrite a 256 MiB file next to the target, never syncing it */
+static void run_dirtier(void *arg)
+{
+    static char buf[1 << 20];
+    uint64_t state = 0x510e527fade682d1ULL;
+    int fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        err(1, "create %s", (char *)arg);
+    fill_random(buf, sizeof(buf), &state);
+    for (unsigned i = 0;; i = (i + 1) % 256)
+        if (pwrite(fd, buf, sizeof(buf), (off_t)i * sizeof(buf)) < 0)
+            err(1, "write %s", (char *)arg);
+}
+
+/* returns the peak RSS of the child, in KiB */
+static long wait_child(pid_t pid, const char *what)
+{
+    struct rusage usage;
+    int status;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        err(1, "wait4");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        errx(1, "%s failed", what);
+    return usage.ru_maxrss;
+}
+
+static int result_fields;
+
+/* one field of a result line, key=value or part of a JSON object with -j */
+static void __attribute__((format(printf, 3, 4)))
+result_field(const char *key, int string, const char *fmt, ...)
+{
+    va_list args;
+
+    if (opt_json)
+        printf("%s\"%s\":%s", result_fields ? "," : "{", key, string ? "\"" : "");
+    else
+        printf("%s%s=", result_fields ? " " : "", key);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    if (opt_json && string)
+        putchar('"');
+    result_fields++;
+}
+
+static void result_end(void)
+{
+    puts(opt_json ? "}" : "");
+    result_fields = 0;
+    fflush(stdout);
+}
+
+static void make_channel(int fds[2])
+{
+    if (opt_socketpair) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+            err(1, "socketpair");
+    } else if (pipe2(fds, O_CLOEXEC)) {
+        err(1, "pipe");
+    }
+}
+
+/* one transfer of the tree in src into dst; returns how long it took */
+static double transfer(const struct run_args *args, const char *src, const char *dst,
+                       long *packer_rss, long *unpacker_rss)
+{
+    const struct bench_config *config = args->config;
+    int to_unpacker[2], to_packer[2];
+    int pack_streams[QFILE_STREAMS_MAX], unpack_streams[QFILE_STREAMS_MAX];
+    pid_t packer, unpacker;
+    double start;
+
+    /* one channel per direction, like qrexec does */
+    make_channel(to_unpacker);
+    make_channel(to_packer);
+    for (int i = 0; i < config->streams; i++) {
+        int pair[2];
+        make_channel(pair);
+        pack_streams[i] = pair[1];
+        unpack_streams[i] = pair[0];
+    }
+    start = now();
+    unpacker = spawn(to_unpacker[0], to_packer[1], unpack_streams, config->streams,
+            dst, run_unpacker, (void *)args);
+    packer = spawn(to_packer[0], to_unpacker[1], pack_streams, config->streams,
+            src, run_packer, (void *)args);
+    close(to_unpacker[0]);
+    close(to_unpacker[1]);
+    close(to_packer[0]);
+    close(to_packer[1]);
+    for (int i = 0; i < config->streams; i++) {
+        close(pack_streams[i]);
+        close(unpack_streams[i]);
+    }
+    *packer_rss = wait_child(packer, "packer");
+    *unpacker_rss = wait_child(unpacker, "unpacker");
+    return now() - start;
+}
+
+static void run_case(const char *workdir, const struct bench_case *c,
+                     const struct bench_config *config)
+{
+    char *src = join(workdir, "src"), *dst = join(workdir, "dst");
+    char *noise = join(workdir, "noise");
+    struct run_args args = { c, config };
+    pid_t dirtier = -1;
+    long packer_rss, unpacker_rss;
+    double elapsed;
+
+    make_dir(dst);
+    if (config->preload) {
+        static const struct bench_config plain = { .name = "preload" };
+        struct run_args preload_args = { c, &plain };
+        transfer(&preload_args, src, dst, &packer_rss, &unpacker_rss);
+    }
+    if (config->tar) {
+        char *cmd;
+        if (asprintf(&cmd, "tar -C '%s' --format=pax -cf '%s/archive.tar' '%s'",
+                    src, workdir, c->name) < 0)
+            err(1, "asprintf");
+        if (system(cmd))
+            errx(1, "%s failed", cmd);
+        free(cmd);
+    }
+    if (config->modify) {
+        char *tree = join(dst, c->name);
+        config->modify(tree);
+        free(tree);
+    }
+    if (c->cold) {
+        char *tree = join(src, c->name);
+        evict_tree(tree);
+        free(tree);
+    }
+    settle_fs(workdir);
+
+    if (c->busy) {
+        dirtier = spawn(0, 1, NULL, 0, workdir, run_dirtier, noise);
+        /* let it build up dirty pages first */
+        usleep(500000);
+    }
+
+    elapsed = transfer(&args, src, dst, &packer_rss, &unpacker_rss);
+    if (dirtier > 0) {
+        kill(dirtier, SIGKILL);
+        waitpid(dirtier, NULL, 0);
+        unlink(noise);
+    }
+
+    result_field("case", 1, "%s", c->name);
+    result_field("config", 1, "%s", config->name);
+    result_field("transport", 1, "%s", opt_socketpair ? "socketpair" : "pipe");
+    result_field("streams", 0, "%d", config->streams + 1);
+    result_field("files", 0, "%llu", tree_size.files);
+    result_field("bytes", 0, "%llu", tree_size.bytes);
+    result_field("seconds", 0, "%.3f", elapsed);
+    result_field("MB/s", 0, "%.1f", tree_size.bytes / elapsed / 1e6);
+    result_field("files/s", 0, "%.0f", tree_size.files / elapsed);
+    result_field("packer_reads", 0, "%llu", io_stats[0].syscr);
+    result_field("packer_writes", 0, "%llu", io_stats[0].syscw);
+    result_field("unpacker_reads", 0, "%llu", io_stats[1].syscr);
+    result_field("unpacker_writes", 0, "%llu", io_stats[1].syscw);
+    /* only the read and write families, see the top of the file */
+    result_field("rw_syscalls_per_file", 0, "%.2f",
+                 (double)(io_stats[0].syscr + io_stats[0].syscw +
+                          io_stats[1].syscr + io_stats[1].syscw) / tree_size.files);
+    result_field("wire_bytes", 0, "%llu", io_stats[0].wchar);
+    result_field("packer_maxrss_kb", 0, "%ld", packer_rss);
+    result_field("unpacker_maxrss_kb", 0, "%ld", unpacker_rss);
+    result_end();
+    remove_tree(dst);
+    free(src);
+    free(dst);
+    free(noise);
+}
+
+/* CRC-32 throughput of every implementation usable on this CPU */
+static void bench_crc32(void)
+{
+    static char buf[1 << 20];
+    uint64_t state = 1;
+    const struct crc32_impl *impl;
+
+    fill_random(buf, sizeof(buf), &state);
+    for (impl = crc32_impls; impl->name; impl++) {
+        unsigned long crc = 0;
+        unsigned long long bytes = 0;
+        double start, elapsed;
+
+        if (!impl->supported())
+            continue;
+        start = now();
+        do {
+            for (int i = 0; i < 16; i++)
+                crc = crc32_compute_with(impl, crc, buf, sizeof(buf));
+            bytes += 16 * sizeof(buf);
+            elapsed = now() - start;
+        } while (elapsed < 0.5);
+        result_field("case", 1, "crc32");
+        result_field("impl", 1, "%s", impl->name);
+        result_field("bytes", 0, "%llu", bytes);
+        result_field("seconds", 0, "%.3f", elapsed);
+        result_field("GB/s", 0, "%.2f", bytes / elapsed / 1e9);
+        result_field("crc", 1, "%08lx", crc);
+        result_end();
+    }
+}
+
+/* the same for the QFILE_FEATURE_DIGEST kernels, and digest_file() in threads */
+static void bench_digest(void)
+{
+    static char buf[1 << 20];
+    uint64_t state = 1;
+    const struct digest_impl *impl;
+    struct digest_settings settings = { .keyed = 0 };
+    uint8_t out[DIGEST_LEN];
+    char path[] = "/tmp/qfile-bench-digest.XXXXXX";
+    int fd;
+
+    fill_random(buf, sizeof(buf), &state);
+    for (impl = digest_impls; impl->name; impl++) {
+        unsigned long long bytes = 0;
+        struct digest d;
+        double start, elapsed;
+
+        if (!impl->supported())
+            continue;
+        digest_init_with(&d, &settings, impl);
+        start = now();
+        do {
+            for (int i = 0; i < 16; i++)
+                digest_update(&d, buf, sizeof(buf));
+            bytes += 16 * sizeof(buf);
+            elapsed = now() - start;
+        } while (elapsed < 0.5);
+        result_field("case", 1, "digest");
+        result_field("impl", 1, "%s", impl->name);
+        result_field("bytes", 0, "%llu", bytes);
+        result_field("seconds", 0, "%.3f", elapsed);
+        result_field("GB/s", 0, "%.2f", bytes / elapsed / 1e9);
+        result_end();
+    }
+
+    /* 64 MiB from the page cache */
+    fd = mkstemp(path);
+    if (fd < 0)
+        err(1, "mkstemp");
+    unlink(path);
+    for (int i = 0; i < 64; i++) {
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+            err(1, "write");
+    }
+    for (settings.threads = 1; settings.threads <= 4; settings.threads *= 2) {
+        double start = now(), elapsed;
+
+        if (digest_file(fd, 64 * sizeof(buf), &settings, out))
+            err(1, "digest_file");
+        elapsed = now() - start;
+        result_field("case", 1, "digest-file");
+        result_field("threads", 0, "%d", settings.threads);
+        result_field("seconds", 0, "%.3f", elapsed);
+        result_field("GB/s", 0, "%.2f", 64 * sizeof(buf) / elapsed / 1e9);
+        result_end();
+    }
+    close(fd);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-j] [-d workdir] [-s scale] [-c case] [-t pipe|socketpair]\n",
+            argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *parent = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+    char *workdir, *src, *path;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:js:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            opt_case = optarg;
+            break;
+        case 'd':
+            parent = optarg;
+            break;
+        case 'j':
+            opt_json = 1;
+            break;
+        case 's':
+            opt_scale = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            if (!strcmp(optarg, "socketpair"))
+                opt_socketpair = 1;
+            else if (strcmp(optarg, "pipe"))
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (!opt_case || !strcmp(opt_case, "crc32"))
+        bench_crc32();
+    if (!opt_case || !strcmp(opt_case, "digest"))
+        bench_digest();
+
+    io_stats = mmap(NULL, 2 * sizeof(*io_stats), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (io_stats == MAP_FAILED)
+        err(1, "mmap");
+
+    workdir = join(parent, "qfile-bench.XXXXXX");
+    if (!mkdtemp(workdir))
+        err(1, "mkdtemp %s", workdir);
+    src = join(workdir, "src");
+    make_dir(src);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (opt_case && strcmp(opt_case, cases[i].name))
+            continue;
+        path = join(src, cases[i].name);
+        cases[i].make_tree(path, opt_scale);
+        memset(&tree_size, 0, sizeof(tree_size));
+        if (nftw(path, size_cb, 64, FTW_PHYS))
+            err(1, "nftw %s", path);
+        for (const struct bench_config *config = cases[i].configs; config->name; config++)
+            run_case(workdir, &cases[i], config);
+        remove_tree(path);
+        free(path);
+    }
+    remove_tree(workdir);
+    free(src);
+    free(workdir);
+    return 0;
+}
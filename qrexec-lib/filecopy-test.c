@@ -0,0 +1,1403 @@
+/*
+ * Round-trip tests for libqubes-rpc-filecopy: pack a tree with do_fs_walk()
+ * in one process, unpack it with do_unpack() in another, and compare the
+ * result with the source.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <err.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "libqubes-rpc-filecopy.h"
+#ifdef NDEBUG
+// without assertions this test program would not test anything
+# error "Filecopy test program does not work without assertions."
+#endif
+#include <assert.h>
+
+struct transfer {
+    /* called in the packer after qfile_pack_init() */
+    void (*setup_pack)(void);
+    /* sends the tree instead of do_fs_walk("tree", 0) */
+    void (*pack)(void);
+    /* called in the unpacker before do_unpack() */
+    void (*setup_unpack)(void);
+    /* called with the empty destination directory before the transfer */
+    void (*prepare)(const char *dst);
+    /* extra checks on the received tree */
+    void (*check)(const char *dst_tree);
+    /* the unpacker rejects the transfer, and the packer must notice */
+    int expect_failure;
+    /* extra streams (socketpairs) for both sides, see set_pack_streams() */
+    int streams;
+};
+
+static char *workdir;
+
+static char *join(const char *dir, const char *name)
+{
+    char *path;
+    if (asprintf(&path, "%s/%s", dir, name) < 0)
+        err(1, "asprintf");
+    return path;
+}
+
+static void write_file_at(const char *path, off_t offset, const char *data)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        err(1, "open %s", path);
+    if (pwrite(fd, data, strlen(data), offset) != (ssize_t)strlen(data))
+        err(1, "pwrite %s", path);
+    close(fd);
+}
+
+/* big enough to go over the extra streams, with data that is not all alike */
+static void write_big_file(const char *path, size_t size, unsigned seed)
+{
+    char *data = malloc(size + 1);
+
+    if (!data)
+        err(1, "malloc");
+    /* no block repeats, for the delta tests */
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = 'a' + (seed >> 16) % 26;
+    }
+    data[size] = '\0';
+    write_file_at(path, 0, data);
+    free(data);
+}
+
+static void make_tree(const char *root)
+{
+    char *path;
+
+    if (mkdir(root, 0755))
+        err(1, "mkdir %s", root);
+    path = join(root, "regular");
+    write_file_at(path, 0, "some data\n");
+    free(path);
+    path = join(root, "empty");
+    write_file_at(path, 0, "");
+    free(path);
+    path = join(root, "subdir");
+    if (mkdir(path, 0750))
+        err(1, "mkdir %s", path);
+    free(path);
+    path = join(root, "subdir/link");
+    if (symlink("../regular", path))
+        err(1, "symlink %s", path);
+    free(path);
+    /* the same file under three names, in two directories */
+    path = join(root, "linked");
+    write_file_at(path, 0, "hardlinked data\n");
+    for (int i = 0; i < 2; i++) {
+        char *other = join(root, i ? "subdir/linked-2" : "linked-1");
+        if (link(path, other))
+            err(1, "link %s", other);
+        free(other);
+    }
+    free(path);
+
+    /* deep enough to need several directory lookups per file */
+    path = join(root, "a/b/c/d/e/f/g/h");
+    for (char *p = path + strlen(root) + 1; ; p++) {
+        char c = *p;
+        if (c == '/' || c == '\0') {
+            *p = '\0';
+            if (mkdir(path, 0755))
+                err(1, "mkdir %s", path);
+            *p = c;
+        }
+        if (!c)
+            break;
+    }
+    free(path);
+    path = join(root, "a/b/c/d/e/f/g/h/deep");
+    write_file_at(path, 0, "deep\n");
+    free(path);
+    path = join(root, "a/b/c/shallower");
+    write_file_at(path, 0, "shallower\n");
+    free(path);
+    /* more directories than the unpacker keeps open */
+    for (int i = 0; i < 40; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "wide-%d", i);
+        path = join(root, name);
+        if (mkdir(path, 0755))
+            err(1, "mkdir %s", path);
+        free(path);
+        snprintf(name, sizeof(name), "wide-%d/file", i);
+        path = join(root, name);
+        write_file_at(path, 0, name);
+        free(path);
+    }
+    /* read-only once its contents are written */
+    path = join(root, "readonly");
+    if (mkdir(path, 0755))
+        err(1, "mkdir %s", path);
+    free(path);
+    path = join(root, "readonly/file");
+    write_file_at(path, 0, "read-only directory\n");
+    free(path);
+    path = join(root, "readonly/big");
+    write_big_file(path, 3 << 20, 1);
+    free(path);
+    path = join(root, "subdir/big");
+    write_big_file(path, (2 << 20) + 123, 2);
+    free(path);
+    path = join(root, "readonly");
+    if (chmod(path, 0555))
+        err(1, "chmod %s", path);
+    free(path);
+
+    /* holes at the start, in the middle and at the end */
+    path = join(root, "sparse");
+    write_file_at(path, 1 << 20, "data after a hole");
+    write_file_at(path, 8 << 20, "more data");
+    if (truncate(path, 16 << 20))
+        err(1, "truncate %s", path);
+    free(path);
+}
+
+static void compare_files(const char *a, const char *b)
+{
+    char buf_a[65536], buf_b[65536];
+    ssize_t len_a, len_b;
+    int fd_a = open(a, O_RDONLY | O_CLOEXEC), fd_b = open(b, O_RDONLY | O_CLOEXEC);
+
+    assert(fd_a >= 0 && fd_b >= 0);
+    do {
+        len_a = read(fd_a, buf_a, sizeof(buf_a));
+        len_b = read(fd_b, buf_b, sizeof(buf_b));
+        assert(len_a >= 0 && len_a == len_b);
+        assert(!memcmp(buf_a, buf_b, len_a));
+    } while (len_a > 0);
+    close(fd_a);
+    close(fd_b);
+}
+
+/* recursively compare type, permissions, mtime and contents */
+static void compare_trees(const char *a, const char *b)
+{
+    struct stat st_a, st_b;
+
+    if (lstat(a, &st_a) || lstat(b, &st_b)) {
+        fprintf(stderr, "BUG: %s or %s missing\n", a, b);
+        abort();
+    }
+    assert((st_a.st_mode & S_IFMT) == (st_b.st_mode & S_IFMT));
+    if (S_ISLNK(st_a.st_mode)) {
+        char target_a[4096], target_b[4096];
+        ssize_t len_a = readlink(a, target_a, sizeof(target_a));
+        ssize_t len_b = readlink(b, target_b, sizeof(target_b));
+        assert(len_a > 0 && len_a == len_b && !memcmp(target_a, target_b, len_a));
+        return;
+    }
+    assert(st_a.st_mode == st_b.st_mode);
+    assert(st_a.st_mtim.tv_sec == st_b.st_mtim.tv_sec);
+    assert(st_a.st_mtim.tv_nsec == st_b.st_mtim.tv_nsec);
+    if (S_ISREG(st_a.st_mode)) {
+        assert(st_a.st_size == st_b.st_size);
+        compare_files(a, b);
+    } else if (S_ISDIR(st_a.st_mode)) {
+        DIR *dir = opendir(a);
+        struct dirent *ent;
+        assert(dir);
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            char *child_a = join(a, ent->d_name), *child_b = join(b, ent->d_name);
+            compare_trees(child_a, child_b);
+            free(child_a);
+            free(child_b);
+        }
+        closedir(dir);
+    }
+}
+
+static int make_writable_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)type;
+    (void)ftw;
+    if (S_ISDIR(st->st_mode))
+        chmod(path, 0700);
+    return 0;
+}
+
+static int remove_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    if (remove(path))
+        err(1, "remove %s", path);
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    /* parents first, so that read-only directories can be entered */
+    if (nftw(path, make_writable_cb, 64, FTW_PHYS) && errno != ENOENT)
+        err(1, "nftw %s", path);
+    if (nftw(path, remove_cb, 64, FTW_DEPTH | FTW_PHYS) && errno != ENOENT)
+        err(1, "nftw %s", path);
+}
+
+static pid_t spawn(int in, int out, const int *streams, const char *dir,
+                   const struct transfer *t, int packer)
+{
+    int fds[QFILE_STREAMS_MAX];
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid)
+        return pid;
+    if (dup2(in, 0) < 0 || dup2(out, 1) < 0)
+        err(1, "dup2");
+    /* the streams go to 3, 4, ..., out of the way of each other first */
+    for (int i = 0; i < t->streams; i++) {
+        if ((fds[i] = fcntl(streams[i], F_DUPFD_CLOEXEC, 64)) < 0)
+            err(1, "fcntl");
+    }
+    for (int i = 0; i < t->streams; i++) {
+        if (dup2(fds[i], 3 + i) < 0)
+            err(1, "dup2");
+        fds[i] = 3 + i;
+    }
+    /* the other ends of the pipes, so that the peer exiting is noticed */
+    if (close_range(3 + t->streams, ~0U, 0))
+        err(1, "close_range");
+    if (chdir(dir))
+        err(1, "chdir %s", dir);
+    if (packer) {
+        qfile_pack_init();
+        set_pack_streams(fds, t->streams);
+        if (t->setup_pack)
+            t->setup_pack();
+        if (t->pack)
+            t->pack();
+        else
+            do_fs_walk("tree", 0);
+        notify_end_and_wait_for_result();
+        _exit(0);
+    } else {
+        int procdir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (procdir_fd >= 0)
+            set_procfs_fd(procdir_fd);
+        set_unpack_streams(fds, t->streams);
+        /* the packer is our own, so everything it offers can be accepted */
+        set_unpack_features(QFILE_FEATURES_SUPPORTED);
+        if (t->setup_unpack)
+            t->setup_unpack();
+        _exit(do_unpack() ? 1 : 0);
+    }
+}
+
+static void wait_child(pid_t pid, const char *what, int expect_failure)
+{
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        err(1, "waitpid");
+    /* after an error, the peer may be gone before the status is sent */
+    if (expect_failure && WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE)
+        return;
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0) != !!expect_failure) {
+        fprintf(stderr, "BUG: %s %s\n", what, expect_failure ? "succeeded" : "failed");
+        abort();
+    }
+}
+
+/* transfer workdir/src/tree into dst */
+static void transfer_tree(const char *dst, const struct transfer *t)
+{
+    char *src = join(workdir, "src");
+    int to_unpacker[2], to_packer[2];
+    int pack_streams[QFILE_STREAMS_MAX], unpack_streams[QFILE_STREAMS_MAX];
+    pid_t packer, unpacker;
+
+    if (pipe2(to_unpacker, O_CLOEXEC) || pipe2(to_packer, O_CLOEXEC))
+        err(1, "pipe");
+    for (int i = 0; i < t->streams; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair))
+            err(1, "socketpair");
+        pack_streams[i] = pair[0];
+        unpack_streams[i] = pair[1];
+    }
+    unpacker = spawn(to_unpacker[0], to_packer[1], unpack_streams, dst, t, 0);
+    packer = spawn(to_packer[0], to_unpacker[1], pack_streams, src, t, 1);
+    close(to_unpacker[0]);
+    close(to_unpacker[1]);
+    close(to_packer[0]);
+    close(to_packer[1]);
+    for (int i = 0; i < t->streams; i++) {
+        close(pack_streams[i]);
+        close(unpack_streams[i]);
+    }
+    wait_child(packer, "packer", t->expect_failure);
+    wait_child(unpacker, "unpacker", t->expect_failure);
+    free(src);
+}
+
+/* transfer workdir/src/tree into workdir/dst and compare */
+static void run_transfer(const char *name, const struct transfer *t)
+{
+    char *src = join(workdir, "src"), *dst = join(workdir, "dst");
+    char *src_tree = join(src, "tree"), *dst_tree = join(dst, "tree");
+
+    if (mkdir(dst, 0700))
+        err(1, "mkdir %s", dst);
+    if (t->prepare)
+        t->prepare(dst);
+    transfer_tree(dst, t);
+    if (!t->expect_failure)
+        compare_trees(src_tree, dst_tree);
+    if (t->check)
+        t->check(dst_tree);
+    printf("%s: OK\n", name);
+    remove_tree(dst);
+    free(src);
+    free(dst);
+    free(src_tree);
+    free(dst_tree);
+}
+
+/* one side of a transfer run with the *_ctx API, in a thread */
+struct ctx_side {
+    int in, out, dir;
+    /* unpacker: lift the process-wide file limit for this context */
+    int unlimited;
+    int ret;
+};
+
+static void *ctx_pack_main(void *arg)
+{
+    struct ctx_side *side = arg;
+    struct qfile_ctx *ctx = qfile_ctx_new(side->in, side->out, side->dir);
+    uint32_t accepted;
+
+    assert(ctx);
+    side->ret = qfile_pack_init_ctx(ctx);
+    if (!side->ret)
+        side->ret = qfile_pack_negotiate_ctx(ctx,
+                QFILE_FEATURE_HARDLINK | QFILE_FEATURE_DIR_ONCE, &accepted);
+    if (!side->ret)
+        side->ret = do_fs_walk_ctx(ctx, "tree", 0);
+    if (!side->ret)
+        side->ret = notify_end_and_wait_for_result_ctx(ctx);
+    assert(!side->ret || *qfile_ctx_message(ctx));
+    qfile_ctx_free(ctx);
+    close(side->in);
+    close(side->out);
+    return NULL;
+}
+
+static void *ctx_unpack_main(void *arg)
+{
+    struct ctx_side *side = arg;
+    struct qfile_ctx *ctx = qfile_ctx_new(side->in, side->out, side->dir);
+
+    assert(ctx);
+    if (side->unlimited)
+        qfile_ctx_set_size_limit(ctx, 0, 0);
+    side->ret = do_unpack_ext_ctx(ctx, COPY_ALLOW_DIRECTORIES | COPY_ALLOW_SYMLINKS);
+    assert(side->ret == qfile_ctx_error(ctx));
+    qfile_ctx_free(ctx);
+    close(side->in);
+    close(side->out);
+    return NULL;
+}
+
+static int count_fds(void)
+{
+    DIR *d = opendir("/proc/self/fd");
+    int count = 0;
+
+    if (!d)
+        err(1, "opendir /proc/self/fd");
+    while (readdir(d))
+        count++;
+    closedir(d);
+    return count;
+}
+
+/*
+ * Run several transfers at once in the threads of one process, with one of
+ * them failing, which must not affect the others or end the process, nor
+ * leave any fds of the threads behind.
+ */
+static void run_ctx_transfers(void)
+{
+    enum { TRANSFERS = 3 };
+    char *src = join(workdir, "src"), *src_tree = join(src, "tree");
+    char *dst[TRANSFERS], *dst_tree[TRANSFERS];
+    struct ctx_side pack[TRANSFERS], unpack[TRANSFERS];
+    pthread_t threads[2 * TRANSFERS];
+    int to_unpacker[2], to_packer[2], src_fd, fds, i;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid) {
+        wait_child(pid, "ctx transfers", 0);
+        printf("ctx-threads: OK\n");
+        free(src);
+        free(src_tree);
+        return;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    /* set in this thread, for the transfer that fails */
+    set_size_limit(0, 3);
+    set_unpack_features(QFILE_FEATURES_SUPPORTED);
+    set_use_splice(1);
+    fds = count_fds();
+    src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0)
+        err(1, "open %s", src);
+    for (i = 0; i < TRANSFERS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "dst%d", i);
+        dst[i] = join(workdir, name);
+        dst_tree[i] = join(dst[i], "tree");
+        if (mkdir(dst[i], 0700))
+            err(1, "mkdir %s", dst[i]);
+        if (pipe2(to_unpacker, O_CLOEXEC) || pipe2(to_packer, O_CLOEXEC))
+            err(1, "pipe");
+        pack[i] = (struct ctx_side) { to_packer[0], to_unpacker[1], src_fd, 0, -1 };
+        unpack[i] = (struct ctx_side) {
+            to_unpacker[0], to_packer[1],
+            open(dst[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+            i != TRANSFERS - 1, -1,
+        };
+        if (unpack[i].dir < 0)
+            err(1, "open %s", dst[i]);
+        if (pthread_create(&threads[2 * i], NULL, ctx_unpack_main, &unpack[i]) ||
+                pthread_create(&threads[2 * i + 1], NULL, ctx_pack_main, &pack[i]))
+            errx(1, "pthread_create");
+    }
+    for (i = 0; i < 2 * TRANSFERS; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < TRANSFERS - 1; i++) {
+        assert(pack[i].ret == 0 && unpack[i].ret == 0);
+        compare_trees(src_tree, dst_tree[i]);
+    }
+    assert(unpack[i].ret == EDQUOT && pack[i].ret == EDQUOT);
+    for (i = 0; i < TRANSFERS; i++) {
+        close(unpack[i].dir);
+        remove_tree(dst[i]);
+    }
+    close(src_fd);
+    assert(count_fds() == fds);
+    _exit(0);
+}
+
+static void pack_sparse(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_SPARSE) == QFILE_FEATURE_SPARSE);
+}
+
+static void check_holes(const char *dst_tree)
+{
+    char *path = join(dst_tree, "sparse");
+    struct stat st;
+
+    assert(!stat(path, &st));
+    if ((long long)st.st_blocks * 512 >= st.st_size) {
+        fprintf(stderr, "BUG: holes in %s not preserved\n", path);
+        abort();
+    }
+    free(path);
+}
+
+static void pack_unbatched(void)
+{
+    set_pack_batch_size(0);
+}
+
+static void pack_compressed(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_COMPRESS) == QFILE_FEATURE_COMPRESS);
+}
+
+static void pack_compressed_unbatched(void)
+{
+    set_pack_batch_size(0);
+    pack_compressed();
+}
+
+static void pack_hardlinks(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_HARDLINK) == QFILE_FEATURE_HARDLINK);
+}
+
+static void pack_stat_threads(void)
+{
+    set_pack_stat_threads(3);
+    set_pack_readahead(4);
+}
+
+static void pack_dir_once(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_DIR_ONCE) == QFILE_FEATURE_DIR_ONCE);
+}
+
+/* the target has the read-only directory already, still empty */
+static void prepare_readonly_dir(const char *dst)
+{
+    char *dst_tree = join(dst, "tree"), *path = join(dst_tree, "readonly");
+
+    if (mkdir(dst_tree, 0755) || mkdir(path, 0555))
+        err(1, "mkdir %s", path);
+    free(path);
+    free(dst_tree);
+}
+
+static void check_hardlinks(const char *dst_tree)
+{
+    static const char *const names[] = { "linked", "linked-1", "subdir/linked-2" };
+    struct stat st[3];
+
+    for (int i = 0; i < 3; i++) {
+        char *path = join(dst_tree, names[i]);
+        assert(!stat(path, &st[i]));
+        free(path);
+    }
+    if (st[0].st_nlink != 3 || st[1].st_ino != st[0].st_ino || st[2].st_ino != st[0].st_ino) {
+        fprintf(stderr, "BUG: hardlinks not preserved\n");
+        abort();
+    }
+}
+
+static void unpack_io_uring(void)
+{
+    set_use_io_uring(1);
+}
+
+static void pack_small_buffers(void)
+{
+    set_io_buffer_size(16, 16);
+    set_pipe_size(1 << 20);
+}
+
+static void unpack_small_buffers(void)
+{
+    set_use_splice(0);
+    set_io_buffer_size(7, 7);
+}
+
+static void unpack_splice(void)
+{
+    set_use_splice(1);
+}
+
+static void unpack_sync_files(void)
+{
+    set_durability(QFILE_DURABILITY_FILE);
+}
+
+static void unpack_sync_files_io_uring(void)
+{
+    set_durability(QFILE_DURABILITY_FILE);
+    set_use_io_uring(1);
+}
+
+static void unpack_threaded(void)
+{
+    set_threaded_unpack(1);
+}
+
+static void unpack_few_files(void)
+{
+    set_size_limit(0, 5);
+}
+
+static void unpack_no_space(void)
+{
+    /* more than any filesystem has, so only the timeout ends the wait */
+    set_wait_for_space(~0UL >> 1);
+    set_wait_for_space_timeout(100);
+}
+
+static void unpack_preallocate(void)
+{
+    set_preallocate(1);
+}
+
+/* if set, fallocate() fails with it, as on filesystems without support */
+static int fallocate_errno;
+
+/* takes the place of the one in libc for the library, too */
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    if (fallocate_errno) {
+        errno = fallocate_errno;
+        return -1;
+    }
+    return syscall(SYS_fallocate, fd, mode, offset, len);
+}
+
+static void unpack_preallocate_unsupported(void)
+{
+    set_preallocate(1);
+    fallocate_errno = EOPNOTSUPP;
+}
+
+static void unpack_preallocate_over_quota(void)
+{
+    set_preallocate(1);
+    fallocate_errno = EDQUOT;
+}
+
+/* the quota never allows the file, so only the timeout ends the wait */
+static void unpack_wait_over_quota(void)
+{
+    set_wait_for_space(1);
+    set_wait_for_space_timeout(100);
+    fallocate_errno = EDQUOT;
+}
+
+static void ignore_error(const char *fmt, va_list args)
+{
+    (void)fmt;
+    (void)args;
+}
+
+static void pack_quietly(void)
+{
+    register_error_handler(ignore_error);
+}
+
+static void unpack_no_features(void)
+{
+    set_unpack_features(0);
+}
+
+static void unpack_default_features(void)
+{
+    set_unpack_features(QFILE_UNPACK_FEATURES_DEFAULT);
+}
+
+/* what could touch existing files, or needs the decompressor, is not accepted unless asked for */
+static void pack_update_refused(void)
+{
+    uint32_t offered = QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_UPDATE |
+        QFILE_FEATURE_DELTA | QFILE_FEATURE_HARDLINK | QFILE_FEATURE_COMPRESS;
+
+    assert(qfile_pack_negotiate(offered) == QFILE_FEATURE_DIR_ONCE);
+}
+
+/*
+ * Check the invariants of every report, and record the final one in
+ * workdir/progress-<side>, for check_progress() to compare.
+ */
+static void record_progress(const struct qfile_progress *p, void *opaque)
+{
+    static unsigned long long last_bytes, last_files;
+    char *path;
+    FILE *f;
+
+    assert(p->bytes >= last_bytes && p->files >= last_files);
+    assert(p->elapsed >= 0 && p->bytes_per_sec >= 0 && p->eta == -1);
+    last_bytes = p->bytes;
+    last_files = p->files;
+    if (!p->done)
+        return;
+    path = join(workdir, opaque);
+    if (!(f = fopen(path, "we")))
+        err(1, "fopen %s", path);
+    fprintf(f, "%llu %llu\n", p->bytes, p->files);
+    fclose(f);
+    free(path);
+}
+
+static void pack_progress(void)
+{
+    register_progress(record_progress, "progress-pack", 1, 0);
+}
+
+/* the data of large files is counted by the stream threads */
+static void pack_progress_striped(void)
+{
+    pack_progress();
+    assert(qfile_pack_negotiate(QFILE_FEATURE_STRIPED) == QFILE_FEATURE_STRIPED);
+}
+
+static void unpack_progress(void)
+{
+    register_progress(record_progress, "progress-unpack", 0, 1);
+}
+
+static void read_progress(const char *name, unsigned long long *bytes,
+                          unsigned long long *files)
+{
+    char *path = join(workdir, name);
+    FILE *f = fopen(path, "re");
+
+    if (!f)
+        err(1, "fopen %s", path);
+    assert(fscanf(f, "%llu %llu", bytes, files) == 2);
+    fclose(f);
+    unlink(path);
+    free(path);
+}
+
+/* both sides saw the same amount of file data and the same entries */
+static void check_progress(const char *dst_tree)
+{
+    unsigned long long pack_bytes, pack_files, unpack_bytes, unpack_files;
+
+    (void)dst_tree;
+    read_progress("progress-pack", &pack_bytes, &pack_files);
+    read_progress("progress-unpack", &unpack_bytes, &unpack_files);
+    assert(pack_bytes > 0 && pack_files > 0);
+    assert(pack_bytes == unpack_bytes && pack_files == unpack_files);
+}
+
+/* at the end of the transfer, every phase of this side has been counted */
+static void check_stats(const struct qfile_progress *p, void *opaque)
+{
+    static const enum qfile_stat pack_stats[] = {
+        QFILE_STAT_READ, QFILE_STAT_WRITE, QFILE_STAT_CRC, QFILE_STAT_OPEN_LINK,
+    };
+    static const enum qfile_stat unpack_stats[] = {
+        QFILE_STAT_READ, QFILE_STAT_WRITE, QFILE_STAT_CRC, QFILE_STAT_VALIDATE,
+        QFILE_STAT_OPEN_LINK, QFILE_STAT_METADATA,
+    };
+    const enum qfile_stat *expected = opaque ? unpack_stats : pack_stats;
+    size_t count = opaque ? 6 : 4;
+    struct qfile_stats stats;
+
+    if (!p->done)
+        return;
+    qfile_get_stats(&stats);
+    for (size_t i = 0; i < count; i++) {
+        if (!stats.bucket[expected[i]].calls) {
+            fprintf(stderr, "BUG: no %s calls\n", qfile_stat_name(expected[i]));
+            abort();
+        }
+    }
+    assert(stats.bucket[QFILE_STAT_CRC].bytes >= p->bytes);
+}
+
+static void pack_stats(void)
+{
+    set_collect_stats(1);
+    register_progress(check_stats, NULL, 0, 0);
+}
+
+static void unpack_stats(void)
+{
+    set_collect_stats(1);
+    register_progress(check_stats, "unpack", 0, 0);
+}
+
+static void pack_striped(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_STRIPED) == QFILE_FEATURE_STRIPED);
+}
+
+static void pack_striped_dir_once(void)
+{
+    uint32_t wanted = QFILE_FEATURE_STRIPED | QFILE_FEATURE_DIR_ONCE;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void pack_striped_quietly(void)
+{
+    pack_quietly();
+    pack_striped();
+}
+
+static void pack_update(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void pack_update_striped(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_STRIPED;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void pack_update_delta(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_DELTA;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void pack_update_striped_delta(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE |
+        QFILE_FEATURE_STRIPED | QFILE_FEATURE_DELTA;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+/* the tree as archived by tar(1), through a pipe */
+static void send_tar(const char *options)
+{
+    char *cmd;
+    FILE *archive;
+
+    if (asprintf(&cmd, "tar %s -cf - tree", options) < 0)
+        err(1, "asprintf");
+    if (!(archive = popen(cmd, "r")))
+        err(1, "popen %s", cmd);
+    assert(qfile_pack_tar(fileno(archive)) == 0);
+    assert(pclose(archive) == 0);
+    free(cmd);
+}
+
+static void pack_tar(void)
+{
+    send_tar("--format=pax --sparse");
+}
+
+/* the same, from a file, so that the reader can go back in it */
+static void pack_tar_seekable(void)
+{
+    char *archive = join(workdir, "tree.tar"), *cmd;
+    int fd;
+
+    if (asprintf(&cmd, "tar --format=pax --sparse -cf %s tree", archive) < 0)
+        err(1, "asprintf");
+    if (system(cmd) != 0)
+        errx(1, "%s failed", cmd);
+    if ((fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0)
+        err(1, "open %s", archive);
+    assert(qfile_pack_tar(fd) == 0);
+    close(fd);
+    unlink(archive);
+    free(cmd);
+    free(archive);
+}
+
+/* without QFILE_FEATURE_HARDLINK, the links must be copies */
+static void pack_tar_legacy(void)
+{
+    send_tar("--format=pax --sparse --hard-dereference");
+}
+
+static void pack_tar_features(void)
+{
+    uint32_t wanted = QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_HARDLINK | QFILE_FEATURE_SPARSE;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void check_tar(const char *dst_tree)
+{
+    check_hardlinks(dst_tree);
+    check_holes(dst_tree);
+}
+
+static ino_t kept_inode;
+
+/*
+ * A complete copy, then made out of date: one file changed in place with
+ * its size kept, one removed, one link retargeted.  Anything else must be
+ * left alone by the update.
+ */
+static void prepare_update(const char *dst)
+{
+    char *dst_tree = join(dst, "tree"), *path;
+    struct stat st;
+
+    transfer_tree(dst, &(struct transfer) { 0 });
+    path = join(dst_tree, "regular");
+    write_file_at(path, 0, "SOME DATA\n");
+    free(path);
+    path = join(dst_tree, "wide-3/file");
+    if (unlink(path))
+        err(1, "unlink %s", path);
+    free(path);
+    path = join(dst_tree, "subdir/link");
+    if (unlink(path) || symlink("../empty", path))
+        err(1, "symlink %s", path);
+    free(path);
+    path = join(dst_tree, "subdir/big");
+    if (stat(path, &st))
+        err(1, "stat %s", path);
+    kept_inode = st.st_ino;
+    free(path);
+    free(dst_tree);
+}
+
+static void check_update(const char *dst_tree)
+{
+    char *path = join(dst_tree, "subdir/big");
+    struct stat st;
+
+    assert(!stat(path, &st) && st.st_ino == kept_inode);
+    free(path);
+}
+
+/* drop len bytes at offset from the file, so the rest of it is shifted */
+static void cut_file(const char *path, off_t offset, size_t len)
+{
+    struct stat st;
+    char *data;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st))
+        err(1, "open %s", path);
+    if (!(data = malloc(st.st_size)))
+        err(1, "malloc");
+    if (pread(fd, data, st.st_size, 0) != st.st_size ||
+            pwrite(fd, data + offset + len, st.st_size - offset - len, offset) !=
+            (ssize_t)(st.st_size - offset - len) ||
+            ftruncate(fd, st.st_size - len))
+        err(1, "cut %s", path);
+    free(data);
+    close(fd);
+}
+
+/*
+ * Out of date large files, sent as deltas: one with a few bytes changed
+ * in place, and one that the new version has a chunk inserted into, so
+ * the matching blocks are not where they were.
+ */
+static void prepare_update_delta(const char *dst)
+{
+    char *dst_tree = join(dst, "tree"), *path;
+
+    prepare_update(dst);
+    path = join(dst_tree, "readonly/big");
+    write_file_at(path, 1 << 20, "CHANGED");
+    write_file_at(path, (3 << 20) - 3, "END");
+    free(path);
+    path = join(dst_tree, "subdir/big");
+    cut_file(path, 100000, 5000);
+    free(path);
+    free(dst_tree);
+}
+
+/* a complete copy, with only one large file out of date */
+static void prepare_update_delta_one(const char *dst)
+{
+    char *dst_tree = join(dst, "tree"), *path;
+
+    transfer_tree(dst, &(struct transfer) { 0 });
+    path = join(dst_tree, "readonly/big");
+    write_file_at(path, 1 << 20, "CHANGED");
+    free(path);
+    free(dst_tree);
+}
+
+/*
+ * The old file changes after its signature was sent, so the blocks copied
+ * from it do not add up to the new file, which then has to be sent again.
+ * Only that file has data to send, so the first report with bytes comes
+ * from its delta, before the unpacker has copied any block.
+ */
+static void change_old_file(const struct qfile_progress *p, void *opaque)
+{
+    static int changed;
+    char *path;
+
+    (void)opaque;
+    if (changed || !p->bytes)
+        return;
+    path = join(workdir, "dst/tree/readonly/big");
+    write_file_at(path, 2 << 20, "CHANGED AGAIN");
+    free(path);
+    changed = 1;
+}
+
+static void pack_update_delta_changed(void)
+{
+    register_progress(change_old_file, NULL, 0, 0);
+    pack_update_delta();
+}
+
+/*
+ * From a pipe, the delta of a member has no blocks of the old file, so
+ * changing it does not matter; from a file, the member is sent again.
+ */
+static void pack_tar_update_delta_changed(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_DELTA |
+        QFILE_FEATURE_HARDLINK | QFILE_FEATURE_SPARSE;
+
+    register_progress(change_old_file, NULL, 0, 0);
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static const uint8_t digest_key[QFILE_DIGEST_KEY_LEN] = "0123456789abcdef0123456789abcdef";
+
+static void pack_digest(void)
+{
+    uint32_t wanted = QFILE_FEATURE_DIGEST | QFILE_FEATURE_SPARSE |
+        QFILE_FEATURE_HARDLINK | QFILE_FEATURE_COMPRESS;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void unpack_digest_threaded(void)
+{
+    set_threaded_unpack(1);
+    set_digest_threads(3);
+}
+
+static void check_digest(const char *dst_tree)
+{
+    check_hardlinks(dst_tree);
+    check_holes(dst_tree);
+}
+
+static void pack_digest_keyed_striped(void)
+{
+    uint32_t wanted = QFILE_FEATURE_DIGEST | QFILE_FEATURE_STRIPED;
+
+    set_digest_key(digest_key);
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void unpack_digest_keyed(void)
+{
+    set_digest_key(digest_key);
+    set_use_io_uring(1);
+}
+
+/* the packer has no key, so none of the digests match */
+static void pack_digest_unkeyed_quietly(void)
+{
+    pack_quietly();
+    assert(qfile_pack_negotiate(QFILE_FEATURE_DIGEST) == QFILE_FEATURE_DIGEST);
+}
+
+static void pack_update_delta_digest(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE |
+        QFILE_FEATURE_DELTA | QFILE_FEATURE_DIGEST;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+/*
+ * An update that fails on the one file it sends, which is there already:
+ * the digest does not match, and the old version must stay.
+ */
+static void prepare_update_failed(const char *dst)
+{
+    char *dst_tree = join(dst, "tree"), *path;
+
+    transfer_tree(dst, &(struct transfer) { 0 });
+    path = join(dst_tree, "regular");
+    write_file_at(path, 0, "SOME DATA\n");
+    free(path);
+    free(dst_tree);
+}
+
+static void pack_update_digest_unkeyed_quietly(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE |
+        QFILE_FEATURE_DIGEST;
+
+    pack_quietly();
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+/* the old file is whole, and no temporary names are left next to it */
+static void check_old_file(const char *dir_path, const char *name, off_t offset,
+                           const char *data)
+{
+    char *path = join(dir_path, name);
+    char buf[16];
+    size_t len = strlen(data);
+    struct dirent *d;
+    DIR *dir;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    assert(fd >= 0 && pread(fd, buf, len, offset) == (ssize_t)len);
+    assert(!memcmp(buf, data, len));
+    close(fd);
+    free(path);
+    dir = opendir(dir_path);
+    assert(dir);
+    while ((d = readdir(dir)))
+        assert(strncmp(d->d_name, ".qfile-", 7));
+    closedir(dir);
+}
+
+static void check_update_failed(const char *dst_tree)
+{
+    check_old_file(dst_tree, "regular", 0, "SOME DATA\n");
+}
+
+static void pack_update_delta_digest_unkeyed_quietly(void)
+{
+    uint32_t wanted = QFILE_FEATURE_UPDATE | QFILE_FEATURE_DIR_ONCE |
+        QFILE_FEATURE_DELTA | QFILE_FEATURE_DIGEST;
+
+    pack_quietly();
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void check_update_delta_failed(const char *dst_tree)
+{
+    char *path = join(dst_tree, "readonly");
+
+    check_old_file(path, "big", 1 << 20, "CHANGED");
+    free(path);
+}
+
+static void pack_tar_digest(void)
+{
+    uint32_t wanted = QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_HARDLINK |
+        QFILE_FEATURE_SPARSE | QFILE_FEATURE_DIGEST;
+
+    assert(qfile_pack_negotiate(wanted) == wanted);
+}
+
+static void pack_sparse_refused(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_SPARSE) == 0);
+}
+
+/* the decompressor is not exposed to the packer unless asked for */
+static void pack_compressed_refused(void)
+{
+    assert(qfile_pack_negotiate(QFILE_FEATURE_COMPRESS) == 0);
+}
+
+int main(void)
+{
+    const char *parent = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+    char *src, *path;
+
+    workdir = join(parent, "qfile-test.XXXXXX");
+    if (!mkdtemp(workdir))
+        err(1, "mkdtemp %s", workdir);
+    src = join(workdir, "src");
+    if (mkdir(src, 0755))
+        err(1, "mkdir %s", src);
+    path = join(src, "tree");
+    make_tree(path);
+    free(path);
+
+    run_transfer("legacy", &(struct transfer) { 0 });
+    run_transfer("unbatched", &(struct transfer) { .setup_pack = pack_unbatched });
+    run_transfer("sparse-refused", &(struct transfer) {
+        .setup_pack = pack_sparse_refused,
+        .setup_unpack = unpack_no_features,
+    });
+    run_transfer("sparse", &(struct transfer) {
+        .setup_pack = pack_sparse,
+        .check = check_holes,
+    });
+    run_transfer("io_uring", &(struct transfer) { .setup_unpack = unpack_io_uring });
+    run_transfer("small-buffers", &(struct transfer) {
+        .setup_pack = pack_small_buffers,
+        .setup_unpack = unpack_small_buffers,
+    });
+    run_transfer("splice", &(struct transfer) { .setup_unpack = unpack_splice });
+    run_transfer("sync-files", &(struct transfer) { .setup_unpack = unpack_sync_files });
+    run_transfer("sync-files-io_uring", &(struct transfer) {
+        .setup_unpack = unpack_sync_files_io_uring,
+    });
+    run_transfer("rejected", &(struct transfer) {
+        .setup_pack = pack_quietly,
+        .setup_unpack = unpack_few_files,
+        .expect_failure = 1,
+    });
+    run_transfer("no-space", &(struct transfer) {
+        .setup_pack = pack_quietly,
+        .setup_unpack = unpack_no_space,
+        .expect_failure = 1,
+    });
+    run_transfer("preallocate", &(struct transfer) { .setup_unpack = unpack_preallocate });
+    run_transfer("preallocate-unsupported", &(struct transfer) {
+        .setup_unpack = unpack_preallocate_unsupported,
+    });
+    run_transfer("preallocate-over-quota", &(struct transfer) {
+        .setup_pack = pack_quietly,
+        .setup_unpack = unpack_preallocate_over_quota,
+        .expect_failure = 1,
+    });
+    run_transfer("wait-over-quota", &(struct transfer) {
+        .setup_pack = pack_quietly,
+        .setup_unpack = unpack_wait_over_quota,
+        .expect_failure = 1,
+    });
+    run_transfer("compressed", &(struct transfer) { .setup_pack = pack_compressed });
+    run_transfer("compressed-refused", &(struct transfer) {
+        .setup_pack = pack_compressed_refused,
+        .setup_unpack = unpack_default_features,
+    });
+    run_transfer("compressed-unbatched", &(struct transfer) {
+        .setup_pack = pack_compressed_unbatched,
+    });
+    run_transfer("compressed-threaded", &(struct transfer) {
+        .setup_pack = pack_compressed,
+        .setup_unpack = unpack_threaded,
+    });
+    run_transfer("hardlinks", &(struct transfer) {
+        .setup_pack = pack_hardlinks,
+        .check = check_hardlinks,
+    });
+    run_transfer("hardlinks-io_uring", &(struct transfer) {
+        .setup_pack = pack_hardlinks,
+        .setup_unpack = unpack_io_uring,
+        .check = check_hardlinks,
+    });
+    run_transfer("stat-threads", &(struct transfer) { .setup_pack = pack_stat_threads });
+    run_transfer("dir-once", &(struct transfer) { .setup_pack = pack_dir_once });
+    run_transfer("dir-once-existing", &(struct transfer) {
+        .setup_pack = pack_dir_once,
+        .setup_unpack = unpack_default_features,
+        .prepare = prepare_readonly_dir,
+    });
+    run_transfer("dir-once-io_uring", &(struct transfer) {
+        .setup_pack = pack_dir_once,
+        .setup_unpack = unpack_io_uring,
+    });
+    run_transfer("striped", &(struct transfer) {
+        .setup_pack = pack_striped,
+        .streams = 3,
+    });
+    run_transfer("striped-dir-once-io_uring", &(struct transfer) {
+        .setup_pack = pack_striped_dir_once,
+        .setup_unpack = unpack_sync_files_io_uring,
+        .streams = 2,
+    });
+    run_transfer("striped-rejected", &(struct transfer) {
+        .setup_pack = pack_striped_quietly,
+        .setup_unpack = unpack_few_files,
+        .expect_failure = 1,
+        .streams = 2,
+    });
+    run_transfer("update", &(struct transfer) {
+        .setup_pack = pack_update,
+        .prepare = prepare_update,
+        .check = check_update,
+    });
+    run_transfer("update-refused", &(struct transfer) {
+        .setup_pack = pack_update_refused,
+        .setup_unpack = unpack_default_features,
+    });
+    run_transfer("update-delta", &(struct transfer) {
+        .setup_pack = pack_update_delta,
+        .prepare = prepare_update_delta,
+    });
+    run_transfer("update-delta-striped", &(struct transfer) {
+        .setup_pack = pack_update_striped_delta,
+        .prepare = prepare_update_delta,
+        .streams = 2,
+    });
+    run_transfer("update-delta-changed", &(struct transfer) {
+        .setup_pack = pack_update_delta_changed,
+        .prepare = prepare_update_delta_one,
+    });
+    run_transfer("update-striped", &(struct transfer) {
+        .setup_pack = pack_update_striped,
+        .prepare = prepare_update,
+        .check = check_update,
+        .streams = 2,
+    });
+    run_transfer("tar", &(struct transfer) {
+        .setup_pack = pack_tar_features,
+        .pack = pack_tar,
+        .check = check_tar,
+    });
+    run_transfer("tar-legacy", &(struct transfer) {
+        .pack = pack_tar_legacy,
+    });
+    run_transfer("tar-update-delta-changed", &(struct transfer) {
+        .setup_pack = pack_tar_update_delta_changed,
+        .pack = pack_tar,
+        .prepare = prepare_update_delta_one,
+    });
+    run_transfer("tar-update-delta-changed-seekable", &(struct transfer) {
+        .setup_pack = pack_tar_update_delta_changed,
+        .pack = pack_tar_seekable,
+        .prepare = prepare_update_delta_one,
+    });
+    run_transfer("digest", &(struct transfer) {
+        .setup_pack = pack_digest,
+        .setup_unpack = unpack_digest_threaded,
+        .check = check_digest,
+    });
+    run_transfer("digest-keyed-striped", &(struct transfer) {
+        .setup_pack = pack_digest_keyed_striped,
+        .setup_unpack = unpack_digest_keyed,
+        .streams = 2,
+    });
+    run_transfer("digest-wrong-key", &(struct transfer) {
+        .setup_pack = pack_digest_unkeyed_quietly,
+        .setup_unpack = unpack_digest_keyed,
+        .expect_failure = 1,
+    });
+    run_transfer("update-delta-digest", &(struct transfer) {
+        .setup_pack = pack_update_delta_digest,
+        .prepare = prepare_update_delta,
+    });
+    run_transfer("update-failed", &(struct transfer) {
+        .setup_pack = pack_update_digest_unkeyed_quietly,
+        .setup_unpack = unpack_digest_keyed,
+        .prepare = prepare_update_failed,
+        .check = check_update_failed,
+        .expect_failure = 1,
+    });
+    run_transfer("update-delta-failed", &(struct transfer) {
+        .setup_pack = pack_update_delta_digest_unkeyed_quietly,
+        .setup_unpack = unpack_digest_keyed,
+        .prepare = prepare_update_delta_one,
+        .check = check_update_delta_failed,
+        .expect_failure = 1,
+    });
+    run_transfer("tar-digest", &(struct transfer) {
+        .setup_pack = pack_tar_digest,
+        .pack = pack_tar,
+        .check = check_tar,
+    });
+    run_ctx_transfers();
+    run_transfer("progress", &(struct transfer) {
+        .setup_pack = pack_progress,
+        .setup_unpack = unpack_progress,
+        .check = check_progress,
+    });
+    run_transfer("progress-striped", &(struct transfer) {
+        .setup_pack = pack_progress_striped,
+        .setup_unpack = unpack_progress,
+        .check = check_progress,
+        .streams = 2,
+    });
+    run_transfer("stats", &(struct transfer) {
+        .setup_pack = pack_stats,
+        .setup_unpack = unpack_stats,
+    });
+    run_transfer("threaded", &(struct transfer) { .setup_unpack = unpack_threaded });
+    run_transfer("threaded-sparse", &(struct transfer) {
+        .setup_pack = pack_sparse,
+        .setup_unpack = unpack_threaded,
+        .check = check_holes,
+    });
+
+    remove_tree(workdir);
+    free(src);
+    free(workdir);
+    return 0;
+}
@@ -24,7 +24,10 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include "libqubes-rpc-filecopy.h"
+#include "ioall.h"
+#include "stats.h"
 
 static void perror_wrapper(const char * msg)
 {
@@ -53,8 +56,11 @@ int write_all(int fd, const void *buf, int size)
 {
     int written = 0;
     int ret;
+    uint64_t t;
     while (written < size) {
+        t = stats_begin();
         ret = write(fd, (char *) buf + written, size - written);
+        stats_end(QFILE_STAT_WRITE, t, ret > 0 ? ret : 0);
         if (ret == -1 && errno == EINTR)
             continue;
         if (ret <= 0) {
@@ -70,8 +76,11 @@ int read_all(int fd, void *buf, int size)
 {
     int got_read = 0;
     int ret;
+    uint64_t t;
     while (got_read < size) {
+        t = stats_begin();
         ret = read(fd, (char *) buf + got_read, size - got_read);
+        stats_end(QFILE_STAT_READ, t, ret > 0 ? ret : 0);
         if (ret == -1 && errno == EINTR)
             continue;
         if (ret == 0) {
@@ -97,9 +106,17 @@ int read_all(int fd, void *buf, int size)
 int copy_fd_all(int fdout, int fdin)
 {
     int ret;
-    char buf[4096];
+    char fallback[4096];
+    char *buf;
+    size_t buf_size;
+
+    buf = get_io_buffer(LLONG_MAX, &buf_size);
+    if (!buf) {
+        buf = fallback;
+        buf_size = sizeof(fallback);
+    }
     for (;;) {
-        ret = read(fdin, buf, sizeof(buf));
+        ret = read(fdin, buf, buf_size);
         if (ret == -1 && errno == EINTR)
             continue;
         if (!ret)
@@ -1,5 +1,28 @@
+#include <stddef.h>
+
+struct digest;
+
 int write_all(int fd, const void *buf, int size);
 int read_all(int fd, void *buf, int size);
 int copy_fd_all(int fdout, int fdin);
 void set_nonblock(int fd);
 void set_block(int fd);
+/*
+ * The shared transfer buffer, sized for a copy of want bytes (see
+ * set_io_buffer_size()); NULL if it cannot be allocated.
+ */
+char *get_io_buffer(long long want, size_t *len);
+/* free the buffer of the calling thread, for threads that end */
+void release_io_buffer(void);
+/*
+ * copy_file() and copy_file_splice(), also hashing the data into digest
+ * (QFILE_FEATURE_DIGEST) if it is not NULL.
+ */
+int copy_file_hash(int outfd, int infd, long long size, unsigned long *crc32,
+                   struct digest *digest);
+int copy_file_splice_hash(int outfd, int infd, long long size, unsigned long *crc32,
+                          struct digest *digest);
+/* close the tee() pipe of copy_file_splice() in the calling thread */
+void release_splice_pipe(void);
+/* apply set_pipe_size() to fd, if it is a pipe */
+void tune_pipe_size(int fd);
@@ -50,6 +50,183 @@ struct result_header {
     uint64_t crc32;
 } __attribute__((packed));
 
+/*
+ * Protocol extensions are negotiated before the first file: the packer sends
+ * a file_header with namelen set to QFILE_HELLO_MAGIC (which older unpackers
+ * reject as too long) and filelen set to the QFILE_FEATURE_* bits it offers.
+ * The unpacker answers with struct qfile_hello_reply, in place of where
+ * a result_header would be, holding the subset it accepts.
+ */
+#define QFILE_HELLO_MAGIC 0x51464831
+
+struct qfile_hello_reply {
+    uint32_t magic;
+    uint32_t _pad;
+    uint64_t features;
+} __attribute__((packed));
+
+/* regular files may be sent as a list of data and hole segments */
+#define QFILE_FEATURE_SPARSE (1 << 0)
+/* everything the packer sends after the hello is in compressed frames */
+#define QFILE_FEATURE_COMPRESS (1 << 1)
+/* further names of an already sent file are sent as QFILE_MODE_HARDLINK */
+#define QFILE_FEATURE_HARDLINK (1 << 2)
+/*
+ * directories are sent once, before their contents, instead of again after
+ * them; the unpacker applies their metadata when the stream leaves them
+ */
+#define QFILE_FEATURE_DIR_ONCE (1 << 3)
+/*
+ * the data of large regular files is sent over extra streams, see
+ * QFILE_MODE_STRIPED; the hello has their number in mode, and the unpacker
+ * accepts only if it has as many
+ */
+#define QFILE_FEATURE_STRIPED (1 << 4)
+#define QFILE_STREAMS_MAX 16
+/*
+ * update the target directory in place: regular files that are there
+ * already with the same size, mtime and permissions are not sent again,
+ * see QFILE_UPDATE_SEND; only accepted together with QFILE_FEATURE_DIR_ONCE
+ */
+#define QFILE_FEATURE_UPDATE (1 << 5)
+/*
+ * with QFILE_FEATURE_UPDATE, large files that changed may be sent as a delta
+ * against the old version, see QFILE_UPDATE_DELTA
+ */
+#define QFILE_FEATURE_DELTA (1 << 6)
+/* the data of each regular file is followed by its digest, see QFILE_DIGEST_LEN */
+#define QFILE_FEATURE_DIGEST (1 << 7)
+
+#define QFILE_FEATURES_SUPPORTED (QFILE_FEATURE_SPARSE | QFILE_FEATURE_COMPRESS | \
+        QFILE_FEATURE_HARDLINK | QFILE_FEATURE_DIR_ONCE | QFILE_FEATURE_STRIPED | \
+        QFILE_FEATURE_UPDATE | QFILE_FEATURE_DELTA | QFILE_FEATURE_DIGEST)
+/* accepted by the unpacker unless set_unpack_features() says otherwise */
+#define QFILE_UNPACK_FEATURES_DEFAULT (QFILE_FEATURE_SPARSE | QFILE_FEATURE_DIR_ONCE)
+
+/*
+ * Extension flags in file_header.mode, above the file type bits.  Only sent
+ * if the corresponding feature was negotiated.
+ */
+#define QFILE_MODE_SPARSE (1U << 16)
+/*
+ * A regular file that is another name of a file sent earlier in the same
+ * transfer.  The data is the path of that file (without a terminating NUL,
+ * as for symlinks), and the times and permissions are ignored.
+ */
+#define QFILE_MODE_HARDLINK (1U << 17)
+/*
+ * A regular file whose data is not on this stream, but on the next of the
+ * extra streams: the first such file goes to the first stream, and so on
+ * round-robin.  Each extra stream is just the data of its files, in order,
+ * followed by the CRC-32 of all of it (uint32_t) at the end of the transfer.
+ */
+#define QFILE_MODE_STRIPED (1U << 18)
+
+/*
+ * With QFILE_MODE_SPARSE, the file data is a sequence of segments; data
+ * segments are followed by their contents, hole segments are not.  The
+ * segment lengths are nonzero and add up to file_header.filelen.  The CRC
+ * of the transfer covers the stream as sent: the segment records and the
+ * data segments, but not the zeros of the holes, so with this feature it no
+ * longer covers what the unpacked files contain, byte for byte.
+ */
+struct sparse_segment {
+    uint32_t type;
+    uint32_t _pad;
+    uint64_t length;
+};
+
+enum {
+    SPARSE_SEGMENT_DATA = 1,
+    SPARSE_SEGMENT_HOLE = 2,
+};
+
+/*
+ * With QFILE_FEATURE_COMPRESS, the stream is cut into frames of at most
+ * QFILE_FRAME_MAX bytes, each compressed on its own (LZ4 block format) and
+ * sent after this header, or stored as is if comp_len is 0.  The CRC is
+ * still computed over the uncompressed stream.
+ */
+#define QFILE_FRAME_MAX 65536
+
+struct compressed_frame {
+    uint32_t raw_len;
+    uint32_t comp_len;
+};
+
+/*
+ * With QFILE_FEATURE_UPDATE, the packer waits after the header and name of
+ * each regular file (except QFILE_MODE_HARDLINK) for the unpacker to answer
+ * with a result_header whose _pad is one of these, and sends the data only
+ * if it is QFILE_UPDATE_SEND.  A skipped file has no data at all, and does
+ * not go to an extra stream.  A real result (_pad 0) may come instead if the
+ * transfer has failed.  Existing entries in the way of the new ones are
+ * removed, and existing directories are entered as if they had been created
+ * (writable by the owner until the stream leaves them).
+ */
+#define QFILE_UPDATE_SEND 0x51465553
+#define QFILE_UPDATE_SKIP 0x5146534b
+
+/*
+ * With QFILE_FEATURE_DELTA, the unpacker may answer QFILE_UPDATE_DELTA for a
+ * file (not QFILE_MODE_SPARSE) that it has an older version of.  The token
+ * is followed by a delta_signature and then a delta_block for each block of
+ * the old file; the last block may be short.  Instead of the data, the
+ * packer sends delta_records on the main stream (never an extra one) that
+ * add up to filelen bytes, and then a DELTA_RECORD_END.  The unpacker
+ * answers that with QFILE_UPDATE_SKIP if the file it has built matches it,
+ * or with QFILE_UPDATE_SEND if not (the old file changed on the way, say),
+ * and the packer then sends all of the data again, as for a new file, on
+ * the main stream.
+ */
+#define QFILE_UPDATE_DELTA 0x51464454
+#define QFILE_DELTA_MAX_BLOCKS (1 << 22)
+#define QFILE_DELTA_STRONG_LEN 16
+
+struct delta_signature {
+    /* a power of two, from 512 to 16 MiB */
+    uint32_t block_size;
+    uint32_t _pad;
+    /* of the old file; at most QFILE_DELTA_MAX_BLOCKS blocks */
+    uint64_t size;
+};
+
+struct delta_block {
+    /* rsync's rolling checksum */
+    uint32_t weak;
+    /* the unkeyed BLAKE3 hash of the block, truncated */
+    uint8_t strong[QFILE_DELTA_STRONG_LEN];
+};
+
+struct delta_record {
+    uint32_t type;
+    uint32_t count;
+    uint64_t value;
+};
+
+enum {
+    /* value bytes of data follow */
+    DELTA_RECORD_LITERAL = 1,
+    /* count blocks of the old file, from block number value */
+    DELTA_RECORD_COPY = 2,
+    /* value is the CRC-32 of the whole new file */
+    DELTA_RECORD_END = 3,
+};
+
+/*
+ * With QFILE_FEATURE_DIGEST, the data of each regular file that is sent
+ * (not QFILE_MODE_HARDLINK, nor skipped by QFILE_UPDATE_SKIP) is followed by
+ * the BLAKE3 hash of the whole file, holes included, on the same stream as
+ * the data.  It is keyed if set_digest_key() was used, which has to be done
+ * on both ends with the same key.  The unpacker hashes the data as it comes
+ * in (a file built from a delta is read back instead, see
+ * set_digest_threads()), and fails the transfer with EBADMSG if the digests
+ * differ.  The digest goes with the data, rather than in the result_header
+ * at the end, so that each file is checked before it gets its name.
+ */
+#define QFILE_DIGEST_LEN 32
+#define QFILE_DIGEST_KEY_LEN 32
+
 /* optional info about last processed file */
 struct result_header_ext {
     uint32_t last_namelen;
@@ -78,8 +255,111 @@ typedef void (error_handler_t)(const char *fmt, va_list args);
 void register_notify_progress(notify_progress_t *func);
 void register_error_handler(error_handler_t *func);
 
+struct qfile_progress {
+    unsigned long long bytes;       /* file data transferred so far */
+    unsigned long long files;       /* entries of any type */
+    unsigned long long total_bytes; /* from set_progress_total(), 0 if unknown */
+    double elapsed;                 /* seconds since the transfer started */
+    double bytes_per_sec;           /* recent throughput */
+    double eta;                     /* seconds left, -1 if unknown */
+    int done;                       /* set in the final report */
+};
+typedef void (progress_report_t)(const struct qfile_progress *progress, void *opaque);
+/*
+ * Aggregated progress, instead of a callback for every chunk.  func is
+ * called once bytes_delta bytes of file data were transferred, or once
+ * msec_delta milliseconds passed, since the last report, whichever comes
+ * first; 0 disables that limit, and both 0 report every update.  The
+ * elapsed time is checked every 64 KiB and after each file.  There is a
+ * final report with done set at the end of the transfer.  NULL func
+ * disables it.  Independent of register_notify_progress().  Data of
+ * QFILE_FEATURE_STRIPED streams is counted as their threads copy it, and
+ * reported from the transfer's thread after each file, or every 50ms while
+ * it waits for the streams.
+ */
+void register_progress(progress_report_t *func, void *opaque,
+        unsigned long long bytes_delta, unsigned long msec_delta);
+/* expected amount of file data, for the ETA; 0 if not known */
+void set_progress_total(unsigned long long bytes);
+
+/*
+ * Transfer statistics: for each phase, the number of calls, the bytes they
+ * moved (for read, write and crc) and the time spent, in nanoseconds of
+ * CLOCK_MONOTONIC.  They are process-wide, summed over all the transfers
+ * since the last qfile_reset_stats(), whichever thread runs them.  The
+ * reader thread of set_threaded_unpack() runs concurrently, so the times can
+ * add up to more than the wall time.
+ */
+enum qfile_stat {
+    QFILE_STAT_READ,        /* reads from the pipe or the source files */
+    QFILE_STAT_WRITE,       /* writes to the pipe or the received files */
+    QFILE_STAT_CRC,
+    QFILE_STAT_VALIDATE,    /* file and symlink name validation */
+    QFILE_STAT_OPEN_LINK,   /* opening, creating and linking files and directories */
+    QFILE_STAT_METADATA,    /* fix_times_and_perms() */
+    QFILE_STAT_WAIT_RESULT, /* the packer waiting for the unpacker, includes its read */
+    QFILE_STAT_COUNT,
+};
+struct qfile_stats {
+    struct {
+        unsigned long long calls;
+        unsigned long long bytes;
+        unsigned long long nsec;
+    } bucket[QFILE_STAT_COUNT];
+};
+/*
+ * Collect statistics (disabled by default).  Setting the QUBES_FILECOPY_STATS
+ * environment variable enables them too, and prints them to stderr at the
+ * end of each transfer.
+ */
+void set_collect_stats(int value);
+void qfile_get_stats(struct qfile_stats *stats);
+void qfile_reset_stats(void);
+const char *qfile_stat_name(enum qfile_stat stat);
+
 /* common functions */
 int copy_file(int outfd, int infd, long long size, unsigned long *crc32);
+/*
+ * Same as copy_file(), but when infd is a pipe move the data to outfd with
+ * splice(2), if enabled with set_use_splice().  This is not zero-copy: the
+ * CRC needs the data in userspace, so it is duplicated with tee(2) into a
+ * second pipe and read from there.  Falls back to copy_file() automatically
+ * when infd is not a pipe or outfd does not support splicing.
+ */
+int copy_file_splice(int outfd, int infd, long long size, unsigned long *crc32);
+/*
+ * Enable or disable (the default) the splice(2) path of copy_file_splice().
+ * It has not been measured to beat the plain read()/write() copy, so it is
+ * off unless asked for.
+ */
+void set_use_splice(int value);
+/*
+ * Size of the buffer copy_file() and copy_fd_all() move data through.  Each
+ * copy uses a buffer as big as the data, but at least min and at most max
+ * bytes (64 KiB and 4 MiB by default; neither above 1 GiB).  The buffer is
+ * kept for later copies of the thread, and freed when a *_ctx transfer ends.
+ */
+void set_io_buffer_size(size_t min, size_t max);
+/*
+ * Grow stdin and stdout to this many bytes with F_SETPIPE_SZ, if they are
+ * pipes, at the start of each transfer.  Unprivileged processes are limited
+ * by /proc/sys/fs/pipe-max-size (1 MiB by default).  0 (the default) keeps
+ * the kernel default of 64 KiB.
+ */
+void set_pipe_size(int bytes);
+/*
+ * Key for QFILE_FEATURE_DIGEST (QFILE_DIGEST_KEY_LEN bytes), so that the
+ * digests authenticate the files too; NULL (the default) for plain hashes.
+ */
+void set_digest_key(const uint8_t *key);
+/*
+ * Files built from a delta (QFILE_FEATURE_DELTA) are read back to be hashed;
+ * do that in up to this many threads, as subtrees of the digest, with at
+ * least 8 MiB of the file for each, so files under 16 MiB are hashed in the
+ * calling thread.  0 (the default) hashes in the calling thread only.  Other
+ * files are hashed as their data comes in, which needs no threads.
+ */
+void set_digest_threads(int threads);
 const char *copy_file_status_to_str(int status);
 void set_size_limit(unsigned long long new_bytes_limit, unsigned long long new_files_limit);
 void set_verbose(int value);
@@ -88,6 +368,39 @@ void set_verbose(int value);
  * for this file, plus a given margin.
  */
 void set_wait_for_space(unsigned long margin);
+/*
+ * Give up waiting for space after this many milliseconds, failing with
+ * ENOSPC.  0 (the default) waits forever.  Once the space is there, the
+ * file is preallocated with fallocate(), so that it cannot be taken away;
+ * if the quota does not allow that, the wait goes on, and fails with EDQUOT.
+ */
+void set_wait_for_space_timeout(unsigned long msec);
+/*
+ * Preallocate each regular file of 1 MiB or more with fallocate() before
+ * its data arrives, to reduce fragmentation.  The size comes from the
+ * packer, which can thus reserve space it never fills, and copy-on-write
+ * filesystems gain nothing from it.  Filesystems without fallocate() just
+ * get the data; a file that does not fit the space or the quota fails the
+ * transfer with ENOSPC or EDQUOT.  Disabled by default.
+ */
+void set_preallocate(int value);
+enum qfile_durability {
+    /* leave writeback to the kernel */
+    QFILE_DURABILITY_NONE,
+    /*
+     * fdatasync() each regular file before it is linked under its name, so
+     * that a crash cannot leave a named file with missing data, and fsync()
+     * each directory that entries were added to once the transfer is done
+     * with it, so that the names are not lost either.  The fdatasync()
+     * calls are batched through io_uring if enabled; otherwise each file
+     * waits for its own.
+     */
+    QFILE_DURABILITY_FILE,
+    /* syncfs() the whole target filesystem at the end (the default) */
+    QFILE_DURABILITY_FS,
+};
+/* how to make the received files durable, see enum qfile_durability */
+void set_durability(enum qfile_durability value);
 /* register open fd to /proc/PID/fd of this process */
 void set_procfs_fd(int value);
 int write_all(int fd, const void *buf, int size);
@@ -101,18 +414,134 @@ extern unsigned long Crc32_ComputeBuf( unsigned long inCrc32, const void *buf,
         size_t bufLen );
 extern int do_unpack(void);
 extern int do_unpack_ext(int flags);
+/*
+ * Protocol extensions (QFILE_FEATURE_*) to accept if the packer offers them.
+ * Defaults to QFILE_UNPACK_FEATURES_DEFAULT, which do not let the packer do
+ * anything it could not do without them.  The others have to be enabled
+ * here: QFILE_FEATURE_UPDATE and QFILE_FEATURE_DELTA let the packer replace
+ * what is already in the target directory, and tell it which files are
+ * there; QFILE_FEATURE_HARDLINK lets it link to files that were there
+ * before the transfer; QFILE_FEATURE_COMPRESS runs all of the stream through
+ * a decompressor, which is more code exposed to the packer's data;
+ * QFILE_FEATURE_STRIPED needs set_unpack_streams() too; and
+ * QFILE_FEATURE_DIGEST costs hashing each received file, and reading back
+ * those built from a delta.
+ */
+void set_unpack_features(uint32_t features);
+/*
+ * Batch the syscalls that finish each file (linkat/symlinkat and closes)
+ * through io_uring.  Falls back to plain syscalls if io_uring is not
+ * available.  Disabled by default.
+ */
+void set_use_io_uring(int value);
+/*
+ * Read stdin (and verify the checksum) in a separate thread, through a
+ * bounded ring buffer, so that reading overlaps with writing files.  Falls
+ * back to the single-threaded path if the thread cannot be started.
+ * Disabled by default.  Must not be combined with other readers of stdin.
+ */
+void set_threaded_unpack(int value);
+/*
+ * Extra streams to accept QFILE_FEATURE_STRIPED with, in the same order as
+ * the packer's, at most QFILE_STREAMS_MAX.  The fds stay owned by the
+ * caller.  0 streams (the default) refuses the feature, which also has to
+ * be enabled with set_unpack_features().
+ */
+void set_unpack_streams(const int *fds, int count);
 
 /* packing */
 int single_file_processor(const char *filename, const struct stat *st);
 int do_fs_walk(const char *file, int ignore_symlinks);
+/*
+ * Send the members of a tar archive read from fd (ustar, with the GNU and
+ * pax extensions: long names, times with nanoseconds, sparse members), as
+ * do_fs_walk() would send the files themselves.  Devices and FIFOs are left
+ * out.  Hardlinks need QFILE_FEATURE_HARDLINK; sparse members are sent with
+ * their holes filled in unless QFILE_FEATURE_SPARSE was accepted.  The
+ * archive is read once, front to back, so fd can be a pipe.
+ */
+int qfile_pack_tar(int fd);
 /* used in tar2qfile to alter only headers, but keep original file stream */
 void write_headers(const struct file_header *hdr, const char *filename);
 int copy_file_with_crc(int outfd, int infd, long long size);
 /* MUST be called before first do_fs_walk/single_file_processor */
 void qfile_pack_init(void);
 void set_ignore_quota_error(int value);
+/*
+ * Prefetch the regular files among this many directory entries ahead of
+ * the one being sent (at most 128), with posix_fadvise(POSIX_FADV_WILLNEED).
+ * It is done by the threads of set_pack_stat_threads() (one if none were
+ * set), which then stat no further ahead than that.  The output is the
+ * same.  0 (the default) disables it.
+ */
+void set_pack_readahead(int files);
+/*
+ * Stat directory entries ahead of the walk in this many threads, for
+ * filesystems where each stat may block (cold caches, network filesystems).
+ * Entries are still sent in the same order.  0 (the default) stats each
+ * entry right before it is sent.
+ */
+void set_pack_stat_threads(int threads);
+/*
+ * Collect headers, names and small files into writes of up to this many
+ * bytes (64 KiB by default).  Buffered data is sent before any wait for
+ * the unpacker, and after each entry if it is 10ms old or more; an entry
+ * that is slow to read or stat holds it back until it is done.  0 writes
+ * everything immediately.  A new size takes effect at the next write, which
+ * sends what was buffered first.
+ */
+void set_pack_batch_size(size_t bytes);
+/*
+ * Extra streams to offer QFILE_FEATURE_STRIPED with, sending the data of
+ * files of 1 MiB or more over them in parallel, a thread each.  The fds stay
+ * owned by the caller.  At most QFILE_STREAMS_MAX; 0 (the default) does not
+ * offer the feature.
+ */
+void set_pack_streams(const int *fds, int count);
+/*
+ * Offer protocol extensions (QFILE_FEATURE_*) to the unpacker and return the
+ * ones it accepted.  Must be called after qfile_pack_init() and before
+ * sending any file.  Only use this when the remote end is known to
+ * understand the hello message; older unpackers abort the transfer.
+ */
+uint32_t qfile_pack_negotiate(uint32_t features);
 /* those two will call registered error handler if needed */
 void wait_for_result(void);
 void notify_end_and_wait_for_result(void);
 
+/*
+ * Reentrant API, for running transfers in threads of a long-lived process.
+ *
+ * The state of a transfer is kept per thread: each thread can run one
+ * transfer at a time, and all the calls of a transfer have to be made from
+ * the same thread.  What is set with the set_* and register_* functions is
+ * process-wide, and shared by the transfers of all threads, so it should
+ * only be changed while none is running; the qfile_ctx_set_* functions
+ * override some of it for a single context.  A context gives the input and
+ * output fds of a transfer (instead of stdin and stdout) and the directory
+ * that paths are relative to (instead of the current one; can be
+ * AT_FDCWD).  The fds stay owned by the caller.
+ *
+ * The *_ctx functions return 0 or an errno value (or LEGAL_EOF), instead of
+ * calling exit().  The error handler is not called; the message is available
+ * from qfile_ctx_message() instead.  For the unpacker, that is the name of the
+ * last file, which was also sent to the packer.  A transfer that failed is
+ * over; the context can be reused for a new one.
+ */
+struct qfile_ctx;
+struct qfile_ctx *qfile_ctx_new(int in_fd, int out_fd, int dir_fd);
+void qfile_ctx_free(struct qfile_ctx *ctx);
+/* like set_size_limit(), for the transfers of this context only */
+void qfile_ctx_set_size_limit(struct qfile_ctx *ctx, unsigned long long bytes_limit,
+                              unsigned long long files_limit);
+/* result of the last *_ctx call */
+int qfile_ctx_error(const struct qfile_ctx *ctx);
+const char *qfile_ctx_message(const struct qfile_ctx *ctx);
+int do_unpack_ext_ctx(struct qfile_ctx *ctx, int flags);
+int qfile_pack_init_ctx(struct qfile_ctx *ctx);
+int qfile_pack_negotiate_ctx(struct qfile_ctx *ctx, uint32_t features, uint32_t *accepted);
+int do_fs_walk_ctx(struct qfile_ctx *ctx, const char *file, int ignore_symlinks);
+int qfile_pack_tar_ctx(struct qfile_ctx *ctx, int fd);
+int notify_end_and_wait_for_result_ctx(struct qfile_ctx *ctx);
+
 #endif /* _LIBQUBES_RPC_FILECOPY_H */
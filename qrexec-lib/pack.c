@@ -8,11 +8,110 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include "libqubes-rpc-filecopy.h"
+#include "ioall.h"
+#include "compress.h"
+#include "progress.h"
+#include "stats.h"
+#include "walk.h"
+#include "ctx.h"
+#include "stripe.h"
+#include "delta.h"
+#include "tar.h"
+#include "digest.h"
 
-static unsigned long crc32_sum;
+static _Thread_local unsigned long crc32_sum;
 static int ignore_quota_error = 0;
+static _Thread_local uint32_t features = 0;
+/* number of directory entries to prefetch ahead of the one being sent */
+static int readahead_files = 0;
+/* threads stat'ing directory entries ahead of the walk */
+static int stat_threads = 0;
+/* path of the entry being walked, grown as needed and reused */
+static _Thread_local char *walk_path;
+static _Thread_local size_t walk_path_size;
+/* the file being sent, closed if the transfer fails on the way */
+static _Thread_local int file_fd = -1;
+/* extra streams for QFILE_FEATURE_STRIPED, and whether their threads run */
+static int stream_fds[QFILE_STREAMS_MAX];
+static int stream_count = 0;
+static _Thread_local int striped = 0;
+/* QFILE_FEATURE_DIGEST: its settings for this transfer, and the file being sent */
+static _Thread_local int digesting = 0;
+static _Thread_local struct digest_settings digest_cfg;
+static _Thread_local struct digest file_digest;
+/*
+ * QFILE_UPDATE_DELTA: the signature of the old file, its index, and the
+ * window over the new one, freed by pack_abort() if the transfer fails.
+ */
+static _Thread_local struct delta_block *delta_blocks;
+static _Thread_local struct delta_index *delta_idx;
+static _Thread_local uint8_t *delta_buf;
+/*
+ * qfile_pack_tar(): the archive, and the directories the current member is
+ * in, innermost last.  Their names are prefixes of tar_dir_path, and their
+ * headers are kept to be sent again once they are left, as do_fs_walk()
+ * does without QFILE_FEATURE_DIR_ONCE.
+ */
+struct tar_dir {
+    struct file_header hdr;
+    size_t len;
+};
+static _Thread_local struct tar_reader *tar;
+static _Thread_local struct tar_dir *tar_dirs;
+static _Thread_local size_t tar_dirs_count, tar_dirs_size;
+static _Thread_local char tar_dir_path[MAX_PATH_LENGTH];
+/*
+ * With QFILE_FEATURE_HARDLINK, the first name sent for each regular file
+ * with more than one link, indexed by (st_dev, st_ino).  Open addressing
+ * with linear probing, at most half full.
+ */
+struct sent_inode {
+    dev_t dev;
+    ino_t ino;
+    char *name;     /* NULL if the slot is free */
+};
+static _Thread_local struct sent_inode *sent_inodes;
+static _Thread_local size_t sent_inodes_size, sent_inodes_count;
+/*
+ * Headers, names and small files are collected in out_buf and written
+ * together, instead of with a syscall (and a wakeup of the unpacker) each.
+ * After each entry, buffered data that is BATCH_LATENCY_NS old is sent, so
+ * that a walk over many small files does not keep the unpacker waiting for
+ * a full buffer.  Nothing is flushed in the middle of an entry.  With
+ * compression, everything goes through out_buf, and each flush sends one
+ * frame.
+ */
+#define SMALL_FILE_MAX 16384
+#define BATCH_LATENCY_NS 10000000LL
+static size_t batch_size = 65536;
+static _Thread_local int compress_output;
+static _Thread_local char *out_buf, *frame_buf;
+static _Thread_local size_t out_size, out_used;
+static _Thread_local struct timespec out_first;
+/*
+ * The unpacker only writes to our stdin when something went wrong or at the
+ * end of the transfer.  Instead of trying to read() after every file, a
+ * thread waits in poll() and sets feedback.ready, so checking for a result
+ * costs no syscalls.  After a result was looked at, the thread is rearmed.
+ */
+struct feedback {
+    pthread_t thread;
+    int fd;
+    int state;  /* 0 - not started, 1 - running, -1 - unavailable */
+    int ready;
+    pthread_mutex_t lock;
+    pthread_cond_t rearm;
+};
+/* the thread gets a pointer to the instance of the thread that started it */
+static _Thread_local struct feedback feedback = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .rearm = PTHREAD_COND_INITIALIZER,
+};
 error_handler_t *error_handler = NULL;
 
 void register_error_handler(error_handler_t *value) {
@@ -21,35 +120,262 @@ void register_error_handler(error_handler_t *value) {
 
 _Noreturn static void call_error_handler(const char *fmt, ...)
 {
+    int code = errno ? errno : EIO;
     va_list args;
     va_start(args, fmt);
-    if (error_handler) {
+    if (current_ctx) {
+        vsnprintf(current_ctx->message, sizeof(current_ctx->message), fmt, args);
+    } else if (error_handler) {
         error_handler(fmt, args);
     } else {
         vfprintf(stderr, fmt, args);
     }
     va_end(args);
-    exit(1);
+    ctx_fail(code, 1, NULL);
+}
+
+static int flush_output(void)
+{
+    struct compressed_frame frame;
+    size_t used = out_used, len;
+
+    out_used = 0;
+    if (!used)
+        return 1;
+    if (!compress_output)
+        return write_all(output_fd(), out_buf, used);
+    frame.raw_len = used;
+    len = compress_block(out_buf, used, frame_buf + sizeof(frame),
+            COMPRESS_BOUND(QFILE_FRAME_MAX));
+    if (len > 0 && len < used) {
+        frame.comp_len = len;
+    } else {
+        frame.comp_len = 0;
+        memcpy(frame_buf + sizeof(frame), out_buf, used);
+        len = used;
+    }
+    memcpy(frame_buf, &frame, sizeof(frame));
+    return write_all(output_fd(), frame_buf, sizeof(frame) + len);
+}
+
+/* sending failed; report the error of the unpacker, if it has sent one */
+_Noreturn static void output_failed(void)
+{
+    int saved_errno = errno;
+
+    set_block(input_fd());
+    wait_for_result();
+    ctx_fail(saved_errno ? saved_errno : EPIPE, 1, "File copy: cannot send data");
+}
+
+static void flush_output_or_exit(void)
+{
+    if (!flush_output())
+        output_failed();
+}
+
+/* a stream thread has failed to send a file */
+_Noreturn static void stripe_failed(void)
+{
+    const char *filename;
+    int status;
+
+    errno = stripe_error(&status, &filename);
+    if (status == COPY_FILE_WRITE_ERROR)
+        output_failed();
+    call_error_handler("Copying file %s: %s", filename ? filename : "",
+            copy_file_status_to_str(status));
+}
+
+/* free space in out_buf, after flushing it if it is full; -1 on errors */
+static ssize_t output_space(void)
+{
+    size_t size = batch_size;
+
+    if (compress_output && (!size || size > QFILE_FRAME_MAX))
+        size = QFILE_FRAME_MAX;
+    /* set_pack_batch_size() was called since out_buf was allocated */
+    if (out_buf && out_size != size) {
+        if (!flush_output())
+            return -1;
+        free(out_buf);
+        out_buf = NULL;
+    }
+    if (!out_buf) {
+        out_size = size;
+        if (!out_size)
+            return 0;
+        if (!(out_buf = malloc(out_size)))
+            call_error_handler("Cannot allocate the output buffer");
+    }
+    if (out_used == out_size && !flush_output())
+        return -1;
+    if (!out_used)
+        clock_gettime(CLOCK_MONOTONIC, &out_first);
+    return out_size - out_used;
+}
+
+/* send buffered data that has waited long enough */
+static void flush_output_if_stale(void)
+{
+    struct timespec now;
+
+    if (!out_used)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - out_first.tv_sec) * 1000000000LL +
+            (now.tv_nsec - out_first.tv_nsec) >= BATCH_LATENCY_NS)
+        flush_output_or_exit();
 }
 
 static int write_all_with_crc(int fd, const void *buf, int size)
 {
+    const char *data = buf;
+    ssize_t space;
+
     crc32_sum = Crc32_ComputeBuf(crc32_sum, buf, size);
-    return write_all(fd, buf, size);
+    if (fd != output_fd())
+        return write_all(fd, buf, size);
+    while (size > 0) {
+        space = output_space();
+        if (space < 0)
+            return 0;
+        /* large writes bypass the buffer, unless everything is framed */
+        if (!space || (!compress_output && (size_t)size > out_size))
+            return flush_output() && write_all(fd, data, size);
+        if (space > size)
+            space = size;
+        memcpy(out_buf + out_used, data, space);
+        out_used += space;
+        data += space;
+        size -= space;
+    }
+    return 1;
+}
+
+/* copy_file() into out_buf, which must be in use */
+static int copy_file_buffered(int infd, long long size)
+{
+    ssize_t space, ret;
+    uint64_t t;
+
+    while (size > 0) {
+        space = output_space();
+        if (space < 0)
+            return COPY_FILE_WRITE_ERROR;
+        if (space > size)
+            space = size;
+        t = stats_begin();
+        ret = read(infd, out_buf + out_used, space);
+        stats_end(QFILE_STAT_READ, t, ret > 0 ? ret : 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0)
+            return COPY_FILE_READ_EOF;
+        if (ret < 0)
+            return COPY_FILE_READ_ERROR;
+        crc32_sum = Crc32_ComputeBuf(crc32_sum, out_buf + out_used, ret);
+        if (digesting)
+            digest_update(&file_digest, out_buf + out_used, ret);
+        out_used += ret;
+        progress_add(ret);
+        size -= ret;
+    }
+    return COPY_FILE_OK;
+}
+
+static void unlock_on_cancel(void *arg)
+{
+    struct feedback *fb = arg;
+
+    pthread_mutex_unlock(&fb->lock);
+}
+
+static void wait_for_rearm(struct feedback *fb)
+{
+    pthread_mutex_lock(&fb->lock);
+    pthread_cleanup_push(unlock_on_cancel, fb);
+    __atomic_store_n(&fb->ready, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&fb->ready, __ATOMIC_RELAXED))
+        pthread_cond_wait(&fb->rearm, &fb->lock);
+    pthread_cleanup_pop(1);
+}
+
+static void *feedback_main(void *arg)
+{
+    struct feedback *fb = arg;
+    struct pollfd pfd = { .fd = fb->fd, .events = POLLIN };
+
+    for (;;) {
+        /* on errors, let wait_for_result() find out what is going on */
+        if (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            continue;
+        wait_for_rearm(fb);
+    }
+    return NULL;
+}
+
+static void start_feedback_thread(void)
+{
+    sigset_t all, old;
+
+    /* signals are for the caller's thread, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    feedback.ready = 0;
+    feedback.fd = input_fd();
+    feedback.state = pthread_create(&feedback.thread, NULL, feedback_main, &feedback) ? -1 : 1;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void stop_feedback_thread(void)
+{
+    if (feedback.state <= 0)
+        return;
+    pthread_cancel(feedback.thread);
+    pthread_join(feedback.thread, NULL);
+    feedback.state = 0;
+}
+
+/* wait_for_result(), but only if the unpacker has sent something */
+static void check_for_result(void)
+{
+    if (feedback.state == 0)
+        start_feedback_thread();
+    if (feedback.state > 0 && !__atomic_load_n(&feedback.ready, __ATOMIC_ACQUIRE))
+        return;
+    wait_for_result();
+    if (feedback.state > 0) {
+        pthread_mutex_lock(&feedback.lock);
+        __atomic_store_n(&feedback.ready, 0, __ATOMIC_RELAXED);
+        pthread_cond_signal(&feedback.rearm);
+        pthread_mutex_unlock(&feedback.lock);
+    }
 }
 
 void notify_end_and_wait_for_result(void)
 {
     struct file_header end_hdr;
 
+    /* the extra streams end with their checksums */
+    if (striped) {
+        if (stripe_finish())
+            stripe_failed();
+        stripe_stop();
+        striped = 0;
+    }
     /* notify end of transfer */
     memset(&end_hdr, 0, sizeof(end_hdr));
     end_hdr.namelen = 0;
     end_hdr.filelen = 0;
-    write_all_with_crc(1, &end_hdr, sizeof(end_hdr));
+    write_all_with_crc(output_fd(), &end_hdr, sizeof(end_hdr));
+    flush_output();
 
-    set_block(0);
+    stop_feedback_thread();
+    set_block(input_fd());
     wait_for_result();
+    progress_finish();
+    stats_finish("pack");
 }
 
 static void sanitize_remote_filename(char *untrusted_filename)
@@ -62,23 +388,15 @@ static void sanitize_remote_filename(char *untrusted_filename)
     }
 }
 
-void wait_for_result(void)
+/* the rest of a result, after its result_header */
+static void process_result(const struct result_header *hdr_in)
 {
-    struct result_header hdr;
+    struct result_header hdr = *hdr_in;
     struct result_header_ext hdr_ext;
     char last_filename[MAX_PATH_LENGTH + 1];
     char last_filename_prefix[] = "; Last file: ";
 
-    if (!read_all(0, &hdr, sizeof(hdr))) {
-        if (errno == EAGAIN) {
-            // no result sent and stdin still open
-            return;
-        } else {
-            // other read error or EOF
-            exit(1);  // hopefully remote has produced error message
-        }
-    }
-    if (!read_all(0, &hdr_ext, sizeof(hdr_ext))) {
+    if (!read_all(input_fd(), &hdr_ext, sizeof(hdr_ext))) {
         // remote used old result_header struct
         hdr_ext.last_namelen = 0;
     }
@@ -86,7 +404,7 @@ void wait_for_result(void)
         // read only at most MAX_PATH_LENGTH chars
         hdr_ext.last_namelen = MAX_PATH_LENGTH;
     }
-    if (!read_all(0, last_filename, hdr_ext.last_namelen)) {
+    if (!read_all(input_fd(), last_filename, hdr_ext.last_namelen)) {
         fprintf(stderr, "Failed to get last filename\n");
         hdr_ext.last_namelen = 0;
     }
@@ -117,6 +435,9 @@ void wait_for_result(void)
                 // that's a bug.
                 call_error_handler("Cannot verify that link at \"%s\" would not be broken by copy", last_filename);
                 break;
+            case EBADMSG:
+                call_error_handler("File copy: Data corrupted in transit%s\"%s\"", last_filename_prefix, last_filename);
+                break;
             case EDQUOT:
                 if (ignore_quota_error) {
                     /* skip also CRC check as sender and receiver might be
@@ -134,24 +455,495 @@ void wait_for_result(void)
     }
 }
 
+static void receive_result(void)
+{
+    struct result_header hdr;
+
+    if (!read_all(input_fd(), &hdr, sizeof(hdr))) {
+        if (errno == EAGAIN) {
+            // no result sent and stdin still open
+            return;
+        } else {
+            // other read error or EOF
+            // hopefully remote has produced error message
+            ctx_fail(errno ? errno : EPIPE, 1, "File copy: no result from the unpacker");
+        }
+    }
+    process_result(&hdr);
+}
+
+/*
+ * QFILE_FEATURE_UPDATE: what the unpacker wants of the file whose header was
+ * just written, one of QFILE_UPDATE_*.
+ */
+static uint32_t receive_update_token(void)
+{
+    struct result_header hdr;
+    uint64_t t;
+
+    flush_output_or_exit();
+    t = stats_begin();
+    set_block(input_fd());
+    if (!read_all(input_fd(), &hdr, sizeof(hdr)))
+        // hopefully remote has produced error message
+        ctx_fail(errno ? errno : EPIPE, 1, "File copy: no reply from the unpacker");
+    stats_end(QFILE_STAT_WAIT_RESULT, t, 0);
+    if (hdr.error_code == 0 &&
+            (hdr._pad == QFILE_UPDATE_SEND || hdr._pad == QFILE_UPDATE_SKIP ||
+             (hdr._pad == QFILE_UPDATE_DELTA && (features & QFILE_FEATURE_DELTA)))) {
+        /* a signature follows a delta token, and is read in blocking mode */
+        if (hdr._pad != QFILE_UPDATE_DELTA)
+            set_nonblock(input_fd());
+        return hdr._pad;
+    }
+    /* the transfer has failed instead */
+    process_result(&hdr);
+    ctx_fail(hdr.error_code ? (int)hdr.error_code : EPROTO, 1,
+            "File copy: unexpected result from the unpacker");
+}
+
+void wait_for_result(void)
+{
+    uint64_t t = stats_begin();
+
+    receive_result();
+    stats_end(QFILE_STAT_WAIT_RESULT, t, 0);
+}
+
 void write_headers(const struct file_header *hdr, const char *filename)
 {
-    if (!write_all_with_crc(1, hdr, sizeof(*hdr))
-            || !write_all_with_crc(1, filename, hdr->namelen)) {
-        set_block(0);
-        wait_for_result();
-        exit(1);
+    if (!write_all_with_crc(output_fd(), hdr, sizeof(*hdr))
+            || !write_all_with_crc(output_fd(), filename, hdr->namelen)) {
+        output_failed();
     }
+    progress_file_done();
 }
 
 int copy_file_with_crc(int outfd, int infd, long long size) {
+    if (outfd == output_fd() && compress_output)
+        return copy_file_buffered(infd, size);
+    if (outfd == output_fd() && !flush_output())
+        return COPY_FILE_WRITE_ERROR;
     return copy_file(outfd, infd, size, &crc32_sum);
 }
 
-int single_file_processor(const char *filename, const struct stat *st)
+uint32_t qfile_pack_negotiate(uint32_t offered)
+{
+    struct file_header hello;
+    struct qfile_hello_reply reply;
+
+    memset(&hello, 0, sizeof(hello));
+    if (!stream_count)
+        offered &= ~QFILE_FEATURE_STRIPED;
+    hello.namelen = QFILE_HELLO_MAGIC;
+    hello.filelen = offered;
+    if (offered & QFILE_FEATURE_STRIPED)
+        hello.mode = stream_count;
+    if (!write_all_with_crc(output_fd(), &hello, sizeof(hello)) || !flush_output()) {
+        output_failed();
+    }
+    set_block(input_fd());
+    if (!read_all(input_fd(), &reply, sizeof(reply)))
+        // hopefully remote has produced error message
+        ctx_fail(errno ? errno : EPIPE, 1, "File copy: no reply from the unpacker");
+    set_nonblock(input_fd());
+    if (reply.magic != QFILE_HELLO_MAGIC)
+        call_error_handler("File copy: remote does not support protocol extensions");
+    if (reply.features & ~(uint64_t)offered)
+        call_error_handler("File copy: remote accepted features that were not offered");
+    features = reply.features;
+    if (features & QFILE_FEATURE_COMPRESS) {
+        /* out_buf is empty, and is sized for frames from now on */
+        free(out_buf);
+        out_buf = NULL;
+        if (!frame_buf)
+            frame_buf = malloc(sizeof(struct compressed_frame) +
+                    COMPRESS_BOUND(QFILE_FRAME_MAX));
+        if (!frame_buf)
+            call_error_handler("Cannot allocate the compression buffer");
+        compress_output = 1;
+    }
+    if (features & QFILE_FEATURE_DIGEST) {
+        digest_settings(&digest_cfg);
+        digesting = 1;
+    }
+    if (features & QFILE_FEATURE_STRIPED) {
+        if (stripe_start(stream_fds, stream_count, 1, digesting ? &digest_cfg : NULL))
+            call_error_handler("File copy: cannot start the stream threads");
+        striped = 1;
+    }
+    return features;
+}
+
+/* copy_file() through write_all_with_crc(), hashing the data on the way */
+static int copy_file_digest(int infd, long long size)
+{
+    size_t buf_size;
+    char *buf = get_io_buffer(size, &buf_size);
+    ssize_t ret;
+    uint64_t t;
+
+    if (!buf)
+        call_error_handler("Cannot allocate memory");
+    while (size > 0) {
+        t = stats_begin();
+        ret = read(infd, buf, size > (long long)buf_size ? buf_size : (size_t)size);
+        stats_end(QFILE_STAT_READ, t, ret > 0 ? ret : 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0)
+            return COPY_FILE_READ_EOF;
+        if (ret < 0)
+            return COPY_FILE_READ_ERROR;
+        digest_update(&file_digest, buf, ret);
+        if (!write_all_with_crc(output_fd(), buf, ret))
+            return COPY_FILE_WRITE_ERROR;
+        progress_add(ret);
+        size -= ret;
+    }
+    return COPY_FILE_OK;
+}
+
+static void copy_file_data(int fd, const char *filename, long long size)
+{
+    int ret;
+
+    if (size <= SMALL_FILE_MAX && (size_t)size <= batch_size)
+        ret = copy_file_buffered(fd, size);
+    else if (digesting)
+        ret = copy_file_digest(fd, size);
+    else
+        ret = copy_file_with_crc(output_fd(), fd, size);
+    if (ret != COPY_FILE_OK) {
+        if (ret != COPY_FILE_WRITE_ERROR)
+            call_error_handler("Copying file %s: %s", filename,
+                    copy_file_status_to_str(ret));
+        else {
+            output_failed();
+        }
+    }
+}
+
+/* QFILE_MODE_STRIPED: a stream thread sends the data, and closes the file */
+static void queue_striped_file(int fd, const char *filename, long long size)
+{
+    struct stripe_job job = { .fd = fd, .size = size, .dirfd = -1 };
+
+    /* the unpacker has to see the header before it reads the data */
+    flush_output_or_exit();
+    if (!(job.name = strdup(filename)))
+        call_error_handler("Cannot allocate memory");
+    file_fd = -1;
+    if (stripe_queue(&job))
+        stripe_failed();
+}
+
+static void write_delta_record(uint32_t type, uint32_t count, uint64_t value)
+{
+    struct delta_record rec = {
+        .type = type,
+        .count = count,
+        .value = value,
+    };
+
+    if (!write_all_with_crc(output_fd(), &rec, sizeof(rec)))
+        output_failed();
+}
+
+static void write_delta_literal(const uint8_t *data, size_t len)
+{
+    if (!len)
+        return;
+    write_delta_record(DELTA_RECORD_LITERAL, 0, len);
+    if (!write_all_with_crc(output_fd(), data, len))
+        output_failed();
+    progress_add(len);
+}
+
+/*
+ * Receive the signature of the old version of the file from the unpacker,
+ * after QFILE_UPDATE_DELTA.
+ */
+static struct delta_block *receive_signature(struct delta_signature *sig)
+{
+    struct delta_signature untrusted_sig;
+    uint64_t count;
+
+    if (!read_all(input_fd(), &untrusted_sig, sizeof(untrusted_sig)))
+        ctx_fail(errno ? errno : EPIPE, 1, "File copy: no signature from the unpacker");
+    /* a size beyond off_t is no file, and could wrap the block count */
+    if (untrusted_sig.block_size < 512 || untrusted_sig.block_size > DELTA_BLOCK_MAX ||
+            (untrusted_sig.block_size & (untrusted_sig.block_size - 1)) ||
+            untrusted_sig.size > INT64_MAX)
+        call_error_handler("File copy: invalid signature from the unpacker");
+    count = untrusted_sig.size / untrusted_sig.block_size +
+        !!(untrusted_sig.size % untrusted_sig.block_size);
+    if (count > QFILE_DELTA_MAX_BLOCKS)
+        call_error_handler("File copy: invalid signature from the unpacker");
+    *sig = untrusted_sig; /* sanitized above */
+    delta_blocks = malloc(count ? count * sizeof(*delta_blocks) : 1);
+    if (!delta_blocks)
+        call_error_handler("Cannot allocate the signature");
+    if (!read_all(input_fd(), delta_blocks, count * sizeof(*delta_blocks)))
+        ctx_fail(errno ? errno : EPIPE, 1, "File copy: no signature from the unpacker");
+    set_nonblock(input_fd());
+    return delta_blocks;
+}
+
+static void release_delta(void)
+{
+    free(delta_buf);
+    delta_index_free(delta_idx);
+    free(delta_blocks);
+    delta_buf = NULL;
+    delta_idx = NULL;
+    delta_blocks = NULL;
+}
+
+static ssize_t read_fd(void *opaque, void *buf, size_t len)
+{
+    return read(*(int *)opaque, buf, len);
+}
+
+/*
+ * Send the file as literal data and runs of blocks of the old version the
+ * unpacker has.  The window slides one byte at a time until it matches a
+ * block, and jumps over the block when it does.  Without copy_blocks, all
+ * of it is literal, which the unpacker can always build the file from.
+ * Returns 1 if the unpacker could not, and wants all of the file.
+ */
+static int send_delta(ssize_t (*read_data)(void *opaque, void *buf, size_t len),
+                      void *opaque, const char *filename, long long size,
+                      int copy_blocks)
+{
+    struct delta_signature sig;
+    struct delta_block *blocks = receive_signature(&sig);
+    struct delta_index *idx = delta_idx =
+        copy_blocks ? delta_index_new(blocks, &sig) : NULL;
+    size_t block = sig.block_size, buf_size = 4 * block < (1 << 20) ? 1 << 20 : 4 * block;
+    uint8_t *buf = delta_buf = malloc(buf_size);
+    /* buf[lit, pos) is literal data yet to be sent, buf[pos, len) is ahead */
+    size_t len = 0, pos = 0, lit = 0, win;
+    long long left = size;
+    unsigned long file_crc = 0;
+    uint64_t run_first = 0, run_count = 0;
+    uint32_t weak = 0;
+    int have_weak = 0;
+    int64_t match;
+    ssize_t ret;
+
+    if ((copy_blocks && !idx) || !buf)
+        call_error_handler("Cannot allocate the delta buffers");
+    for (;;) {
+        if (len - pos < block && left > 0) {
+            /* keep the window in the buffer */
+            write_delta_literal(buf + lit, pos - lit);
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            lit = pos = 0;
+            while (len < buf_size && left > 0) {
+                ret = read_data(opaque, buf + len,
+                        (long long)(buf_size - len) < left ? buf_size - len : (size_t)left);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret <= 0)
+                    call_error_handler("Copying file %s: %s", filename,
+                            copy_file_status_to_str(ret ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF));
+                file_crc = Crc32_ComputeBuf(file_crc, buf + len, ret);
+                if (digesting)
+                    digest_update(&file_digest, buf + len, ret);
+                len += ret;
+                left -= ret;
+            }
+        }
+        if (pos == len)
+            break;
+        if (!copy_blocks) {
+            pos = len;
+            continue;
+        }
+        win = len - pos < block ? len - pos : block;
+        if (!have_weak) {
+            weak = delta_weak(buf + pos, win);
+            have_weak = 1;
+        }
+        match = delta_index_find(idx, weak, buf + pos, win);
+        if (match >= 0) {
+            write_delta_literal(buf + lit, pos - lit);
+            if (run_count && (uint64_t)match != run_first + run_count) {
+                write_delta_record(DELTA_RECORD_COPY, run_count, run_first);
+                run_count = 0;
+            }
+            if (!run_count)
+                run_first = match;
+            /* a record covers at most 4 GiB worth of blocks */
+            if (++run_count == UINT32_MAX) {
+                write_delta_record(DELTA_RECORD_COPY, run_count, run_first);
+                run_count = 0;
+            }
+            progress_add(win);
+            pos += win;
+            lit = pos;
+            have_weak = 0;
+            continue;
+        }
+        if (run_count) {
+            write_delta_record(DELTA_RECORD_COPY, run_count, run_first);
+            run_count = 0;
+        }
+        if (win < block) {
+            /* the short tail did not match, so it is all literal */
+            pos = len;
+        } else if (pos + block < len) {
+            weak = delta_roll(weak, block, buf[pos], buf[pos + block]);
+            pos++;
+        } else {
+            pos++;
+            have_weak = 0;
+        }
+    }
+    write_delta_literal(buf + lit, pos - lit);
+    if (run_count)
+        write_delta_record(DELTA_RECORD_COPY, run_count, run_first);
+    write_delta_record(DELTA_RECORD_END, 0, file_crc);
+    release_delta();
+    switch (receive_update_token()) {
+    case QFILE_UPDATE_SKIP:
+        return 0;
+    case QFILE_UPDATE_SEND:
+        return 1;
+    default:
+        errno = EPROTO;
+        call_error_handler("File copy: unexpected reply to the delta of %s", filename);
+    }
+}
+
+static void write_sparse_segment(uint32_t type, off_t length)
+{
+    struct sparse_segment seg = {
+        .type = type,
+        ._pad = 0,
+        .length = length,
+    };
+    if (!write_all_with_crc(output_fd(), &seg, sizeof(seg))) {
+        output_failed();
+    }
+}
+
+/*
+ * Send the file as data and hole segments found with SEEK_DATA/SEEK_HOLE.
+ * Anything past the size in the header is ignored, as with regular files.
+ */
+static void copy_file_sparse(int fd, const char *filename, off_t size)
+{
+    off_t offset = 0, data, hole;
+
+    while (offset < size) {
+        data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO)
+                call_error_handler("lseek %s", filename);
+            data = size;  /* only a hole is left */
+        }
+        if (data > size)
+            data = size;
+        if (data > offset) {
+            write_sparse_segment(SPARSE_SEGMENT_HOLE, data - offset);
+            if (digesting)
+                digest_update_zeros(&file_digest, data - offset);
+            offset = data;
+            continue;
+        }
+        hole = lseek(fd, offset, SEEK_HOLE);
+        if (hole < 0)
+            call_error_handler("lseek %s", filename);
+        if (hole > size)
+            hole = size;
+        if (lseek(fd, offset, SEEK_SET) != offset)
+            call_error_handler("lseek %s", filename);
+        write_sparse_segment(SPARSE_SEGMENT_DATA, hole - offset);
+        copy_file_data(fd, filename, hole - offset);
+        offset = hole;
+    }
+}
+
+/* QFILE_FEATURE_DIGEST: after the data of a file, on the main stream */
+static void write_digest(void)
+{
+    uint8_t out[QFILE_DIGEST_LEN];
+
+    digest_final(&file_digest, out);
+    if (!write_all_with_crc(output_fd(), out, sizeof(out))) {
+        output_failed();
+    }
+}
+
+static size_t inode_slot(const struct sent_inode *table, size_t size, dev_t dev, ino_t ino)
+{
+    size_t i = ((uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev) & (size - 1);
+
+    while (table[i].name && (table[i].dev != dev || table[i].ino != ino))
+        i = (i + 1) & (size - 1);
+    return i;
+}
+
+/*
+ * The name this file was sent under before, or NULL if this is the first
+ * one, in which case it is remembered.
+ */
+static const char *sent_inode_name(const char *filename, const struct stat *st)
+{
+    struct sent_inode *e;
+
+    if (sent_inodes_count + 1 > sent_inodes_size / 2) {
+        size_t new_size = sent_inodes_size ? 2 * sent_inodes_size : 64;
+        struct sent_inode *table = calloc(new_size, sizeof(*table));
+        if (!table)
+            call_error_handler("Cannot allocate the hardlink table");
+        for (size_t i = 0; i < sent_inodes_size; i++) {
+            e = &sent_inodes[i];
+            if (e->name)
+                table[inode_slot(table, new_size, e->dev, e->ino)] = *e;
+        }
+        free(sent_inodes);
+        sent_inodes = table;
+        sent_inodes_size = new_size;
+    }
+    e = &sent_inodes[inode_slot(sent_inodes, sent_inodes_size, st->st_dev, st->st_ino)];
+    if (e->name)
+        return e->name;
+    if (!(e->name = strdup(filename)))
+        call_error_handler("Cannot allocate the hardlink table");
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    sent_inodes_count++;
+    return NULL;
+}
+
+/* cheap check first, so only files that look sparse cost extra syscalls */
+static int file_has_holes(int fd, const struct stat *st)
+{
+    off_t hole;
+
+    if (!(features & QFILE_FEATURE_SPARSE))
+        return 0;
+    if ((long long)st->st_blocks * 512 >= (long long)st->st_size)
+        return 0;
+    hole = lseek(fd, 0, SEEK_HOLE);
+    if (lseek(fd, 0, SEEK_SET) != 0)
+        return 0;
+    return hole >= 0 && hole < st->st_size;
+}
+
+/* name is relative to dirfd; filename is what is sent */
+static void send_entry(int dirfd, const char *name, const char *filename,
+                       const struct stat *st)
 {
     struct file_header hdr;
+    const char *target;
+    uint32_t token;
     int fd;
+    uint64_t t;
     mode_t mode = st->st_mode;
 
     hdr.namelen = strlen(filename) + 1;
@@ -161,92 +953,556 @@ int single_file_processor(const char *filename, const struct stat *st)
     hdr.mtime = st->st_mtim.tv_sec;
     hdr.mtime_nsec = st->st_mtim.tv_nsec;
 
-    if (S_ISREG(mode)) {
-        int ret;
-        fd = open(filename, O_RDONLY);
+    if (S_ISREG(mode) && st->st_nlink > 1 && (features & QFILE_FEATURE_HARDLINK) &&
+            (target = sent_inode_name(filename, st))) {
+        hdr.mode |= QFILE_MODE_HARDLINK;
+        hdr.filelen = strlen(target);
+        write_headers(&hdr, filename);
+        if (!write_all_with_crc(output_fd(), target, hdr.filelen)) {
+            output_failed();
+        }
+    } else if (S_ISREG(mode)) {
+        t = stats_begin();
+        fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
         if (fd < 0)
             call_error_handler("open %s", filename);
+        file_fd = fd;
+        stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+        if (readahead_files > 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
         hdr.filelen = st->st_size;
+        if (file_has_holes(fd, st))
+            hdr.mode |= QFILE_MODE_SPARSE;
+        else if (striped && hdr.filelen >= STRIPE_MIN)
+            hdr.mode |= QFILE_MODE_STRIPED;
         write_headers(&hdr, filename);
-        ret = copy_file(1, fd, hdr.filelen, &crc32_sum);
-        if (ret != COPY_FILE_OK) {
-            if (ret != COPY_FILE_WRITE_ERROR)
-                call_error_handler("Copying file %s: %s", filename,
-                        copy_file_status_to_str(ret));
-            else {
-                set_block(0);
-                wait_for_result();
-                exit(1);
+        token = features & QFILE_FEATURE_UPDATE ? receive_update_token() : QFILE_UPDATE_SEND;
+        if (digesting)
+            digest_init(&file_digest, &digest_cfg);
+        if (token == QFILE_UPDATE_SKIP) {
+            /* the unpacker has it already */
+        } else if (token == QFILE_UPDATE_DELTA) {
+            if (send_delta(read_fd, &fd, filename, hdr.filelen, 1)) {
+                if (lseek(fd, 0, SEEK_SET) != 0)
+                    call_error_handler("lseek %s", filename);
+                if (digesting)
+                    digest_init(&file_digest, &digest_cfg);
+                copy_file_data(fd, filename, hdr.filelen);
             }
+        } else if (hdr.mode & QFILE_MODE_SPARSE) {
+            copy_file_sparse(fd, filename, st->st_size);
+        } else if (hdr.mode & QFILE_MODE_STRIPED) {
+            queue_striped_file(fd, filename, hdr.filelen);
+            fd = -1;
+        } else {
+            copy_file_data(fd, filename, hdr.filelen);
+        }
+        /* that of a striped file is sent by its stream thread */
+        if (digesting && token != QFILE_UPDATE_SKIP && fd >= 0)
+            write_digest();
+        if (fd >= 0) {
+            file_fd = -1;
+            close(fd);
         }
-        close(fd);
     }
     if (S_ISDIR(mode)) {
         hdr.filelen = 0;
         write_headers(&hdr, filename);
     }
     if (S_ISLNK(mode)) {
-        char name[st->st_size + 1];
-        if (readlink(filename, name, sizeof(name)) != st->st_size)
+        char target[st->st_size + 1];
+        if (readlinkat(dirfd, name, target, sizeof(target)) != st->st_size)
             call_error_handler("readlink %s", filename);
         hdr.filelen = st->st_size;
         write_headers(&hdr, filename);
-        if (!write_all_with_crc(1, name, st->st_size)) {
-            set_block(0);
-            wait_for_result();
-            exit(1);
+        if (!write_all_with_crc(output_fd(), target, st->st_size)) {
+            output_failed();
         }
     }
+    flush_output_if_stale();
+    if (striped)
+        stripe_progress();
     // check for possible error from qfile-unpacker
-    wait_for_result();
+    check_for_result();
+}
+
+int single_file_processor(const char *filename, const struct stat *st)
+{
+    send_entry(base_dir_fd(), filename, filename, st);
     return 0;
 }
 
+/* make room for size bytes in walk_path, and some more */
+static void walk_path_reserve(size_t size)
+{
+    char *p;
+
+    if (size <= walk_path_size)
+        return;
+    size *= 2;
+    if (!(p = realloc(walk_path, size)))
+        call_error_handler("realloc failed");
+    walk_path = p;
+    walk_path_size = size;
+}
+
+/* set walk_path to its first len bytes plus "/name"; returns the new length */
+static size_t walk_path_enter(size_t len, const char *name)
+{
+    size_t name_len = strlen(name);
+
+    walk_path_reserve(len + name_len + 2);
+    walk_path[len] = '/';
+    memcpy(walk_path + len + 1, name, name_len + 1);
+    return len + 1 + name_len;
+}
+
+/*
+ * Send the contents of the directory at walk_path (of length len) in
+ * readdir() order.  Everything is opened and stat'ed relative to the
+ * directory fd, and the entries are stat'ed (and prefetched, with
+ * readahead_files) ahead by the threads of walk_start().
+ */
+static void walk_dir(struct walk_dir *dir, size_t len, int ignore_symlinks)
+{
+    struct walk_dir *subdir;
+    struct stat st;
+    size_t count = walk_dir_count(dir), i, sublen;
+    const char *name;
+    int fd;
+
+    for (i = 0; i < count; i++) {
+        name = walk_dir_name(dir, i);
+        sublen = walk_path_enter(len, name);
+        if (walk_dir_stat(dir, i, &st))
+            call_error_handler("stat %s", walk_path);
+        if (S_ISLNK(st.st_mode) && ignore_symlinks)
+            continue;
+        send_entry(walk_dir_fd(dir), name, walk_path, &st);
+        if (!S_ISDIR(st.st_mode))
+            continue;
+        fd = openat(walk_dir_fd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0 || !(subdir = walk_dir_open(fd)))
+            call_error_handler("opendir %s", walk_path);
+        walk_dir(subdir, sublen, ignore_symlinks);
+        walk_dir_close(subdir);
+        // directory metadata is resent; this makes the code simple,
+        // and the atime/mtime is set correctly at the second time
+        if (!(features & QFILE_FEATURE_DIR_ONCE))
+            send_entry(walk_dir_fd(dir), name, walk_path, &st);
+    }
+    walk_path[len] = 0;
+}
+
 int do_fs_walk(const char *file, int ignore_symlinks)
 {
-    char *newfile;
+    struct walk_dir *dir;
     struct stat st;
-    struct dirent *ent;
-    DIR *dir;
+    size_t len;
+    int fd;
 
-    if (lstat(file, &st))
+    if (fstatat(base_dir_fd(), file, &st, AT_SYMLINK_NOFOLLOW))
         call_error_handler("stat %s", file);
     if (S_ISLNK(st.st_mode) && ignore_symlinks)
         return 0;
     single_file_processor(file, &st);
     if (!S_ISDIR(st.st_mode))
         return 0;
-    dir = opendir(file);
-    if (!dir)
+    len = strlen(file);
+    walk_path_reserve(len + 256);
+    memcpy(walk_path, file, len + 1);
+    if (walk_start(stat_threads, readahead_files))
+        call_error_handler("Cannot start the stat threads");
+    fd = openat(base_dir_fd(), file, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || !(dir = walk_dir_open(fd)))
         call_error_handler("opendir %s", file);
-    while ((ent = readdir(dir))) {
-        char *fname = ent->d_name;
-        if (!strcmp(fname, ".") || !strcmp(fname, ".."))
-            continue;
-        if (asprintf(&newfile, "%s/%s", file, fname) >= 0) {
-            do_fs_walk(newfile, ignore_symlinks);
-            free(newfile);
-        } else {
-            fprintf(stderr, "asprintf failed\n");
-            exit(1);
-        }
-    }
-    closedir(dir);
+    walk_dir(dir, len, ignore_symlinks);
+    walk_dir_close(dir);
+    walk_stop();
     // directory metadata is resent; this makes the code simple,
     // and the atime/mtime is set correctly at the second time
-    single_file_processor(file, &st);
+    if (!(features & QFILE_FEATURE_DIR_ONCE))
+        single_file_processor(file, &st);
     return 0;
 }
 
+static ssize_t read_tar(void *opaque, void *buf, size_t len)
+{
+    return tar_read(opaque, buf, len);
+}
+
+static void tar_failed(void)
+{
+    call_error_handler("Reading the archive: %s",
+            errno == EINVAL ? "invalid tar archive" : strerror(errno));
+}
+
+/* len bytes of member data, as far as buffered by the reader, then from fd */
+static void copy_tar_data(int fd, const char *name, uint64_t len)
+{
+    size_t avail;
+    const void *data = tar_peek(tar, &avail);
+
+    if (avail > len)
+        avail = len;
+    if (avail) {
+        if (digesting)
+            digest_update(&file_digest, data, avail);
+        if (!write_all_with_crc(output_fd(), data, avail))
+            output_failed();
+        progress_add(avail);
+    }
+    if (len > avail)
+        copy_file_data(fd, name, len - avail);
+    tar_data_read(tar, len);
+}
+
+/* the data of a sparse member, as QFILE_MODE_SPARSE segments */
+static void copy_tar_sparse(int fd, const struct tar_member *m)
+{
+    uint64_t offset = 0;
+
+    for (size_t i = 0; i < m->segment_count; i++) {
+        const struct tar_segment *seg = &m->segments[i];
+        if (seg->offset > offset) {
+            write_sparse_segment(SPARSE_SEGMENT_HOLE, seg->offset - offset);
+            if (digesting)
+                digest_update_zeros(&file_digest, seg->offset - offset);
+        }
+        write_sparse_segment(SPARSE_SEGMENT_DATA, seg->length);
+        copy_tar_data(fd, m->name, seg->length);
+        offset = seg->offset + seg->length;
+    }
+    if (m->size > offset) {
+        write_sparse_segment(SPARSE_SEGMENT_HOLE, m->size - offset);
+        if (digesting)
+            digest_update_zeros(&file_digest, m->size - offset);
+    }
+}
+
+/* the data of a sparse member, with the holes filled in */
+static void copy_tar_filled(const struct tar_member *m)
+{
+    size_t buf_len;
+    char *buf = get_io_buffer(m->size, &buf_len);
+    ssize_t ret;
+
+    if (!buf)
+        call_error_handler("Cannot allocate memory");
+    while ((ret = tar_read(tar, buf, buf_len)) > 0) {
+        if (digesting)
+            digest_update(&file_digest, buf, ret);
+        if (!write_all_with_crc(output_fd(), buf, ret))
+            output_failed();
+        progress_add(ret);
+    }
+    if (ret < 0)
+        tar_failed();
+}
+
+static void copy_tar_member(int fd, const struct tar_member *m, const struct file_header *hdr)
+{
+    if (hdr->mode & QFILE_MODE_SPARSE)
+        copy_tar_sparse(fd, m);
+    else if (m->segments)
+        copy_tar_filled(m);
+    else
+        copy_tar_data(fd, m->name, m->size);
+}
+
+static void send_tar_file(int fd, const struct tar_member *m, struct file_header *hdr)
+{
+    uint32_t token;
+    int seekable;
+
+    hdr->filelen = m->size;
+    if (m->segments && (features & QFILE_FEATURE_SPARSE))
+        hdr->mode |= QFILE_MODE_SPARSE;
+    write_headers(hdr, m->name);
+    token = features & QFILE_FEATURE_UPDATE ? receive_update_token() : QFILE_UPDATE_SEND;
+    if (digesting)
+        digest_init(&file_digest, &digest_cfg);
+    if (token == QFILE_UPDATE_SKIP) {
+        /* skipped over by tar_next() */
+    } else if (token == QFILE_UPDATE_DELTA) {
+        /*
+         * Blocks of the old version are only referred to if the member can
+         * be read again, for when the unpacker cannot build the file from
+         * them; from a pipe, the delta is all literal.
+         */
+        seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+        if (send_delta(read_tar, tar, m->name, m->size, seekable)) {
+            if (!seekable) {
+                errno = EPROTO;
+                call_error_handler("File copy: unexpected reply to the delta of %s", m->name);
+            }
+            if (tar_rewind(tar))
+                tar_failed();
+            if (digesting)
+                digest_init(&file_digest, &digest_cfg);
+            copy_tar_member(fd, m, hdr);
+        }
+    } else {
+        copy_tar_member(fd, m, hdr);
+    }
+    if (digesting && token != QFILE_UPDATE_SKIP)
+        write_digest();
+}
+
+/* leave the directories that name is not in, innermost first */
+static void tar_leave_dirs(const char *name)
+{
+    struct tar_dir *d;
+
+    while (tar_dirs_count) {
+        d = &tar_dirs[tar_dirs_count - 1];
+        if (!strncmp(name, tar_dir_path, d->len) && name[d->len] == '/')
+            return;
+        if (!(features & QFILE_FEATURE_DIR_ONCE))
+            write_headers(&d->hdr, tar_dir_path);
+        tar_dirs_count--;
+        tar_dir_path[tar_dirs_count ? tar_dirs[tar_dirs_count - 1].len : 0] = '\0';
+    }
+}
+
+/* send a directory and enter it; name is below the current one */
+static void tar_enter_dir(const char *name, size_t len, const struct file_header *hdr)
+{
+    struct tar_dir *d;
+    size_t size;
+
+    if (tar_dirs_count == tar_dirs_size) {
+        size = tar_dirs_size ? 2 * tar_dirs_size : 16;
+        if (!(d = realloc(tar_dirs, size * sizeof(*tar_dirs))))
+            call_error_handler("Cannot allocate memory");
+        tar_dirs = d;
+        tar_dirs_size = size;
+    }
+    d = &tar_dirs[tar_dirs_count++];
+    d->hdr = *hdr;
+    d->hdr.namelen = len + 1;
+    d->len = len;
+    memcpy(tar_dir_path, name, len);
+    tar_dir_path[len] = '\0';
+    write_headers(&d->hdr, tar_dir_path);
+}
+
+/*
+ * Make sure that the parent directories of name were sent, as archives do
+ * not always have them (tar cf - a/b/file).  Those that were not get the
+ * times of the member and the usual permissions.
+ */
+static void tar_enter_parents(const char *name, const struct file_header *member_hdr)
+{
+    struct file_header hdr = *member_hdr;
+    size_t len = tar_dirs_count ? tar_dirs[tar_dirs_count - 1].len + 1 : 0;
+    const char *slash;
+
+    hdr.mode = S_IFDIR | 0755;
+    hdr.filelen = 0;
+    while ((slash = strchr(name + len, '/'))) {
+        tar_enter_dir(name, slash - name, &hdr);
+        len = slash - name + 1;
+    }
+}
+
+static void send_tar_member(int fd, const struct tar_member *m)
+{
+    struct file_header hdr = {
+        .namelen = strlen(m->name) + 1,
+        .mode = m->mode,
+        .atime = m->atime,
+        .atime_nsec = m->atime_nsec,
+        .mtime = m->mtime,
+        .mtime_nsec = m->mtime_nsec,
+    };
+
+    /* devices and FIFOs are left out, as by do_fs_walk() */
+    if (!(m->mode & S_IFMT))
+        return;
+    tar_leave_dirs(m->name);
+    tar_enter_parents(m->name, &hdr);
+    if (S_ISDIR(m->mode)) {
+        tar_enter_dir(m->name, strlen(m->name), &hdr);
+    } else if (m->hardlink) {
+        if (!(features & QFILE_FEATURE_HARDLINK)) {
+            errno = EOPNOTSUPP;
+            call_error_handler("Hardlink %s in the archive needs QFILE_FEATURE_HARDLINK",
+                    m->name);
+        }
+        hdr.mode |= QFILE_MODE_HARDLINK;
+        hdr.filelen = strlen(m->link);
+        write_headers(&hdr, m->name);
+        if (!write_all_with_crc(output_fd(), m->link, hdr.filelen))
+            output_failed();
+    } else if (S_ISLNK(m->mode)) {
+        hdr.filelen = strlen(m->link);
+        write_headers(&hdr, m->name);
+        if (!write_all_with_crc(output_fd(), m->link, hdr.filelen))
+            output_failed();
+    } else {
+        send_tar_file(fd, m, &hdr);
+    }
+    flush_output_if_stale();
+    check_for_result();
+}
+
+int qfile_pack_tar(int fd)
+{
+    struct tar_member m;
+    int ret;
+
+    if (!(tar = tar_open(fd)))
+        call_error_handler("Cannot allocate memory");
+    tar_dirs_count = 0;
+    tar_dir_path[0] = '\0';
+    while ((ret = tar_next(tar, &m)) > 0)
+        send_tar_member(fd, &m);
+    if (ret < 0)
+        tar_failed();
+    tar_leave_dirs("");
+    tar_close(tar);
+    tar = NULL;
+    return 0;
+}
+
+/* the thread may never run another transfer: free what it has allocated */
+static void release_buffers(void)
+{
+    free(out_buf);
+    free(frame_buf);
+    out_buf = frame_buf = NULL;
+    out_used = 0;
+    release_io_buffer();
+    release_splice_pipe();
+}
+
 void qfile_pack_init(void) {
     crc32_sum = 0;
-    ignore_quota_error = 0;
+    progress_start();
+    stats_start();
+    tune_pipe_size(input_fd());
+    tune_pipe_size(output_fd());
+    /* left over from a transfer that did not end through a *_ctx call */
+    release_buffers();
+    compress_output = 0;
+    for (size_t i = 0; i < sent_inodes_size; i++)
+        free(sent_inodes[i].name);
+    free(sent_inodes);
+    sent_inodes = NULL;
+    sent_inodes_size = sent_inodes_count = 0;
+    features = 0;
+    digesting = 0;
     // this will allow checking for possible feedback packet in the middle of transfer
-    set_nonblock(0);
+    set_nonblock(input_fd());
     signal(SIGPIPE, SIG_IGN);
-    error_handler = NULL;
+    /* settings are shared with the *_ctx transfers running in other threads */
+    if (!current_ctx) {
+        ignore_quota_error = 0;
+        error_handler = NULL;
+    }
 }
 
 void set_ignore_quota_error(int value) {
     ignore_quota_error = value;
 }
+
+void set_pack_readahead(int files) {
+    readahead_files = files;
+}
+
+void set_pack_stat_threads(int threads) {
+    stat_threads = threads;
+}
+
+void set_pack_streams(const int *fds, int count) {
+    if (count > QFILE_STREAMS_MAX)
+        count = QFILE_STREAMS_MAX;
+    stream_count = count > 0 ? count : 0;
+    memcpy(stream_fds, fds, stream_count * sizeof(*fds));
+}
+
+void set_pack_batch_size(size_t bytes) {
+    /* out_buf is resized by the next write, which sends what it holds */
+    batch_size = bytes;
+}
+
+/* clean up after a *_ctx call that failed, for the next transfer */
+static void pack_abort(void)
+{
+    stop_feedback_thread();
+    walk_abort();
+    if (striped) {
+        stripe_stop();
+        striped = 0;
+    }
+    if (file_fd >= 0) {
+        close(file_fd);
+        file_fd = -1;
+    }
+    release_delta();
+    tar_close(tar);
+    tar = NULL;
+    release_buffers();
+}
+
+int qfile_pack_init_ctx(struct qfile_ctx *ctx)
+{
+    ctx_enter(ctx);
+    qfile_pack_init();
+    ctx_leave();
+    return 0;
+}
+
+int qfile_pack_negotiate_ctx(struct qfile_ctx *ctx, uint32_t offered, uint32_t *accepted)
+{
+    if (setjmp(ctx->fail)) {
+        pack_abort();
+        ctx_leave();
+        return ctx->error;
+    }
+    ctx_enter(ctx);
+    *accepted = qfile_pack_negotiate(offered);
+    ctx_leave();
+    return 0;
+}
+
+int do_fs_walk_ctx(struct qfile_ctx *ctx, const char *file, int ignore_symlinks)
+{
+    if (setjmp(ctx->fail)) {
+        pack_abort();
+        ctx_leave();
+        return ctx->error;
+    }
+    ctx_enter(ctx);
+    do_fs_walk(file, ignore_symlinks);
+    ctx_leave();
+    return 0;
+}
+
+int qfile_pack_tar_ctx(struct qfile_ctx *ctx, int fd)
+{
+    if (setjmp(ctx->fail)) {
+        pack_abort();
+        ctx_leave();
+        return ctx->error;
+    }
+    ctx_enter(ctx);
+    qfile_pack_tar(fd);
+    ctx_leave();
+    return 0;
+}
+
+int notify_end_and_wait_for_result_ctx(struct qfile_ctx *ctx)
+{
+    if (setjmp(ctx->fail)) {
+        pack_abort();
+        ctx_leave();
+        return ctx->error;
+    }
+    ctx_enter(ctx);
+    notify_end_and_wait_for_result();
+    release_buffers();
+    ctx_leave();
+    return 0;
+}
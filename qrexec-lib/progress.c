@@ -0,0 +1,154 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include "progress.h"
+
+/*
+ * Between reports, progress_add() only adds to progress_bytes and compares
+ * it with progress_next_check.  Only then is the clock read, so with a time
+ * limit the clock is read about once per PROGRESS_CHECK_STEP bytes, and once
+ * per file.
+ */
+#define PROGRESS_CHECK_STEP (64 * 1024)
+/* weight of the latest interval in the throughput estimate */
+#define RATE_WEIGHT 0.3
+
+_Thread_local unsigned long long progress_bytes;
+_Thread_local unsigned long long progress_next_check = ULLONG_MAX;
+
+static progress_report_t *report_func;
+static void *report_opaque;
+static unsigned long long report_bytes_delta;
+static unsigned long report_msec_delta;
+static unsigned long long expected_bytes;
+static _Thread_local unsigned long long files;
+/* state at the last report */
+static _Thread_local unsigned long long last_bytes;
+static _Thread_local double start_time, last_time, rate;
+
+void register_progress(progress_report_t *func, void *opaque,
+        unsigned long long bytes_delta, unsigned long msec_delta)
+{
+    report_func = func;
+    report_opaque = opaque;
+    report_bytes_delta = bytes_delta;
+    report_msec_delta = msec_delta;
+    progress_start();
+}
+
+void set_progress_total(unsigned long long bytes)
+{
+    expected_bytes = bytes;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void schedule_check(void)
+{
+    unsigned long long next = ULLONG_MAX;
+
+    if (!report_func) {
+        progress_next_check = ULLONG_MAX;
+        return;
+    }
+    if (report_msec_delta)
+        next = progress_bytes + PROGRESS_CHECK_STEP;
+    if (report_bytes_delta && last_bytes + report_bytes_delta < next)
+        next = last_bytes + report_bytes_delta;
+    if (!report_msec_delta && !report_bytes_delta)
+        next = 0;   /* report every update */
+    progress_next_check = next;
+}
+
+static void report(double t, int done)
+{
+    struct qfile_progress p;
+    double interval = t - last_time;
+
+    if (interval > 0) {
+        double current = (progress_bytes - last_bytes) / interval;
+        rate = last_time == start_time ? current : rate + RATE_WEIGHT * (current - rate);
+    }
+    last_bytes = progress_bytes;
+    last_time = t;
+
+    p.bytes = progress_bytes;
+    p.files = files;
+    p.total_bytes = expected_bytes;
+    p.elapsed = t - start_time;
+    p.bytes_per_sec = rate;
+    if (expected_bytes && progress_bytes >= expected_bytes)
+        p.eta = 0;
+    else if (expected_bytes && rate > 0)
+        p.eta = (expected_bytes - progress_bytes) / rate;
+    else
+        p.eta = -1;
+    p.done = done;
+    report_func(&p, report_opaque);
+}
+
+void progress_check(void)
+{
+    double t;
+
+    if (!report_func) {
+        progress_next_check = ULLONG_MAX;
+        return;
+    }
+    if (report_bytes_delta && progress_bytes - last_bytes >= report_bytes_delta) {
+        report(now(), 0);
+    } else if (report_msec_delta) {
+        t = now();
+        if ((t - last_time) * 1000 >= report_msec_delta)
+            report(t, 0);
+    } else if (!report_bytes_delta) {
+        report(now(), 0);
+    }
+    schedule_check();
+}
+
+void progress_start(void)
+{
+    progress_bytes = last_bytes = files = 0;
+    rate = 0;
+    start_time = last_time = now();
+    schedule_check();
+}
+
+void progress_file_done(void)
+{
+    files++;
+    if (report_func)
+        progress_check();
+}
+
+void progress_finish(void)
+{
+    if (report_func)
+        report(now(), 1);
+}
@@ -0,0 +1,32 @@
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <stddef.h>
+#include "libqubes-rpc-filecopy.h"
+
+/* legacy per-chunk callback, see register_notify_progress() */
+extern notify_progress_t *notify_progress_func;
+
+/* file data bytes so far, and the value at which progress_check() is due */
+extern _Thread_local unsigned long long progress_bytes;
+extern _Thread_local unsigned long long progress_next_check;
+
+void progress_check(void);
+/* reset the counters at the start of a transfer */
+void progress_start(void);
+/* count one transferred file (of any type) */
+void progress_file_done(void);
+/* final report, with done set */
+void progress_finish(void);
+
+/* account for n bytes of file data; cheap unless a report may be due */
+static inline void progress_add(size_t n)
+{
+    if (notify_progress_func != NULL)
+        notify_progress_func(n, 0);
+    progress_bytes += n;
+    if (progress_bytes >= progress_next_check)
+        progress_check();
+}
+
+#endif /* _PROGRESS_H */
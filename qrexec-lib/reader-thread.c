@@ -0,0 +1,238 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqubes-rpc-filecopy.h"
+#include "crc32.h"
+#include "digest.h"
+#include "reader-thread.h"
+#include "progress.h"
+#include "stats.h"
+
+#define RING_CHUNKS 16
+#define CHUNK_SIZE 65536
+
+struct chunk {
+    size_t len;
+    /* CRC of the stream before and after this chunk */
+    unsigned long crc_start, crc_end;
+    char data[CHUNK_SIZE];
+};
+
+/*
+ * Per thread, so that each thread can run its own transfer; the reader
+ * thread gets a pointer to the instance of the thread that started it.
+ */
+struct reader {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct chunk *chunks;
+    /* chunks[head % RING_CHUNKS] is being consumed, chunks[tail % ...] filled */
+    unsigned head, tail;
+    /* set by the reader thread when it stops: EOF (0) or errno */
+    int done, error;
+    /* consumer side only */
+    size_t consumed;
+    unsigned long crc_done;
+};
+
+static _Thread_local struct reader r = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void unlock_on_cancel(void *arg)
+{
+    struct reader *rd = arg;
+
+    pthread_mutex_unlock(&rd->lock);
+}
+
+/* the cancellation point of the reader, besides read() */
+static void wait_not_full(struct reader *rd)
+{
+    pthread_mutex_lock(&rd->lock);
+    pthread_cleanup_push(unlock_on_cancel, rd);
+    while (rd->tail - rd->head == RING_CHUNKS)
+        pthread_cond_wait(&rd->not_full, &rd->lock);
+    pthread_cleanup_pop(1);
+}
+
+static void *reader_main(void *arg)
+{
+    struct reader *rd = arg;
+    unsigned long crc = 0;
+    struct chunk *chunk;
+    ssize_t ret;
+    uint64_t t;
+
+    for (;;) {
+        wait_not_full(rd);
+        chunk = &rd->chunks[rd->tail % RING_CHUNKS];
+        do {
+            t = stats_begin();
+            ret = read(rd->fd, chunk->data, CHUNK_SIZE);
+            stats_end(QFILE_STAT_READ, t, ret > 0 ? ret : 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+            pthread_mutex_lock(&rd->lock);
+            rd->done = 1;
+            rd->error = ret < 0 ? errno : 0;
+            pthread_cond_broadcast(&rd->not_empty);
+            pthread_mutex_unlock(&rd->lock);
+            return NULL;
+        }
+        chunk->len = ret;
+        chunk->crc_start = crc;
+        crc = Crc32_ComputeBuf(crc, chunk->data, ret);
+        chunk->crc_end = crc;
+
+        pthread_mutex_lock(&rd->lock);
+        rd->tail++;
+        pthread_cond_signal(&rd->not_empty);
+        pthread_mutex_unlock(&rd->lock);
+    }
+}
+
+int reader_start(int fd)
+{
+    r.chunks = malloc(RING_CHUNKS * sizeof(*r.chunks));
+    if (!r.chunks)
+        return 0;
+    r.fd = fd;
+    r.head = r.tail = 0;
+    r.done = r.error = 0;
+    r.consumed = 0;
+    r.crc_done = 0;
+    errno = pthread_create(&r.thread, NULL, reader_main, &r);
+    if (errno) {
+        free(r.chunks);
+        r.chunks = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void reader_stop(void)
+{
+    if (!r.chunks)
+        return;
+    /* most likely blocked in read(), waiting for data that will never come */
+    pthread_cancel(r.thread);
+    pthread_join(r.thread, NULL);
+    free(r.chunks);
+    r.chunks = NULL;
+}
+
+/* wait for unconsumed data; NULL on EOF or error */
+static const char *peek(size_t *avail)
+{
+    struct chunk *chunk;
+
+    pthread_mutex_lock(&r.lock);
+    while (r.head == r.tail && !r.done)
+        pthread_cond_wait(&r.not_empty, &r.lock);
+    if (r.head == r.tail) {
+        errno = r.error;
+        pthread_mutex_unlock(&r.lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&r.lock);
+    chunk = &r.chunks[r.head % RING_CHUNKS];
+    *avail = chunk->len - r.consumed;
+    return chunk->data + r.consumed;
+}
+
+static void consume(size_t len)
+{
+    struct chunk *chunk = &r.chunks[r.head % RING_CHUNKS];
+
+    r.consumed += len;
+    if (r.consumed < chunk->len)
+        return;
+    r.crc_done = chunk->crc_end;
+    r.consumed = 0;
+    pthread_mutex_lock(&r.lock);
+    r.head++;
+    pthread_cond_signal(&r.not_full);
+    pthread_mutex_unlock(&r.lock);
+}
+
+int reader_read_all(void *buf, size_t size)
+{
+    size_t got = 0, avail;
+    const char *data;
+
+    while (got < size) {
+        if (!(data = peek(&avail))) {
+            if (errno)
+                perror("read");
+            else
+                fprintf(stderr, "EOF\n");
+            return 0;
+        }
+        if (avail > size - got)
+            avail = size - got;
+        memcpy((char *)buf + got, data, avail);
+        consume(avail);
+        got += avail;
+    }
+    return 1;
+}
+
+int reader_copy(int outfd, long long size, struct digest *digest)
+{
+    long long written = 0;
+    size_t avail;
+    const char *data;
+
+    while (written < size) {
+        if (!(data = peek(&avail)))
+            return errno ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF;
+        if ((long long)avail > size - written)
+            avail = size - written;
+        if (digest)
+            digest_update(digest, data, avail);
+        /* straight from the ring buffer, no extra copy */
+        if (!write_all(outfd, data, avail))
+            return COPY_FILE_WRITE_ERROR;
+        consume(avail);
+        progress_add(avail);
+        written += avail;
+    }
+    return COPY_FILE_OK;
+}
+
+unsigned long reader_crc(void)
+{
+    struct chunk *chunk = &r.chunks[r.head % RING_CHUNKS];
+
+    if (!r.consumed)
+        return r.crc_done;
+    return Crc32_ComputeBuf(chunk->crc_start, chunk->data, r.consumed);
+}
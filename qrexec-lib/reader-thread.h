@@ -0,0 +1,27 @@
+#ifndef _READER_THREAD_H
+#define _READER_THREAD_H
+
+#include <stddef.h>
+
+struct digest;
+
+/*
+ * Background thread draining an input fd into a bounded ring of buffers and
+ * computing the CRC-32 of everything it reads, so that reading the pipe
+ * overlaps with writing files.  Only one reader can run at a time.  It may
+ * read ahead past the end of the qfile stream, so the fd must not be used
+ * for anything else afterwards.
+ */
+int reader_start(int fd);
+void reader_stop(void);
+/* same semantics as read_all() */
+int reader_read_all(void *buf, size_t size);
+/*
+ * Same semantics as copy_file_hash(), with the input coming from the ring
+ * (and its CRC-32 computed by the thread).
+ */
+int reader_copy(int outfd, long long size, struct digest *digest);
+/* CRC-32 of the data consumed so far */
+unsigned long reader_crc(void);
+
+#endif /* _READER_THREAD_H */
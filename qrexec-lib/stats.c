@@ -0,0 +1,106 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_ENV "QUBES_FILECOPY_STATS"
+
+int stats_enabled;
+static int stats_from_env;
+/* updated from the reader thread too, hence the atomics */
+static struct qfile_stats stats;
+
+static const char *const stat_names[QFILE_STAT_COUNT] = {
+    [QFILE_STAT_READ] = "read",
+    [QFILE_STAT_WRITE] = "write",
+    [QFILE_STAT_CRC] = "crc",
+    [QFILE_STAT_VALIDATE] = "validate",
+    [QFILE_STAT_OPEN_LINK] = "open_link",
+    [QFILE_STAT_METADATA] = "metadata",
+    [QFILE_STAT_WAIT_RESULT] = "wait_result",
+};
+
+void set_collect_stats(int value)
+{
+    stats_enabled = value;
+}
+
+void qfile_get_stats(struct qfile_stats *out)
+{
+    for (int i = 0; i < QFILE_STAT_COUNT; i++) {
+        out->bucket[i].calls = __atomic_load_n(&stats.bucket[i].calls, __ATOMIC_RELAXED);
+        out->bucket[i].bytes = __atomic_load_n(&stats.bucket[i].bytes, __ATOMIC_RELAXED);
+        out->bucket[i].nsec = __atomic_load_n(&stats.bucket[i].nsec, __ATOMIC_RELAXED);
+    }
+}
+
+void qfile_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+const char *qfile_stat_name(enum qfile_stat bucket)
+{
+    if ((unsigned)bucket >= QFILE_STAT_COUNT)
+        return "????????";
+    return stat_names[bucket];
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(enum qfile_stat bucket, uint64_t start, unsigned long long bytes)
+{
+    uint64_t elapsed = stats_now() - start;
+
+    __atomic_fetch_add(&stats.bucket[bucket].calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bucket[bucket].bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bucket[bucket].nsec, elapsed, __ATOMIC_RELAXED);
+}
+
+void stats_start(void)
+{
+    if (!getenv(STATS_ENV))
+        return;
+    stats_from_env = stats_enabled = 1;
+    qfile_reset_stats();
+}
+
+void stats_finish(const char *side)
+{
+    struct qfile_stats s;
+
+    if (!stats_from_env)
+        return;
+    qfile_get_stats(&s);
+    for (int i = 0; i < QFILE_STAT_COUNT; i++)
+        fprintf(stderr, "qfile %s stats: %s calls=%llu bytes=%llu seconds=%.6f\n",
+                side, stat_names[i], s.bucket[i].calls, s.bucket[i].bytes,
+                s.bucket[i].nsec / 1e9);
+}
@@ -0,0 +1,38 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include "libqubes-rpc-filecopy.h"
+
+/*
+ * Timing of the transfer phases, see struct qfile_stats.  Each timed
+ * operation is
+ *
+ *     uint64_t t = stats_begin();
+ *     ...
+ *     stats_end(QFILE_STAT_..., t, bytes);
+ *
+ * which costs a load and a branch when stats are disabled.
+ */
+extern int stats_enabled;
+
+uint64_t stats_now(void);
+void stats_add(enum qfile_stat bucket, uint64_t start, unsigned long long bytes);
+/* enable collection if QUBES_FILECOPY_STATS is set, at the start of a transfer */
+void stats_start(void);
+/* print the stats to stderr if QUBES_FILECOPY_STATS is set */
+void stats_finish(const char *side);
+
+static inline uint64_t stats_begin(void)
+{
+    return stats_enabled ? stats_now() : 0;
+}
+
+static inline void stats_end(enum qfile_stat bucket, uint64_t start,
+        unsigned long long bytes)
+{
+    if (start)
+        stats_add(bucket, start, bytes);
+}
+
+#endif /* _STATS_H */
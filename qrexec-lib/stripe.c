@@ -0,0 +1,513 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libqubes-rpc-filecopy.h"
+#include "ioall.h"
+#include "crc32.h"
+#include "progress.h"
+#include "stripe.h"
+
+/* jobs waiting per stream, on top of the one being copied */
+#define STRIPE_QUEUE 4
+/* how often a thread waiting for the streams reports their progress */
+#define PROGRESS_POLL_NS 50000000L
+
+struct stream {
+    struct stripe_set *set;
+    pthread_t thread;
+    int started;
+    int fd;
+    unsigned long crc;
+    /* jobs[head .. head + count), the first one being worked on */
+    struct stripe_job jobs[STRIPE_QUEUE];
+    int head, count;
+    /* the stream cannot be read any more, so its jobs are dropped */
+    int broken;
+};
+
+struct stripe_set {
+    pthread_mutex_t lock;
+    /* work: a job was queued or the set is finishing; done: a job finished */
+    pthread_cond_t work, done;
+    int sending;
+    int finishing;
+    int count, next;
+    int digesting;
+    struct digest_settings digest;
+    /* data copied by the streams and not passed to progress_add() yet */
+    unsigned long long progress;
+    /* first failure, see stripe_error() */
+    int error, status;
+    char *error_name;
+    struct stream streams[];
+};
+
+/*
+ * Per thread, so that each thread can run its own transfer; the stream
+ * threads get a pointer to their stream in the set.
+ */
+static _Thread_local struct stripe_set *set;
+
+static void job_release(struct stripe_job *job)
+{
+    /* a replacement that did not complete: the old file stays */
+    if (job->temp_name)
+        unlinkat(job->dirfd, job->temp_name, 0);
+    if (job->fd >= 0)
+        close(job->fd);
+    if (job->dirfd >= 0)
+        close(job->dirfd);
+    free(job->name);
+    free(job->temp_name);
+    job->fd = job->dirfd = -1;
+    job->name = job->temp_name = NULL;
+}
+
+/* record the first failure; called with the lock held */
+static void set_failed(struct stripe_set *s, int error, int status, const char *name)
+{
+    if (s->error)
+        return;
+    s->error = error ? error : EIO;
+    s->status = status;
+    s->error_name = name ? strdup(name) : NULL;
+    pthread_cond_broadcast(&s->done);
+}
+
+static void failed(struct stripe_set *s, int error, int status, const char *name)
+{
+    pthread_mutex_lock(&s->lock);
+    set_failed(s, error, status, name);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* cancellation (by stripe_stop()) only while blocked on the streams */
+static ssize_t stream_read(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    do {
+        ret = read(fd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    return ret;
+}
+
+/*
+ * As copy_file(), but the progress is only counted, and reported by the
+ * thread that queued the job.  With a digest, the data is hashed on the way,
+ * and then followed by it.
+ */
+static int copy_job(struct stream *st, struct stripe_job *job)
+{
+    char fallback[4096];
+    uint8_t out[DIGEST_LEN];
+    struct digest d;
+    long long left = job->size;
+    size_t buf_size;
+    char *buf;
+    ssize_t ret;
+
+    buf = get_io_buffer(job->size, &buf_size);
+    if (!buf) {
+        buf = fallback;
+        buf_size = sizeof(fallback);
+    }
+    if (st->set->digesting)
+        digest_init(&d, &st->set->digest);
+    while (left > 0) {
+        ret = read(job->fd, buf, left > (long long)buf_size ? buf_size : (size_t)left);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ret ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF;
+        if (st->set->digesting)
+            digest_update(&d, buf, ret);
+        st->crc = Crc32_ComputeBuf(st->crc, buf, ret);
+        if (!write_all(st->fd, buf, ret))
+            return COPY_FILE_WRITE_ERROR;
+        __atomic_fetch_add(&st->set->progress, ret, __ATOMIC_RELAXED);
+        left -= ret;
+    }
+    if (!st->set->digesting)
+        return COPY_FILE_OK;
+    digest_final(&d, out);
+    st->crc = Crc32_ComputeBuf(st->crc, out, sizeof(out));
+    return write_all(st->fd, out, sizeof(out)) ? COPY_FILE_OK : COPY_FILE_WRITE_ERROR;
+}
+
+static void send_job(struct stream *st, struct stripe_job *job)
+{
+    int ret, saved_errno;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    ret = copy_job(st, job);
+    saved_errno = errno;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (ret != COPY_FILE_OK) {
+        /* the stream is out of step with its jobs now */
+        st->broken = 1;
+        failed(st->set, ret == COPY_FILE_READ_EOF ? EIO : saved_errno, ret, job->name);
+    }
+}
+
+/* the digest after the data of a file; 0 if the stream has failed */
+static int receive_digest(struct stream *st, struct stripe_job *job, uint8_t *untrusted_digest)
+{
+    size_t got = 0;
+    ssize_t ret;
+
+    while (got < DIGEST_LEN) {
+        ret = stream_read(st->fd, untrusted_digest + got, DIGEST_LEN - got);
+        if (ret <= 0) {
+            st->broken = 1;
+            failed(st->set, ret ? errno : LEGAL_EOF,
+                    ret ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF, job->name);
+            return 0;
+        }
+        got += ret;
+    }
+    st->crc = Crc32_ComputeBuf(st->crc, untrusted_digest, DIGEST_LEN);
+    return 1;
+}
+
+/*
+ * The data is read even if writing the file has failed, so the stream stays
+ * usable, and the packer does not get stuck before it learns of the error.
+ * With a digest, the data is hashed as it comes in.
+ */
+static void receive_job(struct stream *st, struct stripe_job *job)
+{
+    char fallback[4096];
+    char fd_str[11];
+    uint8_t untrusted_digest[DIGEST_LEN], digest[DIGEST_LEN];
+    struct digest d;
+    long long left = job->size;
+    size_t buf_size;
+    char *buf;
+    ssize_t ret;
+    int error = 0;
+
+    buf = get_io_buffer(job->size, &buf_size);
+    if (!buf) {
+        buf = fallback;
+        buf_size = sizeof(fallback);
+    }
+    if (st->set->digesting)
+        digest_init(&d, &st->set->digest);
+    while (left > 0) {
+        ret = stream_read(st->fd, buf, left > (long long)buf_size ? buf_size : (size_t)left);
+        if (ret <= 0) {
+            st->broken = 1;
+            failed(st->set, ret ? errno : LEGAL_EOF,
+                    ret ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF, job->name);
+            return;
+        }
+        st->crc = Crc32_ComputeBuf(st->crc, buf, ret);
+        if (st->set->digesting)
+            digest_update(&d, buf, ret);
+        if (!error && !write_all(job->fd, buf, ret))
+            error = errno;
+        __atomic_fetch_add(&st->set->progress, ret, __ATOMIC_RELAXED);
+        left -= ret;
+    }
+    if (st->set->digesting) {
+        if (!receive_digest(st, job, untrusted_digest))
+            return;
+        digest_final(&d, digest);
+        if (!error && !digest_equal(digest, untrusted_digest)) {
+            failed(st->set, EBADMSG, COPY_FILE_READ_ERROR, job->name);
+            return;
+        }
+    }
+    /* the data must be on disk before the file gets its name */
+    if (!error && job->sync && fdatasync(job->fd))
+        error = errno;
+    if (!error && job->procdir_fd >= 0) {
+        if ((unsigned)snprintf(fd_str, sizeof(fd_str), "%d", job->fd) >= sizeof(fd_str))
+            abort();
+        if (linkat(job->procdir_fd, fd_str, job->dirfd,
+                    job->temp_name ? job->temp_name : job->last_segment, AT_SYMLINK_FOLLOW))
+            error = errno;
+    }
+    if (!error && fchmod(job->fd, job->mode & 07777))
+        error = errno;
+    if (!error && futimens(job->fd, job->times))
+        error = errno;
+    if (!error && job->temp_name) {
+        if (renameat(job->dirfd, job->temp_name, job->dirfd, job->last_segment)) {
+            error = errno;
+        } else {
+            free(job->temp_name);
+            job->temp_name = NULL;
+        }
+    }
+    /* and so must its name, if it got it here */
+    if (!error && job->sync && job->dirfd >= 0 && fsync(job->dirfd))
+        error = errno;
+    if (error)
+        failed(st->set, error, COPY_FILE_WRITE_ERROR, job->name);
+}
+
+/* the CRC-32 of everything sent over the stream, at its end */
+static void finish_stream(struct stream *st)
+{
+    uint32_t crc = st->crc, untrusted_crc;
+    int ok;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (st->set->sending)
+        ok = write_all(st->fd, &crc, sizeof(crc));
+    else
+        ok = read_all(st->fd, &untrusted_crc, sizeof(untrusted_crc));
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (!ok)
+        failed(st->set, st->set->sending ? errno : LEGAL_EOF,
+                st->set->sending ? COPY_FILE_WRITE_ERROR : COPY_FILE_READ_EOF, NULL);
+    else if (!st->set->sending && untrusted_crc != crc)
+        failed(st->set, EBADMSG, COPY_FILE_READ_ERROR, NULL);
+}
+
+static void stream_run(struct stream *st)
+{
+    struct stripe_set *s = st->set;
+    struct stripe_job *job;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!st->count && !s->finishing)
+            pthread_cond_wait(&s->work, &s->lock);
+        if (!st->count)
+            break;
+        job = &st->jobs[st->head];
+        pthread_mutex_unlock(&s->lock);
+        if (!st->broken) {
+            if (s->sending)
+                send_job(st, job);
+            else
+                receive_job(st, job);
+        }
+        pthread_mutex_lock(&s->lock);
+        /* under the lock, so that stripe_stop() cannot release it too */
+        job_release(job);
+        st->head = (st->head + 1) % STRIPE_QUEUE;
+        st->count--;
+        pthread_cond_broadcast(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!st->broken && !s->error)
+        finish_stream(st);
+}
+
+static void release_buffer(void *unused)
+{
+    (void)unused;
+    release_io_buffer();
+}
+
+static void *stream_main(void *arg)
+{
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    /* the copy buffer is per thread, and so would outlive it */
+    pthread_cleanup_push(release_buffer, NULL);
+    stream_run(arg);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+int stripe_start(const int *fds, int count, int sending,
+                 const struct digest_settings *digest)
+{
+    sigset_t all, old;
+    int ret = 0;
+
+    pthread_condattr_t attr;
+
+    set = calloc(1, sizeof(*set) + count * sizeof(set->streams[0]));
+    if (!set)
+        return -1;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->work, NULL);
+    /* for wait_done() */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&set->done, &attr);
+    pthread_condattr_destroy(&attr);
+    set->sending = sending;
+    set->count = count;
+    if (digest) {
+        set->digesting = 1;
+        set->digest = *digest;
+    }
+    /* signals are for the caller's thread, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0; i < count && !ret; i++) {
+        set->streams[i].set = set;
+        set->streams[i].fd = fds[i];
+        ret = pthread_create(&set->streams[i].thread, NULL, stream_main, &set->streams[i]);
+        set->streams[i].started = !ret;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret) {
+        stripe_stop();
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+void stripe_progress(void)
+{
+    unsigned long long n = __atomic_exchange_n(&set->progress, 0, __ATOMIC_RELAXED);
+
+    if (n)
+        progress_add(n);
+}
+
+/*
+ * Wait for a job to finish, or for the next progress report; called with
+ * the lock held.  The reports are made without it, so that the streams
+ * are not held up by a slow callback.
+ */
+static void wait_done(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += PROGRESS_POLL_NS;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&set->done, &set->lock, &ts);
+    pthread_mutex_unlock(&set->lock);
+    stripe_progress();
+    pthread_mutex_lock(&set->lock);
+}
+
+int stripe_queue(struct stripe_job *job)
+{
+    struct stream *st = &set->streams[set->next];
+
+    set->next = (set->next + 1) % set->count;
+    pthread_mutex_lock(&set->lock);
+    while (st->count == STRIPE_QUEUE && !set->error)
+        wait_done();
+    if (set->error) {
+        pthread_mutex_unlock(&set->lock);
+        job_release(job);
+        return -1;
+    }
+    st->jobs[(st->head + st->count) % STRIPE_QUEUE] = *job;
+    st->count++;
+    pthread_cond_broadcast(&set->work);
+    pthread_mutex_unlock(&set->lock);
+    return 0;
+}
+
+static int busy(void)
+{
+    for (int i = 0; i < set->count; i++) {
+        if (set->streams[i].count)
+            return 1;
+    }
+    return 0;
+}
+
+int stripe_wait(void)
+{
+    int error;
+
+    pthread_mutex_lock(&set->lock);
+    while (busy() && !set->error)
+        wait_done();
+    error = set->error;
+    pthread_mutex_unlock(&set->lock);
+    stripe_progress();
+    return error ? -1 : 0;
+}
+
+int stripe_finish(void)
+{
+    pthread_mutex_lock(&set->lock);
+    set->finishing = 1;
+    pthread_cond_broadcast(&set->work);
+    while (busy() && !set->error)
+        wait_done();
+    pthread_mutex_unlock(&set->lock);
+    for (int i = 0; i < set->count; i++) {
+        if (set->streams[i].started)
+            pthread_join(set->streams[i].thread, NULL);
+        set->streams[i].started = 0;
+    }
+    stripe_progress();
+    return set->error ? -1 : 0;
+}
+
+void stripe_stop(void)
+{
+    if (!set)
+        return;
+    pthread_mutex_lock(&set->lock);
+    set->finishing = 1;
+    pthread_cond_broadcast(&set->work);
+    pthread_mutex_unlock(&set->lock);
+    /* blocked on a stream at worst, and only there can they be cancelled */
+    for (int i = 0; i < set->count; i++) {
+        if (set->streams[i].started)
+            pthread_cancel(set->streams[i].thread);
+    }
+    for (int i = 0; i < set->count; i++) {
+        struct stream *st = &set->streams[i];
+        if (st->started)
+            pthread_join(st->thread, NULL);
+        for (; st->count; st->count--) {
+            job_release(&st->jobs[st->head]);
+            st->head = (st->head + 1) % STRIPE_QUEUE;
+        }
+    }
+    pthread_mutex_destroy(&set->lock);
+    pthread_cond_destroy(&set->work);
+    pthread_cond_destroy(&set->done);
+    free(set->error_name);
+    free(set);
+    set = NULL;
+}
+
+int stripe_error(int *status, const char **name)
+{
+    *status = set->status;
+    *name = set->error_name;
+    return set->error;
+}
@@ -0,0 +1,76 @@
+#ifndef _STRIPE_H
+#define _STRIPE_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include "digest.h"
+
+/*
+ * With QFILE_FEATURE_STRIPED, the data of large regular files is sent over
+ * extra streams, each with its own thread at both ends, while the headers
+ * and everything else stay on the main stream.  Files go to the streams
+ * round-robin, in the order of their headers, so both ends agree on where
+ * each one is without sending stream numbers.  Only one set of streams can
+ * be running per thread.
+ */
+#define STRIPE_MIN (1 << 20)
+
+struct stripe_job {
+    /* the file, owned by the job: read by the packer, written by the unpacker */
+    int fd;
+    long long size;
+    /* for error reports, owned by the job */
+    char *name;
+    /* unpacker only: what to do once the data is written */
+    int dirfd;                  /* owned; where the file goes, if not -1 */
+    int procdir_fd;             /* linkat() fd into dirfd if not -1 */
+    const char *last_segment;   /* points into name */
+    /*
+     * Owned; if not NULL, the file is linked (or was created) there, and
+     * renamed over last_segment once complete.  Removed if it fails.
+     */
+    char *temp_name;
+    mode_t mode;
+    struct timespec times[2];
+    /* fdatasync() the file before it is linked, and fsync() dirfd after */
+    int sync;
+};
+
+/*
+ * Start a thread per stream; fds stay owned by the caller.  With digest
+ * (QFILE_FEATURE_DIGEST), the data of each file is followed by its digest,
+ * which the unpacker checks against the data it has received.
+ */
+int stripe_start(const int *fds, int count, int sending,
+                 const struct digest_settings *digest);
+/*
+ * Hand the job over to the next stream, waiting while its queue is full.
+ * Returns -1 if any stream has failed (see stripe_error()); the job is
+ * released either way.
+ */
+int stripe_queue(struct stripe_job *job);
+/*
+ * Pass the data the streams have copied since the last call to
+ * progress_add(), in the calling thread.  The waits below do it too.
+ */
+void stripe_progress(void);
+/* wait until all queued jobs are done; -1 if any has failed */
+int stripe_wait(void);
+/*
+ * End the streams with the CRC-32 of their data (packer) or check it
+ * (unpacker), once their jobs are done; -1 if anything has failed.
+ */
+int stripe_finish(void);
+/*
+ * Stop the threads, cancelling those still busy, and release the jobs that
+ * are left.  Also needed after stripe_finish(), which keeps the error.
+ */
+void stripe_stop(void);
+/*
+ * The first failure: an errno value (LEGAL_EOF if a stream ended early),
+ * with the copy_file() status and the name of the file.  0 if none.
+ */
+int stripe_error(int *status, const char **name);
+
+#endif /* _STRIPE_H */
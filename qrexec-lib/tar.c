@@ -0,0 +1,804 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libqubes-rpc-filecopy.h"
+#include "ioall.h"
+#include "tar.h"
+
+/* offsets in a header block */
+#define TAR_NAME 0
+#define TAR_MODE 100
+#define TAR_SIZE 124
+#define TAR_MTIME 136
+#define TAR_CHKSUM 148
+#define TAR_TYPEFLAG 156
+#define TAR_LINKNAME 157
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+/* old GNU sparse members ('S'), and their extension blocks */
+#define TAR_GNU_SPARSE 386
+#define TAR_GNU_ISEXTENDED 482
+#define TAR_GNU_REALSIZE 483
+#define TAR_GNU_EXT_ENTRIES 21
+#define TAR_GNU_EXT_ISEXTENDED 504
+
+/*
+ * Headers are read through a buffer, so that a run of small members costs
+ * a read() or so for all of them, and their data is taken from it too.
+ */
+#define TAR_BUF_SIZE (64 << 10)
+
+/* member data is skipped with lseek(), so its size must be a valid offset */
+#define TAR_SIZE_MAX INT64_MAX
+
+struct tar_reader {
+    int fd;
+    unsigned char *buf;
+    size_t buf_pos, buf_len;
+    unsigned char block[TAR_BLOCK];
+    /* of the current member: data not read yet, and the padding after it */
+    uint64_t data_left;
+    size_t padding;
+    /* for tar_read(): position in the file, and the segment it is in */
+    uint64_t pos, size;
+    size_t segment;
+    /* of the current member's data, for tar_rewind() */
+    uint64_t data_size;
+    char name[MAX_PATH_LENGTH], link[MAX_PATH_LENGTH];
+    char *pax;
+    struct tar_segment *segments;
+    size_t segment_count;
+    /* overrides for the next member, from pax and GNU extension headers */
+    int have_name, have_link, have_size, have_mtime, have_atime;
+    uint64_t pax_size, realsize;
+    int64_t mtime, atime;
+    uint32_t mtime_nsec, atime_nsec;
+    int sparse_major, sparse_minor;
+    int have_map, have_sparse_name;
+    uint64_t sparse_offset;
+};
+
+struct tar_reader *tar_open(int fd)
+{
+    struct tar_reader *r = calloc(1, sizeof(*r));
+
+    if (!r)
+        return NULL;
+    r->fd = fd;
+    r->buf = malloc(TAR_BUF_SIZE);
+    r->pax = malloc(TAR_PAX_MAX + 1);
+    r->segments = malloc(TAR_SPARSE_MAX * sizeof(*r->segments));
+    if (!r->buf || !r->pax || !r->segments) {
+        tar_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void tar_close(struct tar_reader *r)
+{
+    if (!r)
+        return;
+    free(r->buf);
+    free(r->pax);
+    free(r->segments);
+    free(r);
+}
+
+static int read_exact(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (!ret)
+                errno = EINVAL;     /* truncated archive */
+            return -1;
+        }
+        buf = (char *)buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static size_t buffered(const struct tar_reader *r)
+{
+    return r->buf_len - r->buf_pos;
+}
+
+/*
+ * At least len bytes (at most TAR_BUF_SIZE) in the buffer, unless the
+ * archive ends first.  Returns how many there are, or -1.
+ */
+static ssize_t fill(struct tar_reader *r, size_t len)
+{
+    ssize_t ret;
+
+    if (buffered(r) >= len)
+        return buffered(r);
+    memmove(r->buf, r->buf + r->buf_pos, buffered(r));
+    r->buf_len -= r->buf_pos;
+    r->buf_pos = 0;
+    while (r->buf_len < len) {
+        ret = read(r->fd, r->buf + r->buf_len, TAR_BUF_SIZE - r->buf_len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        r->buf_len += ret;
+    }
+    return r->buf_len;
+}
+
+/* the next len bytes of the archive, from the buffer first; NULL dst skips them */
+static int take(struct tar_reader *r, void *dst, uint64_t len)
+{
+    size_t n = buffered(r) < len ? buffered(r) : len, buf_len;
+    char *buf;
+
+    if (dst) {
+        memcpy(dst, r->buf + r->buf_pos, n);
+        dst = (char *)dst + n;
+    }
+    r->buf_pos += n;
+    len -= n;
+    if (dst || !len)
+        return len ? read_exact(r->fd, dst, len) : 0;
+    if (len >= TAR_BUF_SIZE && lseek(r->fd, len, SEEK_CUR) >= 0)
+        return 0;
+    while (len) {
+        if (!(buf = get_io_buffer(len, &buf_len)))
+            return -1;
+        if (buf_len > len)
+            buf_len = len;
+        if (read_exact(r->fd, buf, buf_len))
+            return -1;
+        len -= buf_len;
+    }
+    return 0;
+}
+
+/* octal, or base-256 for values that do not fit */
+static int parse_number(const unsigned char *field, size_t len, uint64_t *value)
+{
+    uint64_t v = 0;
+    size_t i = 0;
+
+    if (field[0] & 0x80) {
+        /* negative values are not valid anywhere we look */
+        if (field[0] & 0x40)
+            return -1;
+        v = field[0] & 0x3f;
+        for (i = 1; i < len; i++) {
+            if (v >> 56)
+                return -1;
+            v = v << 8 | field[i];
+        }
+        *value = v;
+        return 0;
+    }
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (v >> 61)
+            return -1;
+        v = v << 3 | (field[i] - '0');
+    }
+    if (i < len && field[i] != ' ' && field[i] != '\0')
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static int check_header(const unsigned char *block)
+{
+    uint64_t expected;
+    unsigned sum = 0;
+    int signed_sum = 0;
+
+    if (parse_number(block + TAR_CHKSUM, 8, &expected))
+        return -1;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        unsigned char c = i >= TAR_CHKSUM && i < TAR_CHKSUM + 8 ? ' ' : block[i];
+        sum += c;
+        signed_sum += (signed char)c;
+    }
+    /* some old archivers summed signed chars */
+    return expected == sum || (int64_t)expected == signed_sum ? 0 : -1;
+}
+
+/* decimal, with up to nine digits of a fraction for times */
+static int parse_decimal(const char *s, const char *end, uint64_t *value, uint32_t *nsec)
+{
+    uint64_t v = 0;
+    uint32_t frac = 0;
+    int digits = 0;
+
+    if (s == end)
+        return -1;
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+        if (v > (UINT64_MAX - 9) / 10)
+            return -1;
+        v = v * 10 + (*s - '0');
+    }
+    if (nsec && s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++) {
+            if (digits++ < 9)
+                frac = frac * 10 + (*s - '0');
+        }
+        for (; digits < 9; digits++)
+            frac *= 10;
+        *nsec = frac;
+    } else if (nsec) {
+        *nsec = 0;
+    }
+    if (s != end)
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static int parse_time(const char *s, const char *end, int64_t *sec, uint32_t *nsec)
+{
+    uint64_t v;
+
+    /* before 1970 is clamped to it; nobody ships those */
+    if (s < end && *s == '-') {
+        *sec = 0;
+        *nsec = 0;
+        return 0;
+    }
+    if (parse_decimal(s, end, &v, nsec) || v > INT64_MAX)
+        return -1;
+    *sec = v;
+    return 0;
+}
+
+static int copy_string(char *dst, const char *s, const char *end)
+{
+    if ((size_t)(end - s) >= MAX_PATH_LENGTH || memchr(s, '\0', end - s))
+        return -1;
+    memcpy(dst, s, end - s);
+    dst[end - s] = '\0';
+    return 0;
+}
+
+static int add_segment(struct tar_reader *r, uint64_t offset, uint64_t length)
+{
+    if (!length)
+        return 0;
+    if (r->segment_count == TAR_SPARSE_MAX)
+        return -1;
+    r->segments[r->segment_count].offset = offset;
+    r->segments[r->segment_count].length = length;
+    r->segment_count++;
+    return 0;
+}
+
+/* "offset,length,offset,length,..." of GNU.sparse.map (format 0.1) */
+static int parse_map(struct tar_reader *r, const char *s, const char *end)
+{
+    uint64_t offset, length;
+    const char *comma;
+
+    r->segment_count = 0;
+    while (s < end) {
+        if (!(comma = memchr(s, ',', end - s)) || parse_decimal(s, comma, &offset, NULL))
+            return -1;
+        s = comma + 1;
+        comma = memchr(s, ',', end - s);
+        if (!comma)
+            comma = end;
+        if (parse_decimal(s, comma, &length, NULL) || add_segment(r, offset, length))
+            return -1;
+        s = comma < end ? comma + 1 : end;
+    }
+    r->have_map = 1;
+    return 0;
+}
+
+static int parse_pax_record(struct tar_reader *r, const char *key, size_t key_len,
+                            const char *value, const char *end)
+{
+    uint64_t v;
+
+#define KEY(name) (key_len == sizeof(name) - 1 && !memcmp(key, name, key_len))
+    if (KEY("path") || KEY("GNU.sparse.name")) {
+        /* the real name of a sparse member, whatever the order */
+        if (r->have_sparse_name)
+            return 0;
+        if (copy_string(r->name, value, end))
+            return -1;
+        r->have_name = 1;
+        r->have_sparse_name = key[0] == 'G';
+    } else if (KEY("linkpath")) {
+        if (copy_string(r->link, value, end))
+            return -1;
+        r->have_link = 1;
+    } else if (KEY("size")) {
+        if (parse_decimal(value, end, &r->pax_size, NULL))
+            return -1;
+        r->have_size = 1;
+    } else if (KEY("mtime")) {
+        if (parse_time(value, end, &r->mtime, &r->mtime_nsec))
+            return -1;
+        r->have_mtime = 1;
+    } else if (KEY("atime")) {
+        if (parse_time(value, end, &r->atime, &r->atime_nsec))
+            return -1;
+        r->have_atime = 1;
+    } else if (KEY("GNU.sparse.realsize") || KEY("GNU.sparse.size")) {
+        if (parse_decimal(value, end, &r->realsize, NULL))
+            return -1;
+    } else if (KEY("GNU.sparse.major") || KEY("GNU.sparse.minor")) {
+        if (parse_decimal(value, end, &v, NULL) || v > INT_MAX)
+            return -1;
+        *(key[12] == 'a' ? &r->sparse_major : &r->sparse_minor) = v;
+    } else if (KEY("GNU.sparse.offset")) {
+        /* format 0.0: a record per offset and length */
+        if (parse_decimal(value, end, &r->sparse_offset, NULL))
+            return -1;
+    } else if (KEY("GNU.sparse.numbytes")) {
+        if (parse_decimal(value, end, &v, NULL) || add_segment(r, r->sparse_offset, v))
+            return -1;
+        r->have_map = 1;
+    } else if (KEY("GNU.sparse.map")) {
+        if (parse_map(r, value, end))
+            return -1;
+        /* only format 0.1 has the map in the header */
+        if (!r->sparse_major && !r->sparse_minor)
+            r->sparse_minor = 1;
+    }
+#undef KEY
+    /* anything else (owners, ctime, charset, ...) does not matter here */
+    return 0;
+}
+
+/* "<length> <key>=<value>\n" records */
+static int parse_pax(struct tar_reader *r, size_t len)
+{
+    char *p = r->pax, *end = r->pax + len, *space, *eq, *record_end;
+    uint64_t record_len;
+
+    while (p < end) {
+        if (!(space = memchr(p, ' ', end - p)) ||
+                parse_decimal(p, space, &record_len, NULL) ||
+                record_len > (uint64_t)(end - p) || record_len < 2)
+            return -1;
+        record_end = p + record_len - 1;
+        if (*record_end != '\n' || !(eq = memchr(space + 1, '=', record_end - space - 1)))
+            return -1;
+        if (parse_pax_record(r, space + 1, eq - space - 1, eq + 1, record_end))
+            return -1;
+        p = record_end + 1;
+    }
+    return 0;
+}
+
+/*
+ * The map of a sparse member in format 1.0, which starts its data: the
+ * number of segments and then their offsets and lengths, a decimal number
+ * per line, padded to a whole block.
+ */
+static int read_sparse_map(struct tar_reader *r)
+{
+    uint64_t offset = 0, v = 0;
+    size_t i = TAR_BLOCK, wanted = 1, got = 0;
+    int digits = 0;
+
+    r->segment_count = 0;
+    /* got numbers so far: the count, then offsets and lengths in turn */
+    while (got < wanted) {
+        if (i == TAR_BLOCK) {
+            if (r->data_left < TAR_BLOCK || take(r, r->block, TAR_BLOCK))
+                return -1;
+            r->data_left -= TAR_BLOCK;
+            i = 0;
+        }
+        char c = r->block[i++];
+        if (c >= '0' && c <= '9' && v <= (UINT64_MAX - 9) / 10) {
+            v = v * 10 + (c - '0');
+            digits++;
+            continue;
+        }
+        if (c != '\n' || !digits)
+            return -1;
+        if (!got) {
+            if (v > TAR_SPARSE_MAX)
+                return -1;
+            wanted = 1 + 2 * v;
+        } else if (got % 2) {
+            offset = v;
+        } else if (add_segment(r, offset, v)) {
+            return -1;
+        }
+        got++;
+        v = 0;
+        digits = 0;
+    }
+    r->have_map = 1;
+    return 0;
+}
+
+/* segments in order, within the file, adding up to the data in the archive */
+static int check_segments(const struct tar_reader *r)
+{
+    uint64_t end = 0, total = 0;
+
+    for (size_t i = 0; i < r->segment_count; i++) {
+        const struct tar_segment *s = &r->segments[i];
+        if (s->offset < end || s->length > r->size || s->offset > r->size - s->length)
+            return -1;
+        end = s->offset + s->length;
+        total += s->length;
+    }
+    return total == r->data_left ? 0 : -1;
+}
+
+/* old GNU format: four segments in the header, more in extension blocks */
+static int read_gnu_sparse(struct tar_reader *r)
+{
+    const unsigned char *entry = r->block + TAR_GNU_SPARSE;
+    int entries = 4, extended = r->block[TAR_GNU_ISEXTENDED];
+    uint64_t offset, length;
+
+    r->segment_count = 0;
+    if (parse_number(r->block + TAR_GNU_REALSIZE, 12, &r->realsize))
+        return -1;
+    for (;;) {
+        for (int i = 0; i < entries && entry[24 * i]; i++) {
+            if (parse_number(entry + 24 * i, 12, &offset) ||
+                    parse_number(entry + 24 * i + 12, 12, &length) ||
+                    add_segment(r, offset, length))
+                return -1;
+        }
+        if (!extended)
+            break;
+        if (take(r, r->block, TAR_BLOCK))
+            return -1;
+        entry = r->block;
+        entries = TAR_GNU_EXT_ENTRIES;
+        extended = r->block[TAR_GNU_EXT_ISEXTENDED];
+    }
+    r->have_map = 1;
+    return 0;
+}
+
+/* strip "/" and "./" at the start, and "/" at the end */
+static void normalize_name(char *name)
+{
+    size_t len, skip = 0;
+
+    for (;;) {
+        if (name[skip] == '/')
+            skip++;
+        else if (name[skip] == '.' && name[skip + 1] == '/')
+            skip += 2;
+        else
+            break;
+    }
+    len = strlen(name + skip);
+    memmove(name, name + skip, len + 1);
+    while (len && name[len - 1] == '/')
+        name[--len] = '\0';
+    if (!strcmp(name, "."))
+        name[0] = '\0';
+}
+
+/* a header field that is NUL-terminated unless it fills the field */
+static void copy_field(char *dst, const unsigned char *field, size_t len)
+{
+    size_t n = strnlen((const char *)field, len);
+
+    memcpy(dst, field, n);
+    dst[n] = '\0';
+}
+
+/*
+ * The next header block, after the padding of the previous member, which is
+ * read in the same go.  1 if there is one, 0 at the end of the archive.
+ */
+static int read_header(struct tar_reader *r)
+{
+    size_t pad = r->padding;
+    ssize_t ret;
+
+    r->padding = 0;
+    ret = fill(r, pad + TAR_BLOCK);
+    if (ret < 0)
+        return -1;
+    /* EOF right after a member: no end marker, but nothing is missing */
+    if ((size_t)ret == pad)
+        return 0;
+    if ((size_t)ret < pad + TAR_BLOCK) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(r->block, r->buf + r->buf_pos + pad, TAR_BLOCK);
+    r->buf_pos += pad + TAR_BLOCK;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        if (r->block[i])
+            break;
+        if (i == TAR_BLOCK - 1)
+            return 0;
+    }
+    if (check_header(r->block)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/* the data of an extension header, into buf, NUL-terminated */
+static int read_extension(struct tar_reader *r, char *buf, uint64_t size, size_t max)
+{
+    if (size >= max || take(r, buf, size))
+        return -1;
+    buf[size] = '\0';
+    r->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    return 0;
+}
+
+static void start_member(struct tar_reader *r, uint64_t data_size)
+{
+    r->data_left = data_size;
+    r->padding = (TAR_BLOCK - data_size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static int next_member(struct tar_reader *r, struct tar_member *m)
+{
+    uint64_t size, mode, mtime;
+    unsigned char type;
+    int ret;
+
+    r->have_name = r->have_link = r->have_size = r->have_mtime = r->have_atime = 0;
+    r->sparse_major = r->sparse_minor = r->have_map = r->have_sparse_name = 0;
+    r->realsize = 0;
+    r->segment_count = 0;
+    for (;;) {
+        if (take(r, NULL, r->data_left))
+            return -1;
+        r->data_left = 0;
+        if ((ret = read_header(r)) <= 0)
+            return ret;
+        type = r->block[TAR_TYPEFLAG];
+        if (parse_number(r->block + TAR_SIZE, 12, &size) ||
+                size > TAR_SIZE_MAX)
+            goto invalid;
+        switch (type) {
+        case 'x':
+            if (read_extension(r, r->pax, size, TAR_PAX_MAX + 1) ||
+                    parse_pax(r, size))
+                goto invalid;
+            continue;
+        case 'g':
+            /* global defaults: nothing that matters to us */
+            start_member(r, size);
+            continue;
+        case 'L':
+            if (read_extension(r, r->name, size, MAX_PATH_LENGTH))
+                goto invalid;
+            r->have_name = 1;
+            continue;
+        case 'K':
+            if (read_extension(r, r->link, size, MAX_PATH_LENGTH))
+                goto invalid;
+            r->have_link = 1;
+            continue;
+        }
+        break;
+    }
+
+    if (r->have_size)
+        size = r->pax_size;
+    if (size > TAR_SIZE_MAX)
+        goto invalid;
+    if (!r->have_name) {
+        /* the prefix field is only there in POSIX ustar, GNU puts times in it */
+        if (!memcmp(r->block + TAR_MAGIC, "ustar", 6) && r->block[TAR_PREFIX]) {
+            copy_field(r->name, r->block + TAR_PREFIX, 155);
+            strcat(r->name, "/");
+            copy_field(r->name + strlen(r->name), r->block + TAR_NAME, 100);
+        } else {
+            copy_field(r->name, r->block + TAR_NAME, 100);
+        }
+    }
+    if (!r->have_link)
+        copy_field(r->link, r->block + TAR_LINKNAME, 100);
+    if (parse_number(r->block + TAR_MODE, 8, &mode) ||
+            parse_number(r->block + TAR_MTIME, 12, &mtime))
+        goto invalid;
+    if (!r->have_mtime) {
+        r->mtime = mtime > INT64_MAX ? INT64_MAX : (int64_t)mtime;
+        r->mtime_nsec = 0;
+    }
+    if (!r->have_atime) {
+        r->atime = r->mtime;
+        r->atime_nsec = r->mtime_nsec;
+    }
+    normalize_name(r->name);
+
+    memset(m, 0, sizeof(*m));
+    m->name = r->name;
+    m->link = r->link;
+    m->mode = mode & 07777;
+    m->size = size;
+    m->mtime = r->mtime;
+    m->mtime_nsec = r->mtime_nsec;
+    m->atime = r->atime;
+    m->atime_nsec = r->atime_nsec;
+    start_member(r, size);
+    switch (type) {
+    case '1':
+        m->mode |= S_IFREG;
+        m->hardlink = 1;
+        m->size = 0;
+        normalize_name(r->link);
+        break;
+    case '2':
+        m->mode |= S_IFLNK;
+        m->size = 0;
+        break;
+    case '5':
+    case 'D':   /* GNU dumpdir: its data is a listing, which is skipped */
+        m->mode |= S_IFDIR;
+        m->size = 0;
+        break;
+    case '3':
+    case '4':
+    case '6':
+    case 'V':
+    case 'M':
+    case 'N':
+        /* devices, FIFOs, and what multi-volume archives have */
+        m->size = 0;
+        break;
+    case 'S':
+        m->mode |= S_IFREG;
+        if (read_gnu_sparse(r))
+            goto invalid;
+        break;
+    default:
+        /* '0', '7', and as POSIX says, anything unknown */
+        m->mode |= S_IFREG;
+        if (r->sparse_major == 1 && r->sparse_minor == 0 && read_sparse_map(r))
+            goto invalid;
+        break;
+    }
+    if (r->have_map) {
+        m->size = r->size = r->realsize;
+        if (r->realsize > TAR_SIZE_MAX || check_segments(r))
+            goto invalid;
+        m->segments = r->segments;
+        m->segment_count = r->segment_count;
+    } else {
+        r->size = m->size;
+    }
+    r->data_size = r->data_left;
+    r->pos = 0;
+    r->segment = 0;
+    return 1;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+int tar_next(struct tar_reader *r, struct tar_member *m)
+{
+    int ret;
+
+    /* the top directory itself ("." or "./") is left out */
+    while ((ret = next_member(r, m)) > 0 && !m->name[0])
+        ;
+    return ret;
+}
+
+uint64_t tar_data_left(const struct tar_reader *r)
+{
+    return r->data_left;
+}
+
+const void *tar_peek(const struct tar_reader *r, size_t *len)
+{
+    *len = buffered(r) < r->data_left ? buffered(r) : r->data_left;
+    return r->buf + r->buf_pos;
+}
+
+void tar_data_read(struct tar_reader *r, uint64_t len)
+{
+    r->buf_pos += buffered(r) < len ? buffered(r) : len;
+    r->data_left -= len;
+    r->pos += len;
+}
+
+ssize_t tar_read(struct tar_reader *r, void *buf, size_t len)
+{
+    const struct tar_segment *s;
+    uint64_t end = r->size;
+    ssize_t ret;
+
+    if (r->have_map) {
+        while (r->segment < r->segment_count &&
+                r->pos >= r->segments[r->segment].offset + r->segments[r->segment].length)
+            r->segment++;
+        s = r->segment < r->segment_count ? &r->segments[r->segment] : NULL;
+        if (!s || r->pos < s->offset) {
+            /* a hole */
+            end = s ? s->offset : r->size;
+            if (len > end - r->pos)
+                len = end - r->pos;
+            memset(buf, 0, len);
+            r->pos += len;
+            return len;
+        }
+        end = s->offset + s->length;
+    }
+    if (len > end - r->pos)
+        len = end - r->pos;
+    if (!len)
+        return 0;
+    if (buffered(r)) {
+        ret = buffered(r) < len ? buffered(r) : len;
+        memcpy(buf, r->buf + r->buf_pos, ret);
+    } else {
+        do {
+            ret = read(r->fd, buf, len);
+        } while (ret < 0 && errno == EINTR);
+        if (ret == 0) {
+            errno = EINVAL;     /* truncated archive */
+            return -1;
+        }
+    }
+    if (ret > 0)
+        tar_data_read(r, ret);
+    return ret;
+}
+
+int tar_rewind(struct tar_reader *r)
+{
+    off_t cur = lseek(r->fd, 0, SEEK_CUR);
+    /* what was read of the data, and what is buffered past it */
+    uint64_t back = r->data_size - r->data_left + buffered(r);
+
+    if (cur < 0)
+        return -1;
+    if ((uint64_t)cur < back || lseek(r->fd, cur - back, SEEK_SET) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    r->buf_pos = r->buf_len = 0;
+    r->data_left = r->data_size;
+    r->pos = 0;
+    r->segment = 0;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _TAR_H
+#define _TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Streaming reader of tar archives (ustar, with the GNU and pax extensions)
+ * for qfile_pack_tar(), in buffers of a fixed size.  The data of a member
+ * is what the reader has buffered of it (tar_peek()), and then the rest
+ * straight from the archive fd; or tar_read() for sparse members.
+ */
+#define TAR_BLOCK 512
+/* the most a member can carry in pax headers and sparse maps */
+#define TAR_PAX_MAX (64 << 10)
+#define TAR_SPARSE_MAX 4096
+
+struct tar_segment {
+    uint64_t offset, length;
+};
+
+struct tar_member {
+    /* without a leading "/" or "./", or a trailing "/" */
+    const char *name;
+    /* symlink target, or the name of the earlier member for a hardlink */
+    const char *link;
+    /* S_IFREG, S_IFDIR, S_IFLNK, or 0 for anything else; permission bits */
+    mode_t mode;
+    int hardlink;
+    /* of the file, holes included */
+    uint64_t size;
+    int64_t mtime, atime;
+    uint32_t mtime_nsec, atime_nsec;
+    /* data of a sparse member, in order; NULL if it is not sparse */
+    const struct tar_segment *segments;
+    size_t segment_count;
+};
+
+struct tar_reader;
+
+/* the fd stays owned by the caller; NULL on allocation failure */
+struct tar_reader *tar_open(int fd);
+void tar_close(struct tar_reader *r);
+/*
+ * Skip whatever is left of the current member and read the next one, which
+ * stays valid until the next call.  1 if there is one, 0 at the end of the
+ * archive, -1 with errno set (EINVAL if the archive is malformed).
+ */
+int tar_next(struct tar_reader *r, struct tar_member *m);
+/* bytes of the member that are in the archive and were not read yet */
+uint64_t tar_data_left(const struct tar_reader *r);
+/* the start of them that is buffered already, and how much of it */
+const void *tar_peek(const struct tar_reader *r, size_t *len);
+/* the caller used len of them: first what tar_peek() had, then from the fd */
+void tar_data_read(struct tar_reader *r, uint64_t len);
+/*
+ * Read the member as a file, holes as zeros.  Returns the number of bytes
+ * read, 0 at its end, -1 with errno set.
+ */
+ssize_t tar_read(struct tar_reader *r, void *buf, size_t len);
+/*
+ * Go back to the start of the member's data, to read it again.  0 on
+ * success, -1 with errno set (ESPIPE if the archive is not seekable).
+ */
+int tar_rewind(struct tar_reader *r);
+
+#endif /* _TAR_H */
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <stdlib.h>
@@ -18,20 +19,85 @@
 #include "pure.h"
 #include "ioall.h"
 #include "crc32.h"
+#include "uring.h"
+#include "reader-thread.h"
+#include "compress.h"
+#include "progress.h"
+#include "stats.h"
+#include "ctx.h"
+#include "stripe.h"
+#include "delta.h"
+#include "digest.h"
 
-static char untrusted_namebuf[MAX_PATH_LENGTH];
-static unsigned long long bytes_limit = 0;
-static unsigned long long files_limit = 0;
-static unsigned long long total_bytes = 0;
-static unsigned long long total_files = 0;
+static _Thread_local char untrusted_namebuf[MAX_PATH_LENGTH];
+/* set_size_limit(), and the limits of this transfer */
+static unsigned long long opt_bytes_limit = 0;
+static unsigned long long opt_files_limit = 0;
+static _Thread_local unsigned long long bytes_limit = 0;
+static _Thread_local unsigned long long files_limit = 0;
+static _Thread_local unsigned long long total_bytes = 0;
+static _Thread_local unsigned long long total_files = 0;
 static int verbose = 0;
 /*
  * If positive, wait for disk space before extracting a file,
  * keeping this much extra space (in bytes).
  */
 static unsigned long opt_wait_for_space_margin;
-static int use_tmpfile = 0;
+/* give up waiting for space after this many milliseconds, 0 - never */
+static unsigned long opt_wait_for_space_timeout;
+/* preallocate large files even without waiting for space */
+static int opt_preallocate;
+/* cleared for the rest of the transfer if O_TMPFILE turns out not to work */
+static _Thread_local int use_tmpfile = 0;
 static int procdir_fd = -1;
+/* the file or directory being set up, closed if the transfer fails on the way */
+static _Thread_local int file_fd = -1;
+/*
+ * The old version of the file being received as a delta, if not -1, and
+ * the signature of it that was sent, which the records refer to.
+ */
+static _Thread_local int delta_fd = -1;
+static _Thread_local struct delta_signature delta_sig;
+/*
+ * QFILE_FEATURE_UPDATE: an entry that replaces an existing one is created
+ * under a temporary name in the same directory, and renamed over the old
+ * one once it is complete, so that a failed transfer leaves the old one in
+ * place.  The temporary name is removed if the transfer fails first.
+ */
+#define TEMP_NAME_LEN 32
+static unsigned temp_counter;
+static _Thread_local int temp_pending;
+static _Thread_local int temp_dirfd;
+static _Thread_local char temp_name[TEMP_NAME_LEN];
+/* protocol extensions to accept, and the ones in use for this transfer */
+static uint32_t accepted_features = QFILE_UNPACK_FEATURES_DEFAULT;
+static _Thread_local uint32_t features = 0;
+static int use_io_uring = 0;
+static enum qfile_durability durability = QFILE_DURABILITY_FS;
+/* requested with set_threaded_unpack(), and whether the reader is running */
+static int opt_threaded = 0;
+static _Thread_local int threaded = 0;
+/* extra streams for QFILE_FEATURE_STRIPED, and whether their threads run */
+static int stream_fds[QFILE_STREAMS_MAX];
+static int stream_count = 0;
+static _Thread_local int striped = 0;
+/*
+ * QFILE_FEATURE_DIGEST: its settings for this transfer, and the digest of
+ * the file being received.  data_digest points to it while the data coming
+ * in is to be hashed on the way, NULL if the file is read back instead.
+ */
+static _Thread_local struct digest_settings digest_cfg;
+static _Thread_local struct digest file_digest;
+static _Thread_local struct digest *data_digest;
+/*
+ * With QFILE_FEATURE_COMPRESS, the current decompressed frame.  Frames are
+ * decompressed one at a time into a fixed buffer, so untrusted input cannot
+ * make the unpacker use more memory than this.  Limits are applied to the
+ * decompressed data, like they would be without compression.
+ */
+static _Thread_local int decompressing = 0;
+static _Thread_local uint8_t *frame_data, *frame_input;
+static _Thread_local size_t frame_len, frame_pos;
 
 void send_status_and_crc(int code, const char *last_filename);
 
@@ -47,15 +113,39 @@ void send_status_and_crc(int code, const char *last_filename);
 
 static _Noreturn void do_exit(int code, const char *last_filename)
 {
-    close(0);
+    if (temp_pending) {
+        unlinkat(temp_dirfd, temp_name, 0);
+        temp_pending = 0;
+    }
+    /* the input of a *_ctx transfer belongs to the caller */
+    if (!current_ctx)
+        close(0);
     send_status_and_crc(code, last_filename);
-    exit(code);
+    ctx_fail(code, code, last_filename);
+}
+
+/* pick the temporary name in dirfd of an entry that replaces another */
+static const char *start_replace(int dirfd)
+{
+    snprintf(temp_name, sizeof(temp_name), ".qfile-%d-%u", (int)getpid(),
+            __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+    temp_dirfd = dirfd;
+    temp_pending = 1;
+    return temp_name;
+}
+
+/* move the complete entry from its temporary name over the old one */
+static void finish_replace(const char *last_segment, const char *untrusted_name)
+{
+    if (renameat(temp_dirfd, temp_name, temp_dirfd, last_segment))
+        do_exit(errno, untrusted_name);
+    temp_pending = 0;
 }
 
 void set_size_limit(unsigned long long new_bytes_limit, unsigned long long new_files_limit)
 {
-    bytes_limit = new_bytes_limit;
-    files_limit = new_files_limit;
+    opt_bytes_limit = new_bytes_limit;
+    opt_files_limit = new_files_limit;
 }
 
 void set_verbose(int value)
@@ -68,37 +158,217 @@ void set_wait_for_space(unsigned long value)
     opt_wait_for_space_margin = value;
 }
 
+void set_wait_for_space_timeout(unsigned long msec)
+{
+    opt_wait_for_space_timeout = msec;
+}
+
+void set_preallocate(int value)
+{
+    opt_preallocate = value;
+}
+
+void set_durability(enum qfile_durability value)
+{
+    durability = value;
+}
+
 void set_procfs_fd(int value)
 {
     procdir_fd = value;
-    use_tmpfile = 1;
 }
 
-static int wait_for_space(int fd, unsigned long how_much) {
-    int counter = 0;
+void set_unpack_features(uint32_t value)
+{
+    accepted_features = value & QFILE_FEATURES_SUPPORTED;
+}
+
+void set_use_io_uring(int value)
+{
+    use_io_uring = value;
+}
+
+void set_threaded_unpack(int value)
+{
+    opt_threaded = value;
+}
+
+void set_unpack_streams(const int *fds, int count)
+{
+    if (count > QFILE_STREAMS_MAX)
+        count = QFILE_STREAMS_MAX;
+    stream_count = count > 0 ? count : 0;
+    memcpy(stream_fds, fds, stream_count * sizeof(*fds));
+}
+
+/*
+ * With set_preallocate(), files at least this large are preallocated, to
+ * reduce fragmentation and to fail early if they cannot fit.  Smaller ones
+ * are not worth a syscall.
+ */
+#define PREALLOCATE_MIN (1 << 20)
+/* polling interval while waiting for space, doubled up to the maximum */
+#define SPACE_POLL_MIN_USEC 10000
+#define SPACE_POLL_MAX_USEC 1000000
+
+/*
+ * Reserve len bytes for the empty file fd, without changing its size.
+ * Fails with ENOSPC or EDQUOT if they are not available, and with any
+ * other error of fallocate() except those saying it is not supported.
+ */
+static int preallocate(int fd, off_t len)
+{
+    int saved_errno;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len) == 0)
+        return 0;
+    /* not supported by the filesystem: just write the data */
+    if (errno == EOPNOTSUPP || errno == ENOSYS)
+        return 0;
+    if (errno != ENOSPC && errno != EDQUOT)
+        return -1;
+    /* give back what was reserved before the space (or quota) ran out */
+    saved_errno = errno;
+    if (ftruncate(fd, 0))
+        return -1;
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Wait until there is how_much free space, then reserve len bytes of it
+ * for fd.  If the space is taken by someone else in the meantime, or the
+ * quota does not allow it, keep waiting.  Fails with ENOSPC (or EDQUOT if
+ * that was the last reason to wait) after opt_wait_for_space_timeout.
+ */
+static int wait_for_space(int fd, unsigned long long how_much, off_t len)
+{
     struct statvfs fs_space;
-    do {
+    struct timespec start, now;
+    unsigned long delay = SPACE_POLL_MIN_USEC;
+    int reason;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
         if (fstatvfs(fd, &fs_space) == -1) {
             perror("fstatvfs");
             return -1;
         }
-        // TODO: timeout?
-        if (counter > 0)
-            usleep(1000000);
-        counter++;
-    } while (fs_space.f_bsize * fs_space.f_bavail < how_much);
-    return 0;
+        reason = ENOSPC;
+        if ((unsigned long long)fs_space.f_frsize * fs_space.f_bavail >= how_much) {
+            if (len == 0 || preallocate(fd, len) == 0)
+                return 0;
+            if (errno != ENOSPC && errno != EDQUOT)
+                return -1;
+            reason = errno;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (opt_wait_for_space_timeout &&
+                (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >=
+                (long long)opt_wait_for_space_timeout) {
+            errno = reason;
+            return -1;
+        }
+        usleep(delay);
+        if (delay < SPACE_POLL_MAX_USEC / 2)
+            delay *= 2;
+        else
+            delay = SPACE_POLL_MAX_USEC;
+    }
+}
+
+static _Thread_local unsigned long crc32_sum = 0;
+
+/* stdin without the checksum, for compressed frames */
+static int read_input(void *buf, int size)
+{
+    if (threaded)
+        return reader_read_all(buf, size);
+    return read_all(input_fd(), buf, size);
+}
+
+/* make the next frame current; 0 on EOF or read error */
+static int next_frame(void)
+{
+    struct compressed_frame untrusted_frame;
+    long len;
+
+    if (!read_input(&untrusted_frame, sizeof(untrusted_frame)))
+        return 0;
+    if (untrusted_frame.raw_len == 0 || untrusted_frame.raw_len > QFILE_FRAME_MAX ||
+            untrusted_frame.comp_len > COMPRESS_BOUND(QFILE_FRAME_MAX))
+        do_exit(EINVAL, NULL);
+    frame_len = untrusted_frame.raw_len; /* sanitized above */
+    frame_pos = 0;
+    if (untrusted_frame.comp_len == 0)
+        return read_input(frame_data, frame_len);
+    if (!read_input(frame_input, untrusted_frame.comp_len))
+        return 0;
+    len = decompress_block(frame_input, untrusted_frame.comp_len, frame_data, frame_len);
+    if (len < 0 || (size_t)len != frame_len)
+        do_exit(EINVAL, NULL);
+    return 1;
+}
+
+static int read_decompressed(void *buf, size_t size)
+{
+    size_t len;
+
+    while (size > 0) {
+        if (frame_pos == frame_len && !next_frame())
+            return 0;
+        len = frame_len - frame_pos < size ? frame_len - frame_pos : size;
+        memcpy(buf, frame_data + frame_pos, len);
+        crc32_sum = Crc32_ComputeBuf(crc32_sum, buf, len);
+        frame_pos += len;
+        buf = (char *)buf + len;
+        size -= len;
+    }
+    return 1;
+}
+
+static int copy_decompressed(int fdout, unsigned long long size)
+{
+    size_t len;
+
+    while (size > 0) {
+        if (frame_pos == frame_len && !next_frame())
+            return errno ? COPY_FILE_READ_ERROR : COPY_FILE_READ_EOF;
+        len = frame_len - frame_pos < size ? frame_len - frame_pos : size;
+        if (!write_all(fdout, frame_data + frame_pos, len))
+            return COPY_FILE_WRITE_ERROR;
+        crc32_sum = Crc32_ComputeBuf(crc32_sum, frame_data + frame_pos, len);
+        if (data_digest)
+            digest_update(data_digest, frame_data + frame_pos, len);
+        progress_add(len);
+        frame_pos += len;
+        size -= len;
+    }
+    return COPY_FILE_OK;
 }
 
-static unsigned long crc32_sum = 0;
 static int read_all_with_crc(int fd, void *buf, int size) {
     int ret;
+    if (decompressing)
+        return read_decompressed(buf, size);
+    if (threaded)
+        return reader_read_all(buf, size);
     ret = read_all(fd, buf, size);
     if (ret)
         crc32_sum = Crc32_ComputeBuf(crc32_sum, buf, size);
     return ret;
 }
 
+/* file data from stdin, as for read_all_with_crc(), hashed into data_digest */
+static int copy_file_from_input(int fdout, unsigned long long size)
+{
+    if (decompressing)
+        return copy_decompressed(fdout, size);
+    if (threaded)
+        return reader_copy(fdout, size, data_digest);
+    return copy_file_splice_hash(fdout, input_fd(), size, &crc32_sum, data_digest);
+}
+
 void send_status_and_crc(int code, const char *last_filename) {
     struct result_header hdr;
     struct result_header_ext hdr_ext;
@@ -107,24 +377,239 @@ void send_status_and_crc(int code, const char *last_filename) {
     saved_errno = errno;
     hdr.error_code = code;
     hdr._pad = 0;
-    hdr.crc32 = crc32_sum;
-    if (!write_all(1, &hdr, sizeof(hdr)))
+    hdr.crc32 = threaded && !decompressing ? reader_crc() : crc32_sum;
+    if (!write_all(output_fd(), &hdr, sizeof(hdr)))
         perror("write status");
     if (last_filename) {
         hdr_ext.last_namelen = strlen(last_filename);
-        if (!write_all(1, &hdr_ext, sizeof(hdr_ext)))
+        if (!write_all(output_fd(), &hdr_ext, sizeof(hdr_ext)))
             perror("write status ext");
-        if (!write_all(1, last_filename, hdr_ext.last_namelen))
+        if (!write_all(output_fd(), last_filename, hdr_ext.last_namelen))
             perror("write last_filename");
     }
     errno = saved_errno;
 }
 
+#ifdef HAVE_URING
+/*
+ * With io_uring, the syscalls that finish each file - linkat() of the
+ * O_TMPFILE or symlinkat(), then closing the file - are queued and
+ * submitted in batches of URING_BATCH files.  They use the same directory
+ * fds and final path segments as the synchronous code, so the O_NOFOLLOW
+ * guarantees of opendir_safe() still hold.  With QFILE_DURABILITY_FILE, an
+ * fdatasync() is linked in front of the linkat(), so the kernel can write
+ * back the whole batch at once.  The directory fds belong to the directory
+ * cache, which flushes the queue before closing one.  Setting the metadata
+ * of a directory also flushes it first, as a directory can become read-only
+ * and the queued operations would then fail; so does the end of the
+ * transfer.
+ */
+#define URING_BATCH 32
+
+enum {
+    URING_OP_CLOSE,
+    URING_OP_LINK,
+    URING_OP_SYNC,
+};
+
+struct pending_file {
+    char *untrusted_name;   /* for error reporting; last_segment points into it */
+    char *untrusted_target; /* symlink target */
+    char fd_str[11];
+};
+
+static _Thread_local struct uring ring;
+static _Thread_local int ring_state;  /* 0 - not set up yet, 1 - ready, -1 - unavailable */
+static _Thread_local struct pending_file pending[URING_BATCH];
+static _Thread_local unsigned pending_files, pending_sqes;
+
+static int uring_ready(void)
+{
+    static const uint8_t ops[] = {
+        IORING_OP_LINKAT, IORING_OP_SYMLINKAT, IORING_OP_CLOSE, IORING_OP_FSYNC,
+    };
+
+    if (!use_io_uring)
+        return 0;
+    if (ring_state == 0)
+        /* 3 SQEs per file at most */
+        ring_state = uring_init(&ring, 4 * URING_BATCH, ops, sizeof(ops)) ? -1 : 1;
+    return ring_state > 0;
+}
+
+static void uring_flush(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned sqes = pending_sqes, reaped = 0, failed = URING_BATCH, i;
+    int error = 0;
+    uint64_t t;
+
+    if (!sqes)
+        return;
+    /* submitted now, whatever happens next */
+    pending_sqes = 0;
+    t = stats_begin();
+    if (uring_submit_and_wait(&ring, sqes))
+        do_exit(errno, NULL);
+    while (reaped < sqes) {
+        cqe = uring_peek_cqe(&ring);
+        if (!cqe) {
+            if (uring_submit_and_wait(&ring, sqes - reaped))
+                do_exit(errno, NULL);
+            continue;
+        }
+        /*
+         * Report the first file in stream order that failed.  A linkat()
+         * cancelled because the fdatasync() before it failed is not the
+         * cause.
+         */
+        i = cqe->user_data >> 8;
+        if ((cqe->user_data & 0xff) != URING_OP_CLOSE && cqe->res < 0 &&
+                cqe->res != -ECANCELED && i < failed) {
+            failed = i;
+            error = -cqe->res;
+        }
+        uring_cqe_seen(&ring);
+        reaped++;
+    }
+    if (error)
+        do_exit(error, pending[failed].untrusted_name);
+    stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+    for (i = 0; i < pending_files; i++) {
+        free(pending[i].untrusted_name);
+        free(pending[i].untrusted_target);
+    }
+    pending_files = 0;
+}
+
+/*
+ * After a failed *_ctx transfer: let the kernel run (and close) whatever is
+ * queued without waiting for it, and start with a new ring next time.
+ */
+static void uring_abort(void)
+{
+    unsigned i;
+
+    if (ring_state <= 0)
+        return;
+    if (pending_sqes)
+        uring_submit_and_wait(&ring, 0);
+    uring_exit(&ring);
+    ring_state = 0;
+    for (i = 0; i < pending_files; i++) {
+        free(pending[i].untrusted_name);
+        free(pending[i].untrusted_target);
+    }
+    pending_files = pending_sqes = 0;
+}
+
+/* link_flags: IOSQE_IO_LINK or IOSQE_IO_HARDLINK to chain the next SQE */
+static struct io_uring_sqe *uring_queue(unsigned op, unsigned link_flags)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+    assert(sqe); /* space was reserved in uring_pending_file() */
+    sqe->user_data = ((uint64_t)pending_files << 8) | op;
+    sqe->flags |= link_flags;
+    pending_sqes++;
+    return sqe;
+}
+
+/* *last_segment is moved into the copy of the name that outlives the call */
+static struct pending_file *uring_pending_file(const char *untrusted_name,
+        const char **last_segment)
+{
+    struct pending_file *p;
+
+    if (pending_files == URING_BATCH || uring_sq_space(&ring) < 3)
+        uring_flush();
+    p = &pending[pending_files];
+    p->untrusted_target = NULL;
+    if ((p->untrusted_name = strdup(untrusted_name)) == NULL)
+        do_exit(ENOMEM, untrusted_name);
+    *last_segment = p->untrusted_name + (*last_segment - untrusted_name);
+    return p;
+}
+
+static void uring_queue_close(int fd)
+{
+    struct io_uring_sqe *sqe = uring_queue(URING_OP_CLOSE, 0);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
+
+/* link (if needed) and close a fully written file */
+static void uring_finish_file(int fdout, int safe_dirfd,
+        const char *last_segment, const char *untrusted_name)
+{
+    struct pending_file *p = uring_pending_file(untrusted_name, &last_segment);
+    struct io_uring_sqe *sqe;
+
+    if (durability == QFILE_DURABILITY_FILE) {
+        /*
+         * A failed sync cancels the rest of the chain, close included, but
+         * then uring_flush() ends the transfer anyway.
+         */
+        sqe = uring_queue(URING_OP_SYNC, IOSQE_IO_LINK);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fdout;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    if (use_tmpfile) {
+        if ((unsigned)snprintf(p->fd_str, sizeof(p->fd_str), "%d", fdout) >= sizeof(p->fd_str))
+            abort();
+        /* hard link: the close must run even if the link failed */
+        sqe = uring_queue(URING_OP_LINK, IOSQE_IO_HARDLINK);
+        sqe->opcode = IORING_OP_LINKAT;
+        sqe->fd = procdir_fd;
+        sqe->addr = (uintptr_t)p->fd_str;
+        sqe->len = safe_dirfd;
+        sqe->addr2 = (uintptr_t)last_segment;
+        sqe->hardlink_flags = AT_SYMLINK_FOLLOW;
+    }
+    uring_queue_close(fdout);
+    pending_files++;
+}
+
+static void uring_finish_link(int safe_dirfd, const char *last_segment,
+        const char *untrusted_name, const char *untrusted_content)
+{
+    struct pending_file *p = uring_pending_file(untrusted_name, &last_segment);
+    struct io_uring_sqe *sqe;
+
+    if ((p->untrusted_target = strdup(untrusted_content)) == NULL)
+        do_exit(ENOMEM, untrusted_name);
+    sqe = uring_queue(URING_OP_LINK, 0);
+    sqe->opcode = IORING_OP_SYMLINKAT;
+    sqe->fd = safe_dirfd;
+    sqe->addr = (uintptr_t)p->untrusted_target;
+    sqe->addr2 = (uintptr_t)last_segment;
+    pending_files++;
+}
+#else
+static int uring_ready(void) { return 0; }
+static void uring_flush(void) { }
+static void uring_abort(void) { }
+#define uring_finish_file(...) abort()
+#define uring_finish_link(...) abort()
+#endif
+
+static int validate_file_name(const char *untrusted_name, uint32_t flags)
+{
+    uint64_t t = stats_begin();
+    int rc = qubes_pure_validate_file_name_v2((const uint8_t *)untrusted_name, flags);
+
+    stats_end(QFILE_STAT_VALIDATE, t, 0);
+    return rc;
+}
+
 static long validate_utime_nsec(uint32_t untrusted_nsec)
 {
     enum { MAX_NSEC = 999999999L };
-    if (untrusted_nsec > MAX_NSEC)
-        errx(1, "Invalid nanoseconds value %" PRIu32, untrusted_nsec);
+    if (untrusted_nsec > MAX_NSEC) {
+        warnx("Invalid nanoseconds value %" PRIu32, untrusted_nsec);
+        do_exit(EINVAL, NULL);
+    }
     return (long)untrusted_nsec;
 }
 
@@ -143,12 +628,32 @@ static void fix_times_and_perms(const int fd,
             .tv_nsec = validate_utime_nsec(untrusted_hdr->mtime_nsec)
         },
     };
+    uint64_t t = stats_begin();
+
     /* Do not change the mode of symbolic links */
     if (!S_ISLNK(untrusted_hdr->mode) &&
             fchmod(fd, untrusted_hdr->mode & 07777))
         do_exit(errno, untrusted_name);
     if (futimens(fd, times))  /* as above */
         do_exit(errno, untrusted_name);
+    stats_end(QFILE_STAT_METADATA, t, 0);
+}
+
+/* fail the transfer with the error of the stream that failed */
+static _Noreturn void stripe_failed(void)
+{
+    const char *untrusted_name;
+    int status, code;
+
+    code = stripe_error(&status, &untrusted_name);
+    do_exit(code, untrusted_name);
+}
+
+/* wait for the files being received on the extra streams */
+static void stripe_flush(void)
+{
+    if (striped && stripe_wait())
+        stripe_failed();
 }
 
 // Open the second-to-last component of a path, enforcing O_NOFOLLOW for every
@@ -178,33 +683,503 @@ static int opendir_safe(int dirfd, char *path, const char **last_segment)
             abort();
         }
         int new_fd = openat(cur_fd, this_segment, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
-        if (new_fd == -1)
-            do_exit(errno, this_segment);
+        if (new_fd == -1) {
+            int saved_errno = errno;
+            if (cur_fd != dirfd)
+                close(cur_fd);
+            do_exit(saved_errno, this_segment);
+        }
         if (cur_fd != dirfd)
             close(cur_fd);
         cur_fd = new_fd;
     }
 }
 
+/*
+ * Cache of directory fds opened by opendir_safe(), keyed by their path
+ * relative to base_dir_fd(), so that siblings do not have to walk
+ * the whole path again.  Entries are added when a directory is created
+ * (the stream sends its contents next) and on lookups, and dropped with
+ * the directory's second header, after which nothing more is sent inside
+ * it.  A cached fd keeps referring to the directory that was verified
+ * with O_NOFOLLOW, even if the path is changed behind our back later.
+ *
+ * With QFILE_DURABILITY_FILE, a directory that entries were added to is
+ * fsync()ed once, when its fd is dropped, so that the names are as durable
+ * as the data.  The base directory, which is not cached, is synced at the
+ * end of the transfer.
+ */
+#define DIRCACHE_SIZE 32
+
+struct dircache_entry {
+    char *path;     /* NULL if the slot is free */
+    size_t len;
+    int fd;
+    int dirty;      /* entries were added since it was opened */
+    unsigned long last_used;
+};
+
+static _Thread_local struct dircache_entry dircache[DIRCACHE_SIZE];
+static _Thread_local unsigned long dircache_clock;
+static _Thread_local int base_dir_dirty;
+
+static void dircache_drop(struct dircache_entry *e)
+{
+    /* queued operations may refer to the fd */
+    uring_flush();
+    if (e->dirty) {
+        e->dirty = 0;
+        if (fsync(e->fd))
+            do_exit(errno, e->path);
+    }
+    close(e->fd);
+    free(e->path);
+    e->path = NULL;
+}
+
+static void dircache_clear(void)
+{
+    for (int i = 0; i < DIRCACHE_SIZE; i++)
+        if (dircache[i].path)
+            dircache_drop(&dircache[i]);
+}
+
+/* after a failed transfer, nothing is worth syncing */
+static void dircache_abort(void)
+{
+    for (int i = 0; i < DIRCACHE_SIZE; i++)
+        dircache[i].dirty = 0;
+    base_dir_dirty = 0;
+    dircache_clear();
+}
+
+/* an entry is added to dirfd, from open_parent_dir() */
+static void dir_touched(int dirfd)
+{
+    if (durability != QFILE_DURABILITY_FILE)
+        return;
+    if (dirfd == base_dir_fd()) {
+        base_dir_dirty = 1;
+        return;
+    }
+    for (int i = 0; i < DIRCACHE_SIZE; i++) {
+        if (dircache[i].path && dircache[i].fd == dirfd) {
+            dircache[i].dirty = 1;
+            return;
+        }
+    }
+}
+
+/* drop path and everything below it */
+static void dircache_invalidate(const char *path)
+{
+    size_t len = strlen(path);
+
+    for (int i = 0; i < DIRCACHE_SIZE; i++) {
+        struct dircache_entry *e = &dircache[i];
+        if (e->path && e->len >= len && !memcmp(e->path, path, len) &&
+                (e->path[len] == '\0' || e->path[len] == '/'))
+            dircache_drop(e);
+    }
+}
+
+/* longest cached path that is path[0..len) or a parent of it */
+static struct dircache_entry *dircache_lookup(const char *path, size_t len)
+{
+    struct dircache_entry *best = NULL;
+
+    for (int i = 0; i < DIRCACHE_SIZE; i++) {
+        struct dircache_entry *e = &dircache[i];
+        if (e->path && e->len <= len && (!best || e->len > best->len) &&
+                !memcmp(e->path, path, e->len) &&
+                (e->len == len || path[e->len] == '/'))
+            best = e;
+    }
+    if (best)
+        best->last_used = ++dircache_clock;
+    return best;
+}
+
+/* takes ownership of fd */
+static void dircache_insert(const char *path, size_t len, int fd)
+{
+    struct dircache_entry *e = &dircache[0];
+
+    for (int i = 0; i < DIRCACHE_SIZE; i++) {
+        if (!dircache[i].path) {
+            e = &dircache[i];
+            break;
+        }
+        if (dircache[i].last_used < e->last_used)
+            e = &dircache[i];
+    }
+    if (e->path)
+        dircache_drop(e);
+    if ((e->path = strndup(path, len)) == NULL)
+        do_exit(ENOMEM, path);
+    e->len = len;
+    e->fd = fd;
+    e->dirty = 0;
+    e->last_used = ++dircache_clock;
+}
+
+/*
+ * Like opendir_safe(base_dir_fd(), ...), but the path is not modified and the
+ * returned fd belongs to the cache and must not be closed.
+ */
+static int open_parent_dir(const char *untrusted_name, const char **last_segment)
+{
+    const char *slash = strrchr(untrusted_name, '/');
+    struct dircache_entry *e;
+    char rest[MAX_PATH_LENGTH];
+    const char *rest_last;
+    size_t len, skip;
+    int dirfd, parent_fd, fd, saved_errno;
+    uint64_t t;
+
+    if (!slash) {
+        *last_segment = untrusted_name;
+        return base_dir_fd();
+    }
+    *last_segment = slash + 1;
+    len = slash - untrusted_name;
+    e = dircache_lookup(untrusted_name, len);
+    if (e && e->len == len)
+        return e->fd;
+
+    /* walk the rest of the way from the closest cached parent */
+    t = stats_begin();
+    dirfd = e ? e->fd : base_dir_fd();
+    skip = e ? e->len + 1 : 0;
+    memcpy(rest, untrusted_name + skip, len - skip);
+    rest[len - skip] = '\0';
+    parent_fd = opendir_safe(dirfd, rest, &rest_last);
+    fd = openat(parent_fd, rest_last, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    saved_errno = errno;
+    if (parent_fd != dirfd)
+        close(parent_fd);
+    if (fd == -1)
+        do_exit(saved_errno, rest_last);
+    stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+    dircache_insert(untrusted_name, len, fd);
+    return fd;
+}
+
+/*
+ * Receive the segments of a QFILE_MODE_SPARSE file into an empty file.
+ * Holes are skipped over, and the final ftruncate() creates a trailing one.
+ */
+static int copy_file_sparse(int fdout, uint64_t filelen, const char *untrusted_name)
+{
+    struct sparse_segment untrusted_seg;
+    uint64_t offset = 0, length;
+    int ret;
+
+    while (offset < filelen) {
+        if (!read_all_with_crc(input_fd(), &untrusted_seg, sizeof(untrusted_seg)))
+            return COPY_FILE_READ_EOF;
+        if (untrusted_seg.length == 0 || untrusted_seg.length > filelen - offset)
+            do_exit(EINVAL, untrusted_name);
+        length = untrusted_seg.length; /* sanitized above */
+        switch (untrusted_seg.type) {
+        case SPARSE_SEGMENT_DATA:
+            ret = copy_file_from_input(fdout, length);
+            if (ret != COPY_FILE_OK)
+                return ret;
+            break;
+        case SPARSE_SEGMENT_HOLE:
+            if (lseek(fdout, length, SEEK_CUR) < 0)
+                do_exit(errno, untrusted_name);
+            if (data_digest)
+                digest_update_zeros(data_digest, length);
+            break;
+        default:
+            do_exit(EINVAL, untrusted_name);
+        }
+        offset += length;
+    }
+    if (ftruncate(fdout, filelen))
+        do_exit(errno, untrusted_name);
+    return COPY_FILE_OK;
+}
+
+static int write_update_token(uint32_t token)
+{
+    struct result_header hdr = {
+        .error_code = 0,
+        ._pad = token,
+        .crc32 = 0,
+    };
+
+    return write_all(output_fd(), &hdr, sizeof(hdr));
+}
+
+static void send_update_token(uint32_t token)
+{
+    if (!write_update_token(token))
+        do_exit(errno, NULL);
+}
+
+/*
+ * QFILE_FEATURE_DELTA: open the old version of a large regular file, which
+ * the new one is built from, and send its signature.  The old file keeps
+ * its name until the new one replaces it.  0 if the file should be sent
+ * whole instead.
+ */
+static int start_delta(int safe_dirfd, const char *last_segment, const struct stat *st)
+{
+    struct delta_signature sig = {
+        .block_size = delta_block_size(st->st_size),
+        .size = st->st_size,
+    };
+    struct delta_block *blocks;
+    uint64_t count = (sig.size + sig.block_size - 1) / sig.block_size;
+    int fd, ok;
+
+    if (count > QFILE_DELTA_MAX_BLOCKS)
+        return 0;
+    fd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0)
+        return 0;   /* not readable, say */
+    blocks = malloc(count * sizeof(*blocks));
+    if (!blocks || delta_signature(fd, sig.size, sig.block_size, blocks)) {
+        free(blocks);
+        close(fd);
+        return 0;
+    }
+    delta_fd = fd;
+    delta_sig = sig;
+    ok = write_update_token(QFILE_UPDATE_DELTA) &&
+        write_all(output_fd(), &sig, sizeof(sig)) &&
+        write_all(output_fd(), blocks, count * sizeof(*blocks));
+    free(blocks);
+    if (!ok)
+        do_exit(errno, NULL);
+    return 1;
+}
+
+/*
+ * QFILE_FEATURE_UPDATE: whether the file has to be received (QFILE_UPDATE_*),
+ * or the one already there can be kept.  *replace is set if anything else
+ * is in its way (except a directory, which is an error later on), to be
+ * replaced once the new file is complete.  The token is sent here.
+ */
+static uint32_t update_needed(int safe_dirfd, const char *last_segment,
+                              const struct file_header *untrusted_hdr,
+                              const char *untrusted_name, int *replace)
+{
+    struct stat st;
+
+    if (fstatat(safe_dirfd, last_segment, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno != ENOENT)
+            do_exit(errno, untrusted_name);
+        send_update_token(QFILE_UPDATE_SEND);
+        return QFILE_UPDATE_SEND;
+    }
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_size == untrusted_hdr->filelen &&
+            st.st_mtim.tv_sec == (time_t)untrusted_hdr->mtime &&
+            st.st_mtim.tv_nsec == validate_utime_nsec(untrusted_hdr->mtime_nsec) &&
+            (st.st_mode & 07777) == (untrusted_hdr->mode & 07777)) {
+        send_update_token(QFILE_UPDATE_SKIP);
+        return QFILE_UPDATE_SKIP;
+    }
+    *replace = !S_ISDIR(st.st_mode);
+    if ((features & QFILE_FEATURE_DELTA) && S_ISREG(st.st_mode) &&
+            st.st_size >= DELTA_MIN && untrusted_hdr->filelen >= DELTA_MIN &&
+            !(untrusted_hdr->mode & QFILE_MODE_SPARSE) &&
+            start_delta(safe_dirfd, last_segment, &st))
+        return QFILE_UPDATE_DELTA;
+    send_update_token(QFILE_UPDATE_SEND);
+    return QFILE_UPDATE_SEND;
+}
+
+/*
+ * Receive the delta_records of a file, copying blocks from delta_fd, which
+ * is closed afterwards.  The whole file is checked against the CRC-32 at the
+ * end, in case the old file changed since its signature was sent; if it
+ * does not match, or the old file got too short to copy from, the data is
+ * received again in full.
+ */
+static int copy_file_delta(int fdout, uint64_t filelen, const char *untrusted_name)
+{
+    const struct delta_signature sig = delta_sig;
+    struct delta_record untrusted_rec;
+    unsigned long file_crc = 0;
+    uint64_t offset = 0, length, first, count;
+    size_t buf_len, len;
+    char *buf;
+    ssize_t ret;
+    int stale = 0;
+
+    count = (sig.size + sig.block_size - 1) / sig.block_size;
+    while (offset < filelen) {
+        if (!read_all_with_crc(input_fd(), &untrusted_rec, sizeof(untrusted_rec)))
+            return COPY_FILE_READ_EOF;
+        switch (untrusted_rec.type) {
+        case DELTA_RECORD_LITERAL:
+            if (untrusted_rec.value == 0 || untrusted_rec.value > filelen - offset)
+                do_exit(EINVAL, untrusted_name);
+            length = untrusted_rec.value; /* sanitized above */
+            first = 0;
+            break;
+        case DELTA_RECORD_COPY:
+            if (untrusted_rec.count == 0 || untrusted_rec.value >= count ||
+                    untrusted_rec.count > count - untrusted_rec.value)
+                do_exit(EINVAL, untrusted_name);
+            first = untrusted_rec.value * sig.block_size;
+            length = untrusted_rec.count * (uint64_t)sig.block_size;
+            if (first + length > sig.size)
+                length = sig.size - first;  /* ends with the short block */
+            if (length > filelen - offset)
+                do_exit(EINVAL, untrusted_name);
+            break;
+        default:
+            do_exit(EINVAL, untrusted_name);
+        }
+        offset += length;
+        /* nothing to read from the stream for blocks that cannot be copied */
+        if (stale && untrusted_rec.type == DELTA_RECORD_COPY)
+            continue;
+        while (length) {
+            if (!(buf = get_io_buffer(length, &buf_len)))
+                do_exit(ENOMEM, untrusted_name);
+            len = length < buf_len ? length : buf_len;
+            if (untrusted_rec.type == DELTA_RECORD_LITERAL) {
+                if (!read_all_with_crc(input_fd(), buf, len))
+                    return COPY_FILE_READ_EOF;
+            } else {
+                ret = pread(delta_fd, buf, len, first);
+                if (ret != (ssize_t)len) {
+                    /* cut short since the signature was sent, or unreadable */
+                    stale = 1;
+                    break;
+                }
+                first += len;
+            }
+            file_crc = Crc32_ComputeBuf(file_crc, buf, len);
+            if (!write_all(fdout, buf, len))
+                return COPY_FILE_WRITE_ERROR;
+            progress_add(len);
+            length -= len;
+        }
+    }
+    if (!read_all_with_crc(input_fd(), &untrusted_rec, sizeof(untrusted_rec)))
+        return COPY_FILE_READ_EOF;
+    if (untrusted_rec.type != DELTA_RECORD_END)
+        do_exit(EINVAL, untrusted_name);
+    close(delta_fd);
+    delta_fd = -1;
+    if (!stale && untrusted_rec.value == file_crc) {
+        send_update_token(QFILE_UPDATE_SKIP);
+        return COPY_FILE_OK;
+    }
+    if (ftruncate(fdout, 0) || lseek(fdout, 0, SEEK_SET) != 0)
+        do_exit(errno, untrusted_name);
+    send_update_token(QFILE_UPDATE_SEND);
+    return copy_file_from_input(fdout, filelen);
+}
+
+/*
+ * QFILE_FEATURE_DIGEST: compare the digest that follows the data with that
+ * of the data received, or of the file as written if it was built from a
+ * delta, and so from data that did not come over the stream.
+ */
+static void check_digest(int fd, uint64_t filelen, const char *untrusted_name)
+{
+    uint8_t untrusted_digest[QFILE_DIGEST_LEN], digest[QFILE_DIGEST_LEN];
+
+    if (!read_all_with_crc(input_fd(), untrusted_digest, sizeof(untrusted_digest)))
+        do_exit(LEGAL_EOF, untrusted_name); // hopefully remote will produce error message
+    if (data_digest)
+        digest_final(data_digest, digest);
+    else if (digest_file(fd, filelen, &digest_cfg, digest))
+        do_exit(errno, untrusted_name);
+    if (!digest_equal(digest, untrusted_digest))
+        do_exit(EBADMSG, untrusted_name);
+}
+
+/*
+ * QFILE_MODE_STRIPED: the checks are done and the file is open, and the rest
+ * is up to the thread of the stream that has its data.
+ */
+static void queue_striped_file(int fdout, int safe_dirfd, const char *last_segment,
+                               int replace, const struct file_header *untrusted_hdr,
+                               const char *untrusted_name)
+{
+    struct stripe_job job = {
+        .fd = fdout,
+        .size = untrusted_hdr->filelen,
+        .dirfd = -1,
+        .procdir_fd = use_tmpfile ? procdir_fd : -1,
+        .mode = untrusted_hdr->mode,
+        .sync = durability == QFILE_DURABILITY_FILE,
+    };
+
+    job.times[0].tv_sec = untrusted_hdr->atime;
+    job.times[0].tv_nsec = validate_utime_nsec(untrusted_hdr->atime_nsec);
+    job.times[1].tv_sec = untrusted_hdr->mtime;
+    job.times[1].tv_nsec = validate_utime_nsec(untrusted_hdr->mtime_nsec);
+    /* safe_dirfd may be evicted from the cache, or be AT_FDCWD */
+    if (use_tmpfile || replace) {
+        job.dirfd = openat(safe_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (job.dirfd < 0)
+            do_exit(errno, untrusted_name);
+    }
+    if (!(job.name = strdup(untrusted_name)) ||
+            (replace && !(job.temp_name = strdup(temp_name)))) {
+        free(job.name);
+        close(job.dirfd);
+        do_exit(ENOMEM, untrusted_name);
+    }
+    job.last_segment = job.name + (last_segment - untrusted_name);
+    /* the job takes care of the temporary name from now on */
+    temp_pending = 0;
+    file_fd = -1;
+    if (stripe_queue(&job))
+        stripe_failed();
+}
+
 static void process_one_file_reg(struct file_header *untrusted_hdr,
                                  const char *untrusted_name,
                                  uint32_t flags)
 {
     int ret;
     int fdout = -1, safe_dirfd;
-    const char *last_segment;
-    char *path_dup;
+    const char *last_segment, *link_name;
+    off_t prealloc_len = 0;
+    uint32_t token = QFILE_UPDATE_SEND;
+    int replace = 0;
+    int access = O_WRONLY;
+    uint64_t t;
 
-    ret = qubes_pure_validate_file_name_v2((const uint8_t *)untrusted_name, flags);
+    ret = validate_file_name(untrusted_name, flags);
     if (ret != 0)
         do_exit(-ret, untrusted_name); /* FIXME: better error message */
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+    safe_dirfd = open_parent_dir(untrusted_name, &last_segment);
+    if (features & QFILE_FEATURE_UPDATE) {
+        token = update_needed(safe_dirfd, last_segment, untrusted_hdr, untrusted_name,
+                &replace);
+        if (token == QFILE_UPDATE_SKIP)
+            return;
+    }
+    dir_touched(safe_dirfd);
+    /* where the file is linked or created; see temp_name */
+    link_name = replace ? start_replace(safe_dirfd) : last_segment;
+    data_digest = NULL;
+    if (features & QFILE_FEATURE_DIGEST) {
+        /* a file built from a delta is read back to be hashed */
+        if (token == QFILE_UPDATE_DELTA) {
+            access = O_RDWR;
+        } else {
+            digest_init(&file_digest, &digest_cfg);
+            data_digest = &file_digest;
+        }
+    }
 
+    t = stats_begin();
     /* make the file inaccessible until fully written */
     if (use_tmpfile) {
-        fdout = openat(safe_dirfd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC | O_NOCTTY, 0700);
+        fdout = openat(safe_dirfd, ".", access | O_TMPFILE | O_CLOEXEC | O_NOCTTY, 0700);
         if (fdout < 0) {
             if (errno==ENOENT || /* most likely, kernel too old for O_TMPFILE */
                     errno==EOPNOTSUPP) /* filesystem has no support for O_TMPFILE */
@@ -215,21 +1190,43 @@ static void process_one_file_reg(struct file_header *untrusted_hdr,
     }
 
     if (fdout < 0)
-        fdout = openat(safe_dirfd, last_segment, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0000);
+        fdout = openat(safe_dirfd, link_name, access | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0000);
     if (fdout < 0)
         do_exit(errno, untrusted_name);
+    stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+    file_fd = fdout;
 
     /* sizes are signed elsewhere */
     if (untrusted_hdr->filelen > LLONG_MAX || (bytes_limit && untrusted_hdr->filelen > bytes_limit))
         do_exit(EDQUOT, untrusted_name);
     if (bytes_limit && total_bytes > bytes_limit - untrusted_hdr->filelen)
         do_exit(EDQUOT, untrusted_name);
+    /* filling the holes of a sparse file would defeat the point */
+    if (untrusted_hdr->mode & QFILE_MODE_SPARSE)
+        prealloc_len = 0;
+    else if (opt_wait_for_space_margin ||
+            (opt_preallocate && untrusted_hdr->filelen >= PREALLOCATE_MIN))
+        prealloc_len = untrusted_hdr->filelen;
     if (opt_wait_for_space_margin) {
-        wait_for_space(fdout,
-            untrusted_hdr->filelen + opt_wait_for_space_margin);
+        if (wait_for_space(fdout, untrusted_hdr->filelen + opt_wait_for_space_margin,
+                    prealloc_len))
+            do_exit(errno, untrusted_name);
+    } else if (prealloc_len && preallocate(fdout, prealloc_len)) {
+        do_exit(errno, untrusted_name);
     }
+    /* holes are charged too, so the limit still bounds the apparent size */
     total_bytes += untrusted_hdr->filelen;
-    ret = copy_file(fdout, 0, untrusted_hdr->filelen, &crc32_sum);
+    /* a delta comes on the main stream, even for a striped file */
+    if (token == QFILE_UPDATE_DELTA) {
+        ret = copy_file_delta(fdout, untrusted_hdr->filelen, untrusted_name);
+    } else if (untrusted_hdr->mode & QFILE_MODE_STRIPED) {
+        queue_striped_file(fdout, safe_dirfd, last_segment, replace, untrusted_hdr,
+                untrusted_name);
+        return;
+    } else if (untrusted_hdr->mode & QFILE_MODE_SPARSE)
+        ret = copy_file_sparse(fdout, untrusted_hdr->filelen, untrusted_name);
+    else
+        ret = copy_file_from_input(fdout, untrusted_hdr->filelen);
     if (ret != COPY_FILE_OK) {
         if (ret == COPY_FILE_READ_EOF
                 || ret == COPY_FILE_READ_ERROR)
@@ -237,54 +1234,195 @@ static void process_one_file_reg(struct file_header *untrusted_hdr,
         else
             do_exit(errno, untrusted_name);
     }
+    if (features & QFILE_FEATURE_DIGEST)
+        check_digest(fdout, untrusted_hdr->filelen, untrusted_name);
+    if (!replace && uring_ready()) {
+        /* futimens() first, linkat() does not change the mtime */
+        fix_times_and_perms(fdout, untrusted_hdr, untrusted_name);
+        uring_finish_file(fdout, safe_dirfd, last_segment, untrusted_name);
+        file_fd = -1;
+        return;
+    }
+    /* the data must be on disk before the file gets its name */
+    if (durability == QFILE_DURABILITY_FILE && fdatasync(fdout))
+        do_exit(errno, untrusted_name);
     if (use_tmpfile) {
         char fd_str[11];
         if ((unsigned)snprintf(fd_str, sizeof(fd_str), "%d", fdout) >= sizeof(fd_str))
             abort();
-        if (linkat(procdir_fd, fd_str, safe_dirfd, last_segment, AT_SYMLINK_FOLLOW) < 0)
+        t = stats_begin();
+        if (linkat(procdir_fd, fd_str, safe_dirfd, link_name, AT_SYMLINK_FOLLOW) < 0)
             do_exit(errno, untrusted_name);
+        stats_end(QFILE_STAT_OPEN_LINK, t, 0);
     }
     fix_times_and_perms(fdout, untrusted_hdr, untrusted_name);
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
+    if (replace)
+        finish_replace(last_segment, untrusted_name);
+    file_fd = -1;
     close(fdout);
-    free(path_dup);
 }
 
 
+/* set the metadata of a directory whose contents have been received */
+static void finish_dir(const struct file_header *untrusted_hdr,
+                       const char *untrusted_name)
+{
+    const char *last_segment;
+    struct stat buf;
+    int safe_dirfd, new_dirfd;
+
+    /* the directory may become read-only, so finish everything inside */
+    stripe_flush();
+    uring_flush();
+    dircache_invalidate(untrusted_name);
+    safe_dirfd = open_parent_dir(untrusted_name, &last_segment);
+    new_dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
+    if (new_dirfd < 0)
+        do_exit(errno, untrusted_name);
+    file_fd = new_dirfd;
+    if (fstat(new_dirfd, &buf) < 0)
+        do_exit(errno, untrusted_name);
+    total_bytes += buf.st_size;
+    /* size accumulated after the fact, so don't check limit here */
+    fix_times_and_perms(new_dirfd, untrusted_hdr, untrusted_name);
+    file_fd = -1;
+    close(new_dirfd);
+}
+
+/*
+ * With QFILE_FEATURE_DIR_ONCE, the directories created on the way to the
+ * current entry, outermost first.  A directory is finished as soon as a name
+ * outside of it arrives, or at the end of the transfer.  Names were validated
+ * before they were pushed.
+ */
+struct open_dir {
+    struct file_header hdr;
+    char *untrusted_name;
+    size_t len;
+};
+
+static _Thread_local struct open_dir *dir_stack;
+static _Thread_local size_t dir_stack_count, dir_stack_size;
+
+static void dir_stack_push(const struct file_header *untrusted_hdr,
+                           const char *untrusted_name)
+{
+    struct open_dir *d;
+    size_t size;
+
+    if (dir_stack_count == dir_stack_size) {
+        size = dir_stack_size ? dir_stack_size * 2 : 16;
+        if (!(d = realloc(dir_stack, size * sizeof(*dir_stack))))
+            do_exit(ENOMEM, untrusted_name);
+        dir_stack = d;
+        dir_stack_size = size;
+    }
+    d = &dir_stack[dir_stack_count];
+    d->hdr = *untrusted_hdr;
+    if (!(d->untrusted_name = strdup(untrusted_name)))
+        do_exit(ENOMEM, untrusted_name);
+    d->len = strlen(untrusted_name);
+    dir_stack_count++;
+}
+
+/* finish the directories that untrusted_name is not in; "" finishes all */
+static void dir_stack_leave(const char *untrusted_name)
+{
+    struct open_dir *d;
+
+    while (dir_stack_count) {
+        d = &dir_stack[dir_stack_count - 1];
+        if (!strncmp(untrusted_name, d->untrusted_name, d->len) &&
+                untrusted_name[d->len] == '/')
+            return;
+        finish_dir(&d->hdr, d->untrusted_name);
+        free(d->untrusted_name);
+        dir_stack_count--;
+    }
+}
+
+static void dir_stack_clear(void)
+{
+    while (dir_stack_count)
+        free(dir_stack[--dir_stack_count].untrusted_name);
+}
+
+/*
+ * QFILE_FEATURE_DIR_ONCE: a directory that exists already is filled in like
+ * a new one, and gets its metadata when the stream leaves it, as its header
+ * is not sent again.
+ */
+static void enter_existing_dir(int safe_dirfd, const char *last_segment,
+                               const struct file_header *untrusted_hdr,
+                               const char *untrusted_name)
+{
+    struct stat st;
+    int new_dirfd;
+
+    new_dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
+    if (new_dirfd < 0)
+        do_exit(errno, untrusted_name);
+    file_fd = new_dirfd;
+    /* writable for now, like a directory created by mkdirat() above */
+    if (fstat(new_dirfd, &st) ||
+            ((st.st_mode & 0700) != 0700 && fchmod(new_dirfd, (st.st_mode & 07777) | 0700)))
+        do_exit(errno, untrusted_name);
+    file_fd = -1;
+    dircache_insert(untrusted_name, strlen(untrusted_name), new_dirfd);
+    dir_stack_push(untrusted_hdr, untrusted_name);
+}
+
 static void process_one_file_dir(struct file_header *untrusted_hdr,
                                  const char *untrusted_name,
                                  uint32_t flags)
 {
     int safe_dirfd;
     const char *last_segment;
-    char *path_dup;
-    int rc = qubes_pure_validate_file_name_v2((const uint8_t *)untrusted_name, flags);
+    int rc = validate_file_name(untrusted_name, flags);
     if (rc != 0)
         do_exit(rc, untrusted_name); /* FIXME: better error message */
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+    safe_dirfd = open_parent_dir(untrusted_name, &last_segment);
 
     // fix perms only when the directory is sent for the second time
     // it allows to transfer r.x directory contents, as we create it rwx initially
-    struct stat buf;
+    int new_dirfd;
+    uint64_t t = stats_begin();
     if (!mkdirat(safe_dirfd, last_segment, 0700)) {
-        close(safe_dirfd);
+        dir_touched(safe_dirfd);
+        /* its contents come next */
+        new_dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
+        if (new_dirfd < 0)
+            do_exit(errno, untrusted_name);
+        stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+        dircache_insert(untrusted_name, strlen(untrusted_name), new_dirfd);
+        if (features & QFILE_FEATURE_DIR_ONCE)
+            dir_stack_push(untrusted_hdr, untrusted_name);
         return;
     }
     if (errno != EEXIST)
         do_exit(errno, untrusted_name);
-    int new_dirfd = openat(safe_dirfd, last_segment, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_DIRECTORY);
-    if (new_dirfd < 0 || fstat(new_dirfd, &buf) < 0)
-        do_exit(errno, untrusted_name);
-    total_bytes += buf.st_size;
-    /* size accumulated after the fact, so don't check limit here */
-    fix_times_and_perms(new_dirfd, untrusted_hdr, untrusted_name);
-    close(new_dirfd);
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
-    free(path_dup);
+    if (features & QFILE_FEATURE_DIR_ONCE) {
+        enter_existing_dir(safe_dirfd, last_segment, untrusted_hdr, untrusted_name);
+        return;
+    }
+    finish_dir(untrusted_hdr, untrusted_name);
+}
+
+/* QFILE_FEATURE_UPDATE: like update_needed(), for symbolic links */
+static int update_link_needed(int safe_dirfd, const char *last_segment,
+                              const char *untrusted_content, int *replace)
+{
+    char current[MAX_PATH_LENGTH];
+    ssize_t len;
+
+    len = readlinkat(safe_dirfd, last_segment, current, sizeof(current));
+    if (len < 0 && errno == ENOENT)
+        return 1;
+    if (len >= 0 && (size_t)len == strlen(untrusted_content) &&
+            !memcmp(current, untrusted_content, len))
+        return 0;
+    *replace = 1;
+    return 1;
 }
 
 static void process_one_file_link(struct file_header *untrusted_hdr,
@@ -292,10 +1430,9 @@ static void process_one_file_link(struct file_header *untrusted_hdr,
                                   uint32_t flags)
 {
     char untrusted_content[MAX_PATH_LENGTH];
-    const char *last_segment;
-    char *path_dup;
+    const char *last_segment, *link_name;
     unsigned int filelen;
-    int safe_dirfd;
+    int safe_dirfd, replace = 0;
     if (untrusted_hdr->filelen > MAX_PATH_LENGTH - 1)
         do_exit(ENAMETOOLONG, untrusted_name);
 
@@ -303,7 +1440,7 @@ static void process_one_file_link(struct file_header *untrusted_hdr,
     total_bytes += filelen;
     if (bytes_limit && total_bytes > bytes_limit)
         do_exit(EDQUOT, untrusted_name);
-    if (!read_all_with_crc(0, untrusted_content, filelen))
+    if (!read_all_with_crc(input_fd(), untrusted_content, filelen))
         do_exit(LEGAL_EOF, untrusted_name); // hopefully remote has produced error message
     untrusted_content[filelen] = 0;
     /*
@@ -311,22 +1448,93 @@ static void process_one_file_link(struct file_header *untrusted_hdr,
      * Ensure that no immediate subdirectory of ~/QubesIncoming/VMNAME
      * may have symlinks that point out of it.
      */
+    uint64_t t = stats_begin();
     int rc = qubes_pure_validate_symbolic_link_v2((const uint8_t *)untrusted_name,
                                                   (const uint8_t *)untrusted_content,
                                                   flags);
+    stats_end(QFILE_STAT_VALIDATE, t, 0);
     if (rc != 0)
         do_exit(-rc, untrusted_content);
 
-    if ((path_dup = strdup(untrusted_name)) == NULL)
-        do_exit(ENOMEM, untrusted_name);
-    safe_dirfd = opendir_safe(AT_FDCWD, path_dup, &last_segment);
+    safe_dirfd = open_parent_dir(untrusted_name, &last_segment);
+    if ((features & QFILE_FEATURE_UPDATE) &&
+            !update_link_needed(safe_dirfd, last_segment, untrusted_content, &replace))
+        return;
+    dir_touched(safe_dirfd);
 
-    if (symlinkat(untrusted_content, safe_dirfd, last_segment))
+    if (!replace && uring_ready()) {
+        uring_finish_link(safe_dirfd, last_segment, untrusted_name,
+                untrusted_content);
+        return;
+    }
+    link_name = replace ? start_replace(safe_dirfd) : last_segment;
+    t = stats_begin();
+    if (symlinkat(untrusted_content, safe_dirfd, link_name))
         do_exit(errno, untrusted_name);
+    if (replace)
+        finish_replace(last_segment, untrusted_name);
+    stats_end(QFILE_STAT_OPEN_LINK, t, 0);
+}
 
-    if (safe_dirfd != AT_FDCWD)
-        close(safe_dirfd);
-    free(path_dup);
+/*
+ * QFILE_MODE_HARDLINK: another name for a regular file.  The target is
+ * validated like any other name and resolved the same way, so it cannot be
+ * outside of the destination directory either.
+ */
+static void process_one_file_hardlink(struct file_header *untrusted_hdr,
+                                      const char *untrusted_name,
+                                      uint32_t flags)
+{
+    char untrusted_target[MAX_PATH_LENGTH];
+    const char *last_segment, *target_last_segment, *link_name;
+    int safe_dirfd, target_dirfd, replace = 0;
+    unsigned int filelen;
+    struct stat st;
+    uint64_t t;
+    int rc;
+
+    if (untrusted_hdr->filelen > MAX_PATH_LENGTH - 1)
+        do_exit(ENAMETOOLONG, untrusted_name);
+    filelen = untrusted_hdr->filelen; /* sanitized above */
+    if (!read_all_with_crc(input_fd(), untrusted_target, filelen))
+        do_exit(LEGAL_EOF, untrusted_name); // hopefully remote has produced error message
+    untrusted_target[filelen] = 0;
+    rc = validate_file_name(untrusted_name, flags);
+    if (rc != 0)
+        do_exit(-rc, untrusted_name);
+    rc = validate_file_name(untrusted_target, flags);
+    if (rc != 0)
+        do_exit(-rc, untrusted_target);
+
+    /* the target may still be waiting to be linked in */
+    stripe_flush();
+    uring_flush();
+    target_dirfd = open_parent_dir(untrusted_target, &target_last_segment);
+    if (fstatat(target_dirfd, target_last_segment, &st, AT_SYMLINK_NOFOLLOW))
+        do_exit(errno, untrusted_name);
+    if (!S_ISREG(st.st_mode))
+        do_exit(EINVAL, untrusted_name);
+    /* the most recently used entry, so this cannot evict target_dirfd */
+    safe_dirfd = open_parent_dir(untrusted_name, &last_segment);
+    if (features & QFILE_FEATURE_UPDATE) {
+        struct stat current;
+        if (!fstatat(safe_dirfd, last_segment, &current, AT_SYMLINK_NOFOLLOW)) {
+            /* also because rename() does nothing then */
+            if (current.st_dev == st.st_dev && current.st_ino == st.st_ino)
+                return;
+            replace = 1;
+        } else if (errno != ENOENT) {
+            do_exit(errno, untrusted_name);
+        }
+    }
+    dir_touched(safe_dirfd);
+    link_name = replace ? start_replace(safe_dirfd) : last_segment;
+    t = stats_begin();
+    if (linkat(target_dirfd, target_last_segment, safe_dirfd, link_name, 0))
+        do_exit(errno, untrusted_name);
+    if (replace)
+        finish_replace(last_segment, untrusted_name);
+    stats_end(QFILE_STAT_OPEN_LINK, t, 0);
 }
 
 static void process_one_file(struct file_header *untrusted_hdr, int flags)
@@ -340,10 +1548,25 @@ static void process_one_file(struct file_header *untrusted_hdr, int flags)
     uint32_t validate_flags = ((uint32_t)flags >> 2) &
         (QUBES_PURE_ALLOW_UNSAFE_CHARACTERS | QUBES_PURE_ALLOW_UNSAFE_SYMLINKS |
          QUBES_PURE_ALLOW_NON_CANONICAL_SYMLINKS);
-    if (!read_all_with_crc(0, untrusted_namebuf, namelen))
+    if (!read_all_with_crc(input_fd(), untrusted_namebuf, namelen))
         do_exit(LEGAL_EOF, NULL); // hopefully remote has produced error message
     untrusted_namebuf[namelen] = 0;
-    if (S_ISREG(untrusted_hdr->mode))
+    if (features & QFILE_FEATURE_DIR_ONCE)
+        dir_stack_leave(untrusted_namebuf);
+    if ((untrusted_hdr->mode & QFILE_MODE_SPARSE) &&
+            (!(features & QFILE_FEATURE_SPARSE) || !S_ISREG(untrusted_hdr->mode)))
+        do_exit(EINVAL, untrusted_namebuf);
+    if ((untrusted_hdr->mode & QFILE_MODE_HARDLINK) &&
+            (!(features & QFILE_FEATURE_HARDLINK) || !S_ISREG(untrusted_hdr->mode) ||
+             (untrusted_hdr->mode & QFILE_MODE_SPARSE)))
+        do_exit(EINVAL, untrusted_namebuf);
+    if ((untrusted_hdr->mode & QFILE_MODE_STRIPED) &&
+            (!(features & QFILE_FEATURE_STRIPED) || !S_ISREG(untrusted_hdr->mode) ||
+             (untrusted_hdr->mode & (QFILE_MODE_SPARSE | QFILE_MODE_HARDLINK))))
+        do_exit(EINVAL, untrusted_namebuf);
+    if (untrusted_hdr->mode & QFILE_MODE_HARDLINK)
+        process_one_file_hardlink(untrusted_hdr, untrusted_namebuf, validate_flags);
+    else if (S_ISREG(untrusted_hdr->mode))
         process_one_file_reg(untrusted_hdr, untrusted_namebuf, validate_flags);
     else if (S_ISLNK(untrusted_hdr->mode) && (flags & COPY_ALLOW_SYMLINKS))
         process_one_file_link(untrusted_hdr, untrusted_namebuf, validate_flags);
@@ -355,6 +1578,60 @@ static void process_one_file(struct file_header *untrusted_hdr, int flags)
         fprintf(stderr, "%s\n", untrusted_namebuf);
 }
 
+static void negotiate_features(const struct file_header *untrusted_hdr)
+{
+    struct qfile_hello_reply reply = {
+        .magic = QFILE_HELLO_MAGIC,
+        ._pad = 0,
+        .features = untrusted_hdr->filelen & accepted_features,
+    };
+
+    /* existing directories are only handled when they are sent once */
+    if (!(reply.features & QFILE_FEATURE_DIR_ONCE))
+        reply.features &= ~QFILE_FEATURE_UPDATE;
+    if (!(reply.features & QFILE_FEATURE_UPDATE))
+        reply.features &= ~QFILE_FEATURE_DELTA;
+    if (reply.features & QFILE_FEATURE_DIGEST)
+        digest_settings(&digest_cfg);
+    /* the streams must match the packer's one for one */
+    if ((reply.features & QFILE_FEATURE_STRIPED) &&
+            (untrusted_hdr->mode != (uint32_t)stream_count || !stream_count ||
+             stripe_start(stream_fds, stream_count, 0,
+                 reply.features & QFILE_FEATURE_DIGEST ? &digest_cfg : NULL)))
+        reply.features &= ~QFILE_FEATURE_STRIPED;
+    features = reply.features;
+    striped = !!(features & QFILE_FEATURE_STRIPED);
+    if (!write_all(output_fd(), &reply, sizeof(reply)))
+        do_exit(errno, NULL);
+    if (features & QFILE_FEATURE_COMPRESS) {
+        frame_data = malloc(QFILE_FRAME_MAX);
+        frame_input = malloc(COMPRESS_BOUND(QFILE_FRAME_MAX));
+        if (!frame_data || !frame_input)
+            do_exit(ENOMEM, NULL);
+        frame_len = frame_pos = 0;
+        /* the checksum continues over the decompressed stream */
+        if (threaded)
+            crc32_sum = reader_crc();
+        decompressing = 1;
+    }
+}
+
+/*
+ * syncfs() the filesystem of the base directory, or just fsync() the
+ * directory itself; 0 or an errno value.
+ */
+static int sync_base_dir(int whole_fs)
+{
+    int fd, ret;
+
+    fd = openat(base_dir_fd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return errno;
+    ret = (whole_fs ? syncfs(fd) : fsync(fd)) ? errno : 0;
+    close(fd);
+    return ret;
+}
+
 int do_unpack(void) {
     return do_unpack_ext(COPY_ALLOW_DIRECTORIES | COPY_ALLOW_SYMLINKS);
 }
@@ -363,31 +1640,126 @@ int do_unpack_ext(int flags)
 {
     struct file_header untrusted_hdr;
     int end_of_transfer_marker_seen = 0;
-    int cwd_fd;
+    int hello_seen = 0;
     int saved_errno;
 
     total_bytes = total_files = 0;
+    if (current_ctx && current_ctx->size_limit_set) {
+        bytes_limit = current_ctx->bytes_limit;
+        files_limit = current_ctx->files_limit;
+    } else {
+        bytes_limit = opt_bytes_limit;
+        files_limit = opt_files_limit;
+    }
+    use_tmpfile = procdir_fd >= 0;
+    base_dir_dirty = 0;
+    features = 0;
     /* initialize checksum */
     crc32_sum = 0;
-    while (read_all_with_crc(0, &untrusted_hdr, sizeof untrusted_hdr)) {
+    progress_start();
+    stats_start();
+    tune_pipe_size(input_fd());
+    tune_pipe_size(output_fd());
+    /* without the thread, just read stdin directly */
+    threaded = opt_threaded && reader_start(input_fd());
+    while (read_all_with_crc(input_fd(), &untrusted_hdr, sizeof untrusted_hdr)) {
         if (untrusted_hdr.namelen == 0) {
             end_of_transfer_marker_seen = 1;
+            dir_stack_leave("");
+            if (striped && stripe_finish())
+                stripe_failed();
             errno = 0;
             break;
         }
+        if (untrusted_hdr.namelen == QFILE_HELLO_MAGIC && !hello_seen &&
+                total_files == 0) {
+            hello_seen = 1;
+            negotiate_features(&untrusted_hdr);
+            continue;
+        }
         total_files++;
         if (files_limit && total_files > files_limit)
             do_exit(EDQUOT, untrusted_namebuf);
         process_one_file(&untrusted_hdr, flags);
+        if (striped)
+            stripe_progress();
+        progress_file_done();
+    }
+    saved_errno = errno;
+    dir_stack_clear();
+    uring_flush();
+    dircache_clear();
+    if (striped) {
+        stripe_stop();
+        striped = 0;
     }
+    errno = saved_errno;
     if (!end_of_transfer_marker_seen && !errno)
         errno = EREMOTEIO;
 
-    saved_errno = errno;
-    cwd_fd = open(".", O_RDONLY);
-    if (cwd_fd >= 0 && syncfs(cwd_fd) == 0 && close(cwd_fd) == 0)
-        errno = saved_errno;
+    if (durability == QFILE_DURABILITY_FS ||
+            (durability == QFILE_DURABILITY_FILE && base_dir_dirty)) {
+        saved_errno = sync_base_dir(durability == QFILE_DURABILITY_FS);
+        if (saved_errno && !errno)
+            errno = saved_errno;
+        base_dir_dirty = 0;
+    }
 
     send_status_and_crc(errno, untrusted_namebuf);
+    saved_errno = errno;
+    progress_finish();
+    stats_finish("unpack");
+    if (threaded) {
+        reader_stop();
+        threaded = 0;
+    }
+    decompressing = 0;
+    free(frame_data);
+    free(frame_input);
+    frame_data = frame_input = NULL;
+    errno = saved_errno;
     return errno;
 }
+
+int do_unpack_ext_ctx(struct qfile_ctx *ctx, int flags)
+{
+    if (setjmp(ctx->fail)) {
+        /* the status was sent already, clean up for the next transfer */
+        dir_stack_clear();
+        uring_abort();
+        dircache_abort();
+        if (striped) {
+            stripe_stop();
+            striped = 0;
+        }
+        if (file_fd >= 0) {
+            close(file_fd);
+            file_fd = -1;
+        }
+        if (delta_fd >= 0) {
+            close(delta_fd);
+            delta_fd = -1;
+        }
+        if (threaded) {
+            reader_stop();
+            threaded = 0;
+        }
+        decompressing = 0;
+        free(frame_data);
+        free(frame_input);
+        frame_data = frame_input = NULL;
+        release_splice_pipe();
+        release_io_buffer();
+        ctx_leave();
+        return ctx->error;
+    }
+    ctx_enter(ctx);
+    ctx->error = do_unpack_ext(flags);
+    if (ctx->error)
+        snprintf(ctx->message, sizeof(ctx->message), "%s", untrusted_namebuf);
+    /* the thread may never run another transfer */
+    release_splice_pipe();
+    release_io_buffer();
+    ctx_leave();
+    return ctx->error;
+}
@@ -0,0 +1,187 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+static int probe_ops(int fd, const uint8_t *ops, size_t nops)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ret = 0;
+
+    if (!probe)
+        return 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ret = 1;
+        for (size_t i = 0; i < nops; i++) {
+            if (ops[i] > probe->last_op ||
+                    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                ret = 0;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+int uring_init(struct uring *ring, unsigned entries, const uint8_t *ops, size_t nops)
+{
+    struct io_uring_params p;
+    size_t sqes_size;
+    int saved_errno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;  /* ENOSYS, or disabled with kernel.io_uring_disabled */
+    if (!probe_ops(ring->fd, ops, nops)) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    saved_errno = errno;
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    errno = saved_errno;
+fail_sq:
+    saved_errno = errno;
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    errno = saved_errno;
+fail:
+    saved_errno = errno;
+    close(ring->fd);
+    errno = saved_errno;
+    return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+unsigned uring_sq_space(const struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - (*ring->sq_tail + ring->to_submit - head);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (!uring_sq_space(ring))
+        return NULL;
+    index = (*ring->sq_tail + ring->to_submit) & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->to_submit++;
+    return sqe;
+}
+
+/*
+ * The wait may be cut short by a signal after the SQEs were submitted, so
+ * callers must be prepared to find fewer than wait_nr completions.
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+    unsigned submit;
+    int ret;
+
+    /* publish the new SQEs before the kernel can see the tail */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+    do {
+        /* including anything not consumed by an interrupted call */
+        submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+                wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_URING */
@@ -0,0 +1,47 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/version.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls, enough for unpack.c to
+ * batch the syscalls that finish each file.  LINKAT and SYMLINKAT need the
+ * 5.15 uapi headers.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    /* SQEs queued but not yet handed to the kernel */
+    unsigned to_submit;
+};
+
+/*
+ * Set up a ring with room for the given number of SQEs.  Fails (returns -1)
+ * unless the kernel supports all of the nops opcodes in ops.
+ */
+int uring_init(struct uring *ring, unsigned entries, const uint8_t *ops, size_t nops);
+void uring_exit(struct uring *ring);
+/* free SQE slots, for checking before queuing a chain */
+unsigned uring_sq_space(const struct uring *ring);
+/* next free SQE, zeroed; NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+/* submit everything queued and wait for at least wait_nr completions */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+/* next completion, or NULL if there is none; release with uring_cqe_seen() */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+#endif
+
+#endif /* _URING_H */
@@ -0,0 +1,378 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "walk.h"
+
+#define DENTS_BUF_SIZE 32768
+/* entries stat'ed ahead of the walk, per directory */
+#define STAT_WINDOW 128
+/* entries a stat thread takes at once */
+#define CLAIM_BATCH 8
+/* how much of each file to prefetch; the rest is left to normal readahead */
+#define READAHEAD_BYTES (2 << 20)
+
+enum { SLOT_FREE, SLOT_BUSY, SLOT_DONE };
+
+struct stat_slot {
+    int state;
+    int error;
+    struct stat st;
+};
+
+struct walk_dir {
+    int fd;
+    /* the names, each NUL-terminated, at offsets[0..count) */
+    char *names;
+    size_t *offsets;
+    size_t count;
+    /*
+     * With stat threads: entry i is in slots[i % STAT_WINDOW] once it is in
+     * [next, next + STAT_WINDOW); next is the entry the walk asks for next,
+     * and claimed is where the threads continue.  Protected by pool.lock.
+     */
+    struct stat_slot *slots;
+    size_t next, claimed;
+    /* the directory this one was opened from */
+    struct walk_dir *parent;
+};
+
+/*
+ * Per thread, so that each thread can run its own walk; the stat threads get
+ * a pointer to the instance of the thread that started them.
+ */
+struct stat_pool {
+    pthread_mutex_t lock;
+    /* work: a directory was opened or a window moved; done: a slot finished */
+    pthread_cond_t work, done;
+    pthread_t *threads;
+    int nthreads;
+    int stopping;
+    /* how far ahead of the walk the threads go, and whether they prefetch */
+    size_t window;
+    int readahead;
+    /* the innermost open directory, whose entries are needed first */
+    struct walk_dir *top;
+};
+
+static _Thread_local struct stat_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static int list_dir(struct walk_dir *dir)
+{
+    size_t names_used = 0, names_size = 0, offsets_size = 0, len;
+    char *buf, *names;
+    size_t *offsets;
+    ssize_t ret, pos;
+    struct dirent64 *ent;
+
+    buf = malloc(DENTS_BUF_SIZE);
+    if (!buf)
+        return -1;
+    while ((ret = getdents64(dir->fd, buf, DENTS_BUF_SIZE)) > 0) {
+        for (pos = 0; pos < ret; pos += ent->d_reclen) {
+            ent = (struct dirent64 *)(buf + pos);
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            len = strlen(ent->d_name) + 1;
+            if (names_used + len > names_size) {
+                names_size = names_size ? names_size * 2 : 4096;
+                if (names_size < names_used + len)
+                    names_size = names_used + len;
+                if (!(names = realloc(dir->names, names_size)))
+                    goto fail;
+                dir->names = names;
+            }
+            if (dir->count == offsets_size) {
+                offsets_size = offsets_size ? offsets_size * 2 : 64;
+                if (!(offsets = realloc(dir->offsets, offsets_size * sizeof(*offsets))))
+                    goto fail;
+                dir->offsets = offsets;
+            }
+            memcpy(dir->names + names_used, ent->d_name, len);
+            dir->offsets[dir->count++] = names_used;
+            names_used += len;
+        }
+    }
+    if (ret < 0)
+        goto fail;
+    free(buf);
+    return 0;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+struct walk_dir *walk_dir_open(int dirfd)
+{
+    struct walk_dir *dir;
+    int saved_errno;
+
+    dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        close(dirfd);
+        return NULL;
+    }
+    dir->fd = dirfd;
+    if (list_dir(dir))
+        goto fail;
+    if (pool.nthreads && dir->count) {
+        dir->slots = calloc(dir->count < STAT_WINDOW ? dir->count : STAT_WINDOW,
+                sizeof(*dir->slots));
+        if (!dir->slots)
+            goto fail;
+    }
+    /* all open directories are listed, for walk_abort() */
+    pthread_mutex_lock(&pool.lock);
+    dir->parent = pool.top;
+    pool.top = dir;
+    if (dir->slots)
+        pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    return dir;
+
+fail:
+    saved_errno = errno;
+    close(dir->fd);
+    free(dir->names);
+    free(dir->offsets);
+    free(dir);
+    errno = saved_errno;
+    return NULL;
+}
+
+void walk_dir_close(struct walk_dir *dir)
+{
+    struct walk_dir **p;
+    size_t i, window;
+
+    pthread_mutex_lock(&pool.lock);
+    if (dir->slots) {
+        window = dir->count < STAT_WINDOW ? dir->count : STAT_WINDOW;
+        /* a thread may still be in fstatat() if the walk stopped early */
+        for (i = 0; i < window; i++)
+            while (dir->slots[i].state == SLOT_BUSY)
+                pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    for (p = &pool.top; *p != dir; p = &(*p)->parent)
+        ;
+    *p = dir->parent;
+    pthread_mutex_unlock(&pool.lock);
+    free(dir->slots);
+    close(dir->fd);
+    free(dir->names);
+    free(dir->offsets);
+    free(dir);
+}
+
+int walk_dir_fd(const struct walk_dir *dir)
+{
+    return dir->fd;
+}
+
+size_t walk_dir_count(const struct walk_dir *dir)
+{
+    return dir->count;
+}
+
+const char *walk_dir_name(const struct walk_dir *dir, size_t i)
+{
+    return dir->names + dir->offsets[i];
+}
+
+static int stat_entry(const struct walk_dir *dir, size_t i, struct stat *st)
+{
+    return fstatat(dir->fd, walk_dir_name(dir, i), st, AT_SYMLINK_NOFOLLOW) ? errno : 0;
+}
+
+int walk_dir_stat(struct walk_dir *dir, size_t i, struct stat *st)
+{
+    struct stat_slot *slot;
+    int error;
+
+    if (!dir->slots) {
+        if (stat_entry(dir, i, st))
+            return -1;
+        return 0;
+    }
+    slot = &dir->slots[i % STAT_WINDOW];
+    pthread_mutex_lock(&pool.lock);
+    if (slot->state == SLOT_FREE) {
+        /* the threads are behind (or busy elsewhere), don't wait for them */
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&pool.lock);
+        error = stat_entry(dir, i, &slot->st);
+        pthread_mutex_lock(&pool.lock);
+        slot->error = error;
+        slot->state = SLOT_DONE;
+    }
+    while (slot->state == SLOT_BUSY)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    *st = slot->st;
+    error = slot->error;
+    slot->state = SLOT_FREE;
+    dir->next = i + 1;
+    /* wake a thread once there is a batch of room, not for every entry */
+    if (dir->next % CLAIM_BATCH == 0 && dir->next + pool.window <= dir->count)
+        pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* claim up to CLAIM_BATCH entries of one directory; called with the lock held */
+static struct walk_dir *claim(struct stat_pool *pl, size_t *first, size_t *count)
+{
+    struct walk_dir *dir;
+    size_t i, end;
+
+    for (dir = pl->top; dir; dir = dir->parent) {
+        if (!dir->slots)
+            continue;
+        i = dir->claimed > dir->next ? dir->claimed : dir->next;
+        end = dir->next + pl->window;
+        if (end > dir->count)
+            end = dir->count;
+        while (i < end && dir->slots[i % STAT_WINDOW].state != SLOT_FREE)
+            i++;
+        if (i == end)
+            continue;
+        *first = i;
+        for (*count = 0; *count < CLAIM_BATCH && i < end &&
+                dir->slots[i % STAT_WINDOW].state == SLOT_FREE; i++, (*count)++)
+            dir->slots[i % STAT_WINDOW].state = SLOT_BUSY;
+        dir->claimed = i;
+        return dir;
+    }
+    return NULL;
+}
+
+/*
+ * Start reading a regular file into the page cache without waiting for it,
+ * so that the disk is busy while the walk sends the files before it.  The
+ * open may block on a cold inode, which is why it is done here.  Nothing
+ * else is opened: opening a device or a FIFO could have side effects.
+ */
+static void prefetch_entry(const struct walk_dir *dir, size_t i, const struct stat *st)
+{
+    int fd;
+
+    fd = openat(dir->fd, walk_dir_name(dir, i),
+            O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, st->st_size < READAHEAD_BYTES ? st->st_size : READAHEAD_BYTES,
+            POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void *stat_main(void *arg)
+{
+    struct stat_pool *pl = arg;
+    struct walk_dir *dir;
+    struct stat_slot *slot;
+    size_t first, count, i;
+    int error;
+
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->stopping) {
+        if (!(dir = claim(pl, &first, &count))) {
+            pthread_cond_wait(&pl->work, &pl->lock);
+            continue;
+        }
+        /* the directory stays open while any of its slots is busy */
+        pthread_mutex_unlock(&pl->lock);
+        for (i = first; i < first + count; i++) {
+            slot = &dir->slots[i % STAT_WINDOW];
+            error = stat_entry(dir, i, &slot->st);
+            if (!error && pl->readahead && S_ISREG(slot->st.st_mode))
+                prefetch_entry(dir, i, &slot->st);
+            pthread_mutex_lock(&pl->lock);
+            slot->error = error;
+            slot->state = SLOT_DONE;
+            pthread_cond_broadcast(&pl->done);
+            pthread_mutex_unlock(&pl->lock);
+        }
+        pthread_mutex_lock(&pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+int walk_start(int threads, int readahead)
+{
+    pool.readahead = readahead > 0;
+    pool.window = readahead > 0 && readahead < STAT_WINDOW ? (size_t)readahead : STAT_WINDOW;
+    if (readahead > 0 && threads <= 0)
+        threads = 1;
+    if (threads <= 0)
+        return 0;
+    pool.threads = calloc(threads, sizeof(*pool.threads));
+    if (!pool.threads)
+        return -1;
+    pool.stopping = 0;
+    for (pool.nthreads = 0; pool.nthreads < threads; pool.nthreads++) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, stat_main, &pool))
+            break;
+    }
+    if (!pool.nthreads) {
+        free(pool.threads);
+        pool.threads = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void walk_stop(void)
+{
+    if (!pool.nthreads)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.nthreads; i++)
+        pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+}
+
+void walk_abort(void)
+{
+    while (pool.top)
+        walk_dir_close(pool.top);
+    walk_stop();
+}
@@ -0,0 +1,39 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Directory listing for the packer.  A directory is read with getdents64()
+ * in one go, and its entries are then stat'ed relative to its fd, so the
+ * kernel never resolves the path from the top again.  With walk_start(),
+ * threads stat the entries of the open directories ahead of the walk;
+ * walk_dir_stat() still returns them in listing order.  They can also start
+ * reading the regular files they find into the page cache.
+ */
+struct walk_dir;
+
+/* takes over dirfd; NULL (with errno set) on failure */
+struct walk_dir *walk_dir_open(int dirfd);
+void walk_dir_close(struct walk_dir *dir);
+int walk_dir_fd(const struct walk_dir *dir);
+size_t walk_dir_count(const struct walk_dir *dir);
+const char *walk_dir_name(const struct walk_dir *dir, size_t i);
+/*
+ * lstat() of entry i, relative to the directory; each entry must be asked
+ * for exactly once, in order.  Returns 0, or -1 with errno set.
+ */
+int walk_dir_stat(struct walk_dir *dir, size_t i, struct stat *st);
+
+/*
+ * Start or stop the stat threads; with 0 threads everything is synchronous.
+ * With readahead > 0, the threads (at least one) stat at most that many
+ * entries ahead, and prefetch the regular files among them.
+ */
+int walk_start(int threads, int readahead);
+void walk_stop(void);
+/* close everything left open by a walk that was cut short, and stop */
+void walk_abort(void);
+
+#endif /* _WALK_H */